@@ -0,0 +1,512 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <utility>
+#include "lwip/sockets.h"
+#include "ExpanderPinMap.h"
+#include "DigitalService_Expander.h"
+#include "ATTinyLink.h"
+#include "can_gateway.h"
+
+using namespace EmbeddedIOServices;
+
+extern uint32_t mock_gpio_out;
+extern uint32_t mock_gpio_in;
+extern uint32_t mock_gpio_writes;
+
+static int failures = 0;
+#define BENCH_CHECK(condition) do { if(!(condition)) { std::printf("FAIL %s:%d %s\n", __FILE__, __LINE__, #condition); failures++; } } while(0)
+
+//keeps benchmarked results from being optimized away
+static volatile uint32_t sink;
+
+template<typename Body>
+static void Bench(const char *name, uint32_t iterations, Body body)
+{
+	const auto start = std::chrono::steady_clock::now();
+	for(uint32_t i = 0; i < iterations; i++)
+		body(i);
+	const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	std::printf("%-40s %10.1f ns\n", name, ns / iterations);
+}
+
+// the board map is checked at compile time, a broken route fails the build
+constexpr bool ExpanderPinMapValid()
+{
+	for(uint8_t pin = 0; pin < EXPANDER_PIN_COUNT; pin++)
+	{
+		const ExpanderPinRoute &route = ExpanderPinMap[pin];
+		if(route.ATTinyDevice >= EXPANDER_ATTINY_DEVICES)
+			return false;
+		if((route.OutBackend == ExpanderBackend_None) != (route.OutPin == EXPANDER_PIN_NONE))
+			return false;
+		if((route.InBackend == ExpanderBackend_None) != (route.InPin == EXPANDER_PIN_NONE))
+			return false;
+		if(route.OutBackend == ExpanderBackend_Esp32 && route.OutPin >= 32)
+			return false;
+		if(route.InBackend == ExpanderBackend_Esp32 && route.InPin >= 32)
+			return false;
+		if(route.Pwm && route.OutBackend == ExpanderBackend_None)
+			return false;
+		if(route.BridgePin != EXPANDER_PIN_NONE && route.SensePin == EXPANDER_PIN_NONE)
+			return false;
+	}
+	return true;
+}
+static_assert(ExpanderPinMapValid(), "ExpanderPinMap has an inconsistent route");
+static_assert((ExpanderPinMaskEsp32Out & ExpanderPinMaskATTinyOut) == 0, "a pin is driven by two backends");
+static_assert((ExpanderPinMaskEsp32In & ExpanderPinMaskATTinyIn) == 0, "a pin is read from two backends");
+
+// every expander service starts from unclaimed pins and idle mocks
+struct DigitalFixture
+{
+	Esp32::Esp32IdfDigitalService Esp32;
+	DigitalService_ATTiny427Expander ATTiny[EXPANDER_ATTINY_DEVICES];
+	DigitalService_ATTiny427Expander *ATTinyServices[EXPANDER_ATTINY_DEVICES];
+	DigitalService_Expander Expander;
+
+	DigitalFixture() : Expander(&Esp32, Reset())
+	{
+	}
+
+	DigitalService_ATTiny427Expander *const *Reset()
+	{
+		for(uint8_t pin = 0; pin < EXPANDER_PIN_COUNT; pin++)
+			ExpanderPinStates[pin] = {};
+		for(uint8_t device = 0; device < EXPANDER_ATTINY_DEVICES; device++)
+			ATTinyServices[device] = &ATTiny[device];
+		mock_gpio_out = 0;
+		mock_gpio_in = 0;
+		return ATTinyServices;
+	}
+
+	void InitOutputs()
+	{
+		for(uint8_t pin = 0; pin < EXPANDER_PIN_COUNT; pin++)
+			if(ExpanderPinMap[pin].OutBackend != ExpanderBackend_None)
+				Expander.InitPin(pin, Out);
+	}
+
+	// level the backend drives for pin, board inversion included
+	bool Driven(uint8_t pin)
+	{
+		const ExpanderPinRoute &route = ExpanderPinMap[pin];
+		const bool level = route.OutBackend == ExpanderBackend_Esp32?
+			(mock_gpio_out >> route.OutPin) & 1 :
+			(ATTiny[route.ATTinyDevice].PortOut >> route.OutPin) & 1;
+		return level != route.OutInverted;
+	}
+
+	// raw level on every backend output, to compare two ways of writing the same values
+	void Outputs(uint32_t *outputs)
+	{
+		outputs[0] = mock_gpio_out;
+		for(uint8_t device = 0; device < EXPANDER_ATTINY_DEVICES; device++)
+			outputs[1 + device] = ATTiny[device].PortOut;
+	}
+
+	void SetInputs(uint32_t levels)
+	{
+		mock_gpio_in = levels;
+		for(uint8_t device = 0; device < EXPANDER_ATTINY_DEVICES; device++)
+			ATTiny[device].PortIn = levels ^ device;
+	}
+	bool Expected(uint8_t pin)
+	{
+		const ExpanderPinRoute &route = ExpanderPinMap[pin];
+		if(route.InBackend == ExpanderBackend_Esp32)
+			return (mock_gpio_in >> route.InPin) & 1;
+		if(route.InBackend == ExpanderBackend_ATTiny)
+			return (ATTiny[route.ATTinyDevice].PortIn >> route.InPin) & 1;
+		return false;
+	}
+};
+
+template<digitalpin_t pin>
+static void CheckCompileTimeWrite(DigitalFixture &fixture, bool value)
+{
+	if constexpr (ExpanderPinMap[pin].OutBackend != ExpanderBackend_None)
+	{
+		fixture.Expander.WritePin<pin>(value);
+		BENCH_CHECK(fixture.Driven(pin) == value);
+	}
+	BENCH_CHECK(fixture.Expander.ReadPin<pin>() == fixture.Expected(pin));
+}
+template<digitalpin_t... pins>
+static void CheckCompileTimeRoutes(DigitalFixture &fixture, std::integer_sequence<digitalpin_t, pins...>)
+{
+	for(const bool value : { false, true })
+		(CheckCompileTimeWrite<pins>(fixture, value), ...);
+}
+
+static void TestRouting()
+{
+	DigitalFixture fixture;
+	fixture.InitOutputs();
+
+	for(uint8_t pin = 0; pin < EXPANDER_PIN_COUNT; pin++)
+	{
+		const ExpanderPinRoute &route = ExpanderPinMap[pin];
+		if(route.OutBackend == ExpanderBackend_None)
+			continue;
+		for(const bool value : { false, true })
+		{
+			fixture.Expander.WritePin(pin, value);
+			BENCH_CHECK(fixture.Driven(pin) == value);
+		}
+		if(route.OutBackend == ExpanderBackend_ATTiny)
+			BENCH_CHECK((fixture.ATTiny[route.ATTinyDevice].PortDir >> route.OutPin) & 1);
+		if(route.BridgePin != EXPANDER_PIN_NONE)
+			BENCH_CHECK((fixture.ATTiny[route.ATTinyDevice].PassthroughMask >> route.BridgePin) & 1);
+		if(route.DisableCAN2)
+			BENCH_CHECK((fixture.ATTiny[0].PortDir >> EXPANDER_ATTINY_CAN2_DISABLE_PIN) & 1);
+	}
+
+	//unrouted and out of range pins go nowhere
+	uint32_t before[1 + EXPANDER_ATTINY_DEVICES], after[1 + EXPANDER_ATTINY_DEVICES];
+	fixture.Outputs(before);
+	fixture.Expander.WritePin(0, true);
+	fixture.Expander.WritePin(EXPANDER_PIN_COUNT, true);
+	fixture.Outputs(after);
+	BENCH_CHECK(std::equal(before, before + 1 + EXPANDER_ATTINY_DEVICES, after));
+	BENCH_CHECK(!fixture.Expander.ReadPin(EXPANDER_PIN_COUNT));
+
+	for(const uint32_t levels : { 0xA5A5A5A5UL, 0x5A5A5A5AUL, 0UL, 0xFFFFFFFFUL })
+	{
+		fixture.SetInputs(levels);
+		ExpanderPinMask expected = 0;
+		for(uint8_t pin = 0; pin < EXPANDER_PIN_COUNT; pin++)
+		{
+			BENCH_CHECK(fixture.Expander.ReadPin(pin) == fixture.Expected(pin));
+			if(fixture.Expected(pin))
+				expected |= ExpanderPinBit(pin);
+		}
+		//bits past the pin map read 0
+		BENCH_CHECK(fixture.Expander.ReadPins(~ExpanderPinMask(0)) == expected);
+		BENCH_CHECK(fixture.Expander.ReadPins(0x0000FF00) == (expected & 0x0000FF00));
+	}
+
+	CheckCompileTimeRoutes(fixture, std::make_integer_sequence<digitalpin_t, EXPANDER_PIN_COUNT>());
+}
+
+static void TestDispatch()
+{
+	DigitalFixture fixture;
+	fixture.InitOutputs();
+
+	//a pin initialized the same way again isn't passed on to the backend
+	const uint32_t esp32Calls = fixture.Esp32.Calls;
+	const uint32_t attinyCalls = fixture.ATTiny[0].Calls;
+	fixture.InitOutputs();
+	BENCH_CHECK(fixture.Esp32.Calls == esp32Calls);
+	BENCH_CHECK(fixture.ATTiny[0].Calls == attinyCalls);
+
+	//initialized ESP32 outputs skip the driver and write the registers
+	for(uint8_t pin = 0; pin < EXPANDER_PIN_COUNT; pin++)
+		if(ExpanderPinMap[pin].OutBackend == ExpanderBackend_Esp32)
+			fixture.Expander.WritePin(pin, true);
+	BENCH_CHECK(fixture.Esp32.Calls == esp32Calls || !DIGITALSERVICE_EXPANDER_RAW_GPIO);
+
+	//the batched write leaves every backend exactly as the single writes do
+	for(const uint32_t values : { 0x0001A5A5UL, 0x00005A5AUL, 0UL, 0x0001FFFFUL })
+	{
+		uint32_t single[1 + EXPANDER_ATTINY_DEVICES], batched[1 + EXPANDER_ATTINY_DEVICES];
+		for(uint8_t pin = 0; pin < EXPANDER_PIN_COUNT; pin++)
+			fixture.Expander.WritePin(pin, (values >> pin) & 1);
+		fixture.Outputs(single);
+		fixture.Expander.WritePins(~ExpanderPinMask(0), ~ExpanderPinMask(values));
+		fixture.Expander.WritePins(~ExpanderPinMask(0), values);
+		fixture.Outputs(batched);
+		BENCH_CHECK(std::equal(single, single + 1 + EXPANDER_ATTINY_DEVICES, batched));
+	}
+
+	//ESP32 pins change in one set and one clear write however many are written
+	const uint32_t writes = mock_gpio_writes;
+	fixture.Expander.WritePins(ExpanderPinMaskEsp32Out, 0x0000A5A5);
+	BENCH_CHECK(mock_gpio_writes - writes <= 2);
+
+	//a pin outside the mask is left alone
+	fixture.Expander.WritePins(~ExpanderPinMask(0), 0);
+	fixture.Expander.WritePins(ExpanderPinBit(13), ~ExpanderPinMask(0));
+	BENCH_CHECK(fixture.Driven(13));
+	BENCH_CHECK(!fixture.Driven(14));
+
+	IDigitalService *service = &fixture.Expander;
+	Bench("DigitalService_Expander::WritePin virtual", 1000000, [&](uint32_t i) { service->WritePin(3 + (i & 7), i & 8); });
+	Bench("DigitalService_Expander::WritePin<pin>", 1000000, [&](uint32_t i) { fixture.Expander.WritePin<13>(i & 1); });
+	Bench("DigitalService_Expander::WritePins", 1000000, [&](uint32_t i) { fixture.Expander.WritePins(0x0001FFFF, i); });
+	Bench("DigitalService_Expander::ReadPin virtual", 1000000, [&](uint32_t i) { sink = sink + service->ReadPin(3 + (i & 7)); });
+	Bench("DigitalService_Expander::ReadPins", 1000000, [&](uint32_t i) { (void)i; sink = sink + fixture.Expander.ReadPins(0x0001FFFF); });
+}
+
+// exposes the refresh timer so the bench can fire it
+class BenchATTinyLink : public ATTinyLink
+{
+public:
+	using ATTinyLink::ATTinyLink;
+	esp_timer_handle_t RefreshTimer() { return _refreshTimer; }
+};
+
+struct LinkFixture
+{
+	DigitalService_ATTiny427Expander Digital;
+	ATTiny427ExpanderUpdateService Update;
+	BenchATTinyLink Link;
+	spi_device_t Device;
+	uint32_t Inputs;
+
+	LinkFixture() :
+		Update(&Digital),
+		Link(&Update, &Digital),
+		Device{ .post_cb = ATTinyLink::TransactionCompleteCallBack, .queue = {}, .queued = 0, .queue_result = ESP_OK, .respond = Respond, .respond_ctx = this },
+		Inputs(0)
+	{
+	}
+
+	// the ATTiny answers every frame with its inputs
+	static void Respond(spi_transaction_t *trans, void *ctx)
+	{
+		uint8_t *rx = reinterpret_cast<uint8_t *>(trans->rx_buffer);
+		rx[0] = ATTINY427EXPANDERUPDATESERVICE_MOCK_RX_MAGIC;
+		std::memcpy(rx + 1, &reinterpret_cast<LinkFixture *>(ctx)->Inputs, 4);
+	}
+
+	// outputs a transaction carries
+	static uint32_t Outputs(const spi_transaction_t *trans)
+	{
+		uint32_t out;
+		std::memcpy(&out, reinterpret_cast<const uint8_t *>(trans->tx_buffer) + 1, 4);
+		return out;
+	}
+};
+
+static void TestLinkFraming()
+{
+	LinkFixture fixture;
+	ATTinyLinkBus bus;
+	fixture.Digital.PortOut = 0x11;
+	BENCH_CHECK(fixture.Link.Begin(&fixture.Device, &bus) == ESP_OK);
+
+	//free running, there is always exactly one transaction on the bus
+	BENCH_CHECK(fixture.Device.queued == 1);
+	BENCH_CHECK(fixture.Device.queue[0]->length == ATTINY427EXPANDERUPDATESERVICE_MOCK_FRAME_SIZE * 8);
+	BENCH_CHECK(LinkFixture::Outputs(fixture.Device.queue[0]) == 0x11);
+
+	//a received frame is decoded once
+	fixture.Inputs = 0x1234;
+	BENCH_CHECK(mock_spi_complete(&fixture.Device));
+	BENCH_CHECK(fixture.Device.queued == 1);
+	BENCH_CHECK(fixture.Link.Receive());
+	BENCH_CHECK(fixture.Digital.PortIn == 0x1234);
+	BENCH_CHECK(fixture.Digital.Updates == 1);
+	BENCH_CHECK(!fixture.Link.Receive());
+	BENCH_CHECK(fixture.Link.TransactionCount.load() == 1);
+
+	//the transaction already queued keeps its frame, the one after it carries the change
+	fixture.Digital.PortOut = 0x22;
+	fixture.Link.Transmit();
+	BENCH_CHECK(LinkFixture::Outputs(fixture.Device.queue[0]) == 0x11);
+	mock_spi_complete(&fixture.Device);
+	BENCH_CHECK(LinkFixture::Outputs(fixture.Device.queue[0]) == 0x22);
+
+	//only the newest of several frames received between two reads is decoded
+	fixture.Inputs = 0x1;
+	mock_spi_complete(&fixture.Device);
+	fixture.Inputs = 0x2;
+	mock_spi_complete(&fixture.Device);
+	BENCH_CHECK(fixture.Link.Receive());
+	BENCH_CHECK(fixture.Digital.PortIn == 0x2);
+	BENCH_CHECK(!fixture.Link.Receive());
+
+	//scheduled, the bus goes quiet until an output changes or the refresh is due
+	fixture.Link.SetRefreshRate(100);
+	mock_spi_complete(&fixture.Device);
+	BENCH_CHECK(fixture.Device.queued == 0);
+	fixture.Link.Transmit();
+	BENCH_CHECK(fixture.Device.queued == 0);
+	fixture.Digital.PortOut = 0x33;
+	fixture.Link.Transmit();
+	BENCH_CHECK(fixture.Device.queued == 1);
+	BENCH_CHECK(LinkFixture::Outputs(fixture.Device.queue[0]) == 0x33);
+	mock_spi_complete(&fixture.Device);
+	BENCH_CHECK(fixture.Device.queued == 0);
+	mock_esp_timer_fire(fixture.Link.RefreshTimer());
+	BENCH_CHECK(fixture.Device.queued == 1);
+	BENCH_CHECK(LinkFixture::Outputs(fixture.Device.queue[0]) == 0x33);
+	mock_spi_complete(&fixture.Device);
+
+	//fast poll free runs while held
+	fixture.Link.AttachFastPoll();
+	BENCH_CHECK(fixture.Device.queued == 1);
+	mock_spi_complete(&fixture.Device);
+	BENCH_CHECK(fixture.Device.queued == 1);
+	fixture.Link.DetachFastPoll();
+	mock_spi_complete(&fixture.Device);
+	BENCH_CHECK(fixture.Device.queued == 0);
+
+	//rates past the timer's microsecond period free run instead of starting it with period 0
+	fixture.Link.SetRefreshRate(2000000);
+	BENCH_CHECK(fixture.Device.queued == 1);
+	mock_spi_complete(&fixture.Device);
+	BENCH_CHECK(fixture.Device.queued == 1);
+	fixture.Link.SetRefreshRate(100);
+	mock_spi_complete(&fixture.Device);
+	BENCH_CHECK(fixture.Device.queued == 0);
+
+	Bench("ATTinyLink frame, outputs changed", 200000, [&](uint32_t i) {
+		fixture.Digital.PortOut = i;
+		fixture.Link.Transmit();
+		mock_spi_complete(&fixture.Device);
+		fixture.Link.Receive();
+	});
+	Bench("ATTinyLink Transmit, outputs unchanged", 1000000, [&](uint32_t i) { (void)i; fixture.Link.Transmit(); });
+}
+
+static void TestLinkBus()
+{
+	LinkFixture first, second;
+	ATTinyLinkBus bus;
+	first.Link.Begin(&first.Device, &bus);
+	second.Link.Begin(&second.Device, &bus);
+
+	//both free run and the bus never runs two transactions. the first link already held the bus while the second
+	//was added, so it may go twice before the second one's turn
+	BENCH_CHECK(first.Device.queued == 1);
+	BENCH_CHECK(second.Device.queued == 0);
+	while(first.Device.queued != 0)
+		mock_spi_complete(&first.Device);
+	BENCH_CHECK(second.Device.queued == 1);
+	mock_spi_complete(&second.Device);
+	const uint32_t firstCount = first.Link.TransactionCount.load();
+	const uint32_t secondCount = second.Link.TransactionCount.load();
+
+	//from then on they alternate
+	for(uint32_t i = 0; i < 100; i++)
+	{
+		BENCH_CHECK(mock_spi_complete(&first.Device));
+		BENCH_CHECK(first.Device.queued == 0 && second.Device.queued == 1);
+		BENCH_CHECK(mock_spi_complete(&second.Device));
+		BENCH_CHECK(first.Device.queued == 1 && second.Device.queued == 0);
+	}
+	BENCH_CHECK(first.Link.TransactionCount.load() - firstCount == 100);
+	BENCH_CHECK(second.Link.TransactionCount.load() - secondCount == 100);
+
+	//a scheduled link with nothing to send leaves the bus to the other
+	second.Link.SetRefreshRate(100);
+	for(uint32_t i = 0; i < 10; i++)
+		BENCH_CHECK(mock_spi_complete(&first.Device) || mock_spi_complete(&second.Device));
+	BENCH_CHECK(first.Device.queued == 1 && second.Device.queued == 0);
+
+	//a transaction that fails to queue frees the bus for the other link and is retried on the next kick
+	first.Device.queue_result = ESP_FAIL;
+	BENCH_CHECK(mock_spi_complete(&first.Device));
+	BENCH_CHECK(first.Device.queued == 0 && first.Link.QueueFailures.load() != 0);
+	second.Digital.PortOut = 0x44;
+	second.Link.Transmit();
+	BENCH_CHECK(second.Device.queued == 1);
+	first.Device.queue_result = ESP_OK;
+	BENCH_CHECK(mock_spi_complete(&second.Device));
+	BENCH_CHECK(first.Device.queued == 1 && second.Device.queued == 0);
+	first.Device.queue_result = ESP_FAIL;
+	BENCH_CHECK(mock_spi_complete(&first.Device));
+	first.Device.queue_result = ESP_OK;
+	first.Link.Transmit();
+	BENCH_CHECK(first.Device.queued == 1);
+
+	//a change that failed to queue is still owed and goes out once the device takes transactions again
+	second.Device.queue_result = ESP_FAIL;
+	second.Digital.PortOut = 0x55;
+	second.Link.Transmit();
+	BENCH_CHECK(mock_spi_complete(&first.Device));
+	BENCH_CHECK(second.Device.queued == 0 && first.Device.queued == 1);
+	second.Device.queue_result = ESP_OK;
+	BENCH_CHECK(mock_spi_complete(&first.Device));
+	BENCH_CHECK(second.Device.queued == 1 && first.Device.queued == 0);
+	BENCH_CHECK(LinkFixture::Outputs(second.Device.queue[0]) == 0x55);
+}
+
+//off in the firmware until Esp32IdfCANService has an RX hook, so the bench is what keeps it working.
+//runs the gateway task on a thread against a udp client on loopback
+#define BENCH_GATEWAY_PORT 18002
+static std::atomic<uint32_t> gatewayTransmits(0);
+static can_gateway_frame_t gatewayTransmitted;
+
+static bool GatewayTransmit(const can_gateway_frame_t *frame)
+{
+	gatewayTransmitted = *frame;
+	gatewayTransmits.fetch_add(1, std::memory_order_release);
+	return true;
+}
+
+static void TestGateway()
+{
+	static can_gateway_config_t config = { .port = BENCH_GATEWAY_PORT, .format = CAN_GATEWAY_FORMAT_SLCAN, .transmit = GatewayTransmit };
+	std::thread(can_gateway, &config).detach();
+
+	const int client = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+	BENCH_CHECK(client >= 0);
+	struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	struct sockaddr_in gateway = {};
+	gateway.sin_family = AF_INET;
+	gateway.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	gateway.sin_port = htons(BENCH_GATEWAY_PORT);
+
+	//a transmit request subscribes the client. resent until the gateway has bound its port
+	const char request[] = "t12321122\r";
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+	while(gatewayTransmits.load(std::memory_order_acquire) == 0 && std::chrono::steady_clock::now() < deadline)
+	{
+		sendto(client, request, sizeof(request) - 1, 0, (struct sockaddr *)&gateway, sizeof(gateway));
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	BENCH_CHECK(gatewayTransmits.load(std::memory_order_acquire) >= 1);
+	BENCH_CHECK(gatewayTransmitted.id == 0x123 && gatewayTransmitted.channel == 0 && gatewayTransmitted.length == 2);
+	BENCH_CHECK(gatewayTransmitted.data[0] == 0x11 && gatewayTransmitted.data[1] == 0x22);
+
+	//frames are refused until the gateway has seen the subscriber
+	const uint8_t data[3] = { 0xAA, 0xBB, 0xCC };
+	bool queued = false;
+	while(!(queued = can_gateway_receive(1, CAN_GATEWAY_ID_EXTENDED | 0x1ABCDEF0, data, 3)) && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	BENCH_CHECK(queued);
+	BENCH_CHECK(can_gateway_receive(0, 0x456, data, 2));
+	BENCH_CHECK(!can_gateway_receive(CAN_GATEWAY_CHANNELS, 0x456, data, 2));
+
+	//the extended frame was queued first, but one pass batches channel 0 first when both are waiting.
+	//read until both are in, timestamps are 4 hex digits
+	char packet[CAN_GATEWAY_PACKET_SIZE];
+	int length = 0;
+	int received;
+	while(length < 14 + 21 && (received = recv(client, packet + length, sizeof(packet) - length, 0)) > 0)
+		length += received;
+	BENCH_CHECK(length == 14 + 21);
+	if(length == 14 + 21)
+	{
+		const char *extended = packet[0] == 'T'? packet : packet + 14;
+		const char *standard = packet[0] == 'T'? packet + 21 : packet;
+		BENCH_CHECK(std::memcmp(extended, "T1ABCDEF03AABBCC", 16) == 0 && extended[20] == '\r');
+		BENCH_CHECK(std::memcmp(standard, "t4562AABB", 9) == 0 && standard[13] == '\r');
+	}
+	BENCH_CHECK(can_gateway_dropped(0) == 0 && can_gateway_dropped(1) == 0);
+	close(client);
+}
+
+int main()
+{
+	TestRouting();
+	TestDispatch();
+	TestLinkFraming();
+	TestLinkBus();
+	TestGateway();
+	if(failures != 0)
+	{
+		std::printf("%d checks failed\n", failures);
+		return 1;
+	}
+	std::printf("all checks passed\n");
+	return 0;
+}
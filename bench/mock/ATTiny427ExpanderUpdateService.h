@@ -0,0 +1,45 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "DigitalService_ATTiny427Expander.h"
+
+#ifndef ATTINY427EXPANDERUPDATESERVICE_H
+#define ATTINY427EXPANDERUPDATESERVICE_H
+
+// frames are sized like a full register image so the link copies and compares as much as on the target
+#define ATTINY427EXPANDERUPDATESERVICE_MOCK_FRAME_SIZE 256
+#define ATTINY427EXPANDERUPDATESERVICE_MOCK_TX_MAGIC 0xA5
+#define ATTINY427EXPANDERUPDATESERVICE_MOCK_RX_MAGIC 0x5A
+
+namespace EmbeddedIOServices
+{
+	// encodes the outputs as magic(1) out(4) dir(4), decodes inputs from magic(1) in(4)
+	class ATTiny427ExpanderUpdateService
+	{
+	protected:
+		DigitalService_ATTiny427Expander *_digitalService;
+	public:
+		uint32_t Received = 0;
+
+		ATTiny427ExpanderUpdateService(DigitalService_ATTiny427Expander *digitalService) : _digitalService(digitalService) {}
+
+		size_t Transmit(void *frame)
+		{
+			uint8_t *bytes = reinterpret_cast<uint8_t *>(frame);
+			std::memset(bytes, 0, ATTINY427EXPANDERUPDATESERVICE_MOCK_FRAME_SIZE);
+			bytes[0] = ATTINY427EXPANDERUPDATESERVICE_MOCK_TX_MAGIC;
+			std::memcpy(bytes + 1, &_digitalService->PortOut, 4);
+			std::memcpy(bytes + 5, &_digitalService->PortDir, 4);
+			return ATTINY427EXPANDERUPDATESERVICE_MOCK_FRAME_SIZE;
+		}
+		void Receive(const void *frame, size_t length)
+		{
+			const uint8_t *bytes = reinterpret_cast<const uint8_t *>(frame);
+			if(length < 5 || bytes[0] != ATTINY427EXPANDERUPDATESERVICE_MOCK_RX_MAGIC)
+				return;
+			std::memcpy(&_digitalService->PortIn, bytes + 1, 4);
+			Received++;
+		}
+	};
+}
+#endif
@@ -0,0 +1,65 @@
+#include "IDigitalService.h"
+
+#ifndef DIGITALSERVICE_ATTINY427EXPANDER_H
+#define DIGITALSERVICE_ATTINY427EXPANDER_H
+
+namespace EmbeddedIOServices
+{
+	// register image of one ATTiny reduced to its port bits
+	class DigitalService_ATTiny427Expander : public IDigitalService
+	{
+	public:
+		uint32_t PortOut = 0;
+		uint32_t PortIn = 0;
+		uint32_t PortDir = 0;
+		uint32_t InterruptMask = 0;
+		uint32_t PassthroughMask = 0;
+		uint32_t Updates = 0;
+		uint32_t Calls = 0;
+
+		void InitPin(digitalpin_t pin, PinDirection direction)
+		{
+			Calls++;
+			if(direction == Out)
+				PortDir |= 1UL << pin;
+			else
+				PortDir &= ~(1UL << pin);
+		}
+		bool ReadPin(digitalpin_t pin)
+		{
+			Calls++;
+			return (PortIn >> pin) & 1;
+		}
+		void WritePin(digitalpin_t pin, bool value)
+		{
+			Calls++;
+			if(value)
+				PortOut |= 1UL << pin;
+			else
+				PortOut &= ~(1UL << pin);
+		}
+		void AttachInterrupt(digitalpin_t pin, callback_t callBack)
+		{
+			(void)callBack;
+			Calls++;
+			InterruptMask |= 1UL << pin;
+		}
+		void DetachInterrupt(digitalpin_t pin)
+		{
+			Calls++;
+			InterruptMask &= ~(1UL << pin);
+		}
+		void InitPassthrough(uint8_t pinIn, uint8_t pinOut, bool inverted)
+		{
+			(void)pinOut;
+			(void)inverted;
+			Calls++;
+			PassthroughMask |= 1UL << pinIn;
+		}
+		void Update()
+		{
+			Updates++;
+		}
+	};
+}
+#endif
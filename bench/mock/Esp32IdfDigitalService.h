@@ -0,0 +1,49 @@
+#include "IDigitalService.h"
+#include "soc/soc.h"
+#include "soc/gpio_reg.h"
+
+#ifndef ESP32IDFDIGITALSERVICE_H
+#define ESP32IDFDIGITALSERVICE_H
+
+namespace Esp32
+{
+	// drives the mocked GPIO registers the raw register path in DigitalService_Expander uses as well
+	class Esp32IdfDigitalService : public EmbeddedIOServices::IDigitalService
+	{
+	public:
+		uint32_t OutputMask = 0;
+		uint32_t InterruptMask = 0;
+		uint32_t Calls = 0;
+
+		void InitPin(EmbeddedIOServices::digitalpin_t pin, EmbeddedIOServices::PinDirection direction)
+		{
+			Calls++;
+			if(direction == EmbeddedIOServices::Out)
+				OutputMask |= 1UL << pin;
+			else
+				OutputMask &= ~(1UL << pin);
+		}
+		bool ReadPin(EmbeddedIOServices::digitalpin_t pin)
+		{
+			Calls++;
+			return (REG_READ(GPIO_IN_REG) >> pin) & 1;
+		}
+		void WritePin(EmbeddedIOServices::digitalpin_t pin, bool value)
+		{
+			Calls++;
+			REG_WRITE(value? GPIO_OUT_W1TS_REG : GPIO_OUT_W1TC_REG, 1UL << pin);
+		}
+		void AttachInterrupt(EmbeddedIOServices::digitalpin_t pin, EmbeddedIOServices::callback_t callBack)
+		{
+			(void)callBack;
+			Calls++;
+			InterruptMask |= 1UL << pin;
+		}
+		void DetachInterrupt(EmbeddedIOServices::digitalpin_t pin)
+		{
+			Calls++;
+			InterruptMask &= ~(1UL << pin);
+		}
+	};
+}
+#endif
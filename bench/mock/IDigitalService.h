@@ -0,0 +1,27 @@
+#include <cstdint>
+#include <functional>
+
+#ifndef IDIGITALSERVICE_H
+#define IDIGITALSERVICE_H
+
+namespace EmbeddedIOServices
+{
+	typedef uint16_t digitalpin_t;
+	typedef std::function<void()> callback_t;
+	enum PinDirection : uint8_t
+	{
+		In = 0,
+		Out = 1
+	};
+
+	class IDigitalService
+	{
+	public:
+		virtual void InitPin(digitalpin_t pin, PinDirection direction) = 0;
+		virtual bool ReadPin(digitalpin_t pin) = 0;
+		virtual void WritePin(digitalpin_t pin, bool value) = 0;
+		virtual void AttachInterrupt(digitalpin_t pin, callback_t callBack) = 0;
+		virtual void DetachInterrupt(digitalpin_t pin) = 0;
+	};
+}
+#endif
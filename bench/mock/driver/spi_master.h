@@ -0,0 +1,59 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "esp_err.h"
+
+#ifndef SPI_MASTER_H
+#define SPI_MASTER_H
+
+typedef struct spi_transaction_t
+{
+	uint32_t flags;
+	size_t length;
+	size_t rxlength;
+	void *user;
+	const void *tx_buffer;
+	void *rx_buffer;
+} spi_transaction_t;
+typedef void (*transaction_cb_t)(spi_transaction_t *trans);
+
+// queued transactions wait until the bench completes them with mock_spi_complete
+#define MOCK_SPI_QUEUE_SIZE 4
+struct spi_device_t
+{
+	transaction_cb_t post_cb;
+	spi_transaction_t *queue[MOCK_SPI_QUEUE_SIZE];
+	size_t queued;
+	esp_err_t queue_result;			// returned by spi_device_queue_trans instead of queueing when not ESP_OK
+	void (*respond)(spi_transaction_t *trans, void *ctx); // fills rx_buffer, loopback when 0
+	void *respond_ctx;
+};
+typedef struct spi_device_t *spi_device_handle_t;
+
+static inline esp_err_t spi_device_queue_trans(spi_device_handle_t handle, spi_transaction_t *trans, uint32_t ticks_to_wait)
+{
+	(void)ticks_to_wait;
+	if(handle->queue_result != ESP_OK)
+		return handle->queue_result;
+	if(handle->queued >= MOCK_SPI_QUEUE_SIZE)
+		return ESP_ERR_INVALID_STATE;
+	handle->queue[handle->queued++] = trans;
+	return ESP_OK;
+}
+
+// completes the oldest queued transaction and runs the post callback like the SPI ISR. false when none was queued
+static inline bool mock_spi_complete(spi_device_handle_t handle)
+{
+	if(handle->queued == 0)
+		return false;
+	spi_transaction_t *trans = handle->queue[0];
+	std::memmove(handle->queue, handle->queue + 1, --handle->queued * sizeof(handle->queue[0]));
+	if(handle->respond != 0)
+		handle->respond(trans, handle->respond_ctx);
+	else
+		std::memcpy(trans->rx_buffer, trans->tx_buffer, trans->length / 8);
+	trans->rxlength = trans->length;
+	handle->post_cb(trans);
+	return true;
+}
+#endif
@@ -0,0 +1,12 @@
+#include <chrono>
+#include <cstdint>
+
+#ifndef ESP_CPU_H
+#define ESP_CPU_H
+
+// host cycles are nanoseconds, see esp_rom_get_cpu_ticks_per_us
+static inline uint32_t esp_cpu_get_cycle_count()
+{
+	return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+#endif
@@ -0,0 +1,4 @@
+#ifndef ESP_HTTP_SERVER_H
+#define ESP_HTTP_SERVER_H
+typedef void *httpd_handle_t;
+#endif
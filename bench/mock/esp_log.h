@@ -0,0 +1,8 @@
+#include <cstdio>
+
+#ifndef ESP_LOG_H
+#define ESP_LOG_H
+#define ESP_LOGE(tag, format, ...) std::printf("E %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) std::printf("W %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) do { } while(0)
+#endif
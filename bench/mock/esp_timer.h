@@ -0,0 +1,62 @@
+#include <chrono>
+#include <cstdint>
+#include "esp_err.h"
+
+#ifndef ESP_TIMER_H
+#define ESP_TIMER_H
+
+typedef void (*esp_timer_cb_t)(void *arg);
+typedef enum { ESP_TIMER_TASK, ESP_TIMER_ISR } esp_timer_dispatch_t;
+typedef struct
+{
+	esp_timer_cb_t callback;
+	void *arg;
+	esp_timer_dispatch_t dispatch_method;
+	const char *name;
+	bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+// timers never fire by themselves, the bench calls mock_esp_timer_fire
+struct esp_timer
+{
+	esp_timer_create_args_t args;
+	uint64_t period;
+	bool running;
+};
+typedef struct esp_timer *esp_timer_handle_t;
+
+static inline esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle)
+{
+	*handle = new esp_timer { *args, 0, false };
+	return ESP_OK;
+}
+static inline esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+	if(period == 0)
+		return ESP_ERR_INVALID_ARG;
+	timer->period = period;
+	timer->running = true;
+	return ESP_OK;
+}
+static inline esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+	if(!timer->running)
+		return ESP_ERR_INVALID_STATE;
+	timer->running = false;
+	return ESP_OK;
+}
+static inline esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+	delete timer;
+	return ESP_OK;
+}
+static inline int64_t esp_timer_get_time()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+static inline void mock_esp_timer_fire(esp_timer_handle_t timer)
+{
+	if(timer != 0 && timer->running)
+		timer->args.callback(timer->args.arg);
+}
+#endif
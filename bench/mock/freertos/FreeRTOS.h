@@ -0,0 +1,23 @@
+#include <cstdint>
+
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+// single threaded host, critical sections only check nesting
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef struct { int nesting; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+#define portENTER_CRITICAL(mux) ((mux)->nesting++)
+#define portEXIT_CRITICAL(mux) ((mux)->nesting--)
+#define portENTER_CRITICAL_SAFE(mux) portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL_SAFE(mux) portEXIT_CRITICAL(mux)
+#define portYIELD_FROM_ISR(...) do { } while(0)
+#define portMAX_DELAY 0xFFFFFFFFUL
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdFAIL 0
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#endif
@@ -0,0 +1,11 @@
+#include "freertos/FreeRTOS.h"
+
+#ifndef SEMPHR_H
+#define SEMPHR_H
+
+typedef struct mock_semaphore { int taken; } *SemaphoreHandle_t;
+static inline SemaphoreHandle_t xSemaphoreCreateMutex() { return new mock_semaphore { 0 }; }
+static inline void vSemaphoreDelete(SemaphoreHandle_t semaphore) { delete semaphore; }
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t wait) { (void)wait; semaphore->taken++; return pdTRUE; }
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) { semaphore->taken--; return pdTRUE; }
+#endif
@@ -0,0 +1,22 @@
+#include "freertos/FreeRTOS.h"
+
+#ifndef TASK_H
+#define TASK_H
+
+typedef void (*TaskFunction_t)(void *);
+typedef struct mock_task { uint32_t notifications; } *TaskHandle_t;
+
+static inline void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higherPriorityTaskWoken)
+{
+	task->notifications++;
+	*higherPriorityTaskWoken = pdFALSE;
+}
+// no tasks on the host, deferred frame processing is not benchmarked
+static inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stack, void *arg, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+	(void)task; (void)name; (void)stack; (void)arg; (void)priority; (void)handle; (void)core;
+	return pdFAIL;
+}
+static inline void vTaskDelete(TaskHandle_t task) { (void)task; }
+static inline uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait) { (void)clear; (void)wait; return 0; }
+#endif
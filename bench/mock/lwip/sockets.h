@@ -0,0 +1,12 @@
+#include <errno.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// lwip follows the BSD socket api, the host sockets stand in for it
+#ifndef LWIP_SOCKETS_H
+#define LWIP_SOCKETS_H
+#endif
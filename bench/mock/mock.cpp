@@ -0,0 +1,47 @@
+#include "soc/soc.h"
+#include "soc/gpio_reg.h"
+#include "profiler.h"
+
+// GPIO output latch and the levels the bench drives onto the inputs
+uint32_t mock_gpio_out = 0;
+uint32_t mock_gpio_in = 0;
+uint32_t mock_gpio_writes = 0;
+
+uint32_t mock_reg_read(uint32_t reg)
+{
+	switch(reg)
+	{
+		case GPIO_IN_REG:
+			return mock_gpio_in;
+		case GPIO_OUT_REG:
+			return mock_gpio_out;
+		default:
+			return 0;
+	}
+}
+
+void mock_reg_write(uint32_t reg, uint32_t value)
+{
+	mock_gpio_writes++;
+	switch(reg)
+	{
+		case GPIO_OUT_W1TS_REG:
+			mock_gpio_out |= value;
+			break;
+		case GPIO_OUT_W1TC_REG:
+			mock_gpio_out &= ~value;
+			break;
+		case GPIO_OUT_REG:
+			mock_gpio_out = value;
+			break;
+	}
+}
+
+profiler_stats_t profiler_stats[PROFILER_STAGE_COUNT];
+uint32_t profiler_counters[PROFILER_COUNTER_COUNT];
+
+void profiler_record(profiler_stage_t stage, uint32_t cycles)
+{
+	profiler_stats[stage].count++;
+	profiler_stats[stage].total += cycles;
+}
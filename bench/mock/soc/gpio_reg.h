@@ -0,0 +1,7 @@
+#ifndef GPIO_REG_H
+#define GPIO_REG_H
+#define GPIO_OUT_REG 0x60091004
+#define GPIO_OUT_W1TS_REG 0x60091008
+#define GPIO_OUT_W1TC_REG 0x6009100C
+#define GPIO_IN_REG 0x6009103C
+#endif
@@ -0,0 +1,10 @@
+#include <cstdint>
+
+#ifndef SOC_H
+#define SOC_H
+
+uint32_t mock_reg_read(uint32_t reg);
+void mock_reg_write(uint32_t reg, uint32_t value);
+#define REG_READ(reg) mock_reg_read(reg)
+#define REG_WRITE(reg, value) mock_reg_write(reg, value)
+#endif
@@ -1,15 +1,32 @@
 #include <ATTiny_UPDI.h>
 #include <stdio.h>
 #include <string.h>
-#include <functional>
+#include <atomic>
 #include "driver/gpio.h"
 #include "hal/gpio_hal.h"
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "UPDI.h"
 
 #define UPDI_KEYNVMPROG 0x4E564D50726F6720
 #define UPDI_KEYNVMERASE 0x4E564D4572617365
 
+#define UPDI_SYNCH 0x55
+#define UPDI_ST_PTR_16 0x69
+#define UPDI_ST_PTR_INC_8 0x64
+#define UPDI_LD_PTR_INC_8 0x24
+#define UPDI_REPEAT_8 0xA0
+#define UPDI_BURST_HEADER_LENGTH 9
+#define UPDI_ASI_CTRLA 0x9
+#define UPDI_NVMCTRL_CTRLA 0x1000
+#define UPDI_NVMCTRL_STATUS 0x1002
+#define UPDI_NVM_READY_POLLS 1000
+#define UPDI_PAGE_SIZE 64
+#define UPDI_FLASH_START 0x8000
+#define UPDI_FLASH_SIZE 4096
+#define UPDI_FAST_CLKSEL 0x1 //16MHz UPDI clock, good for up to 0.9Mbaud
+
 void _UPDI_error_check_failed(const char *file, int line, const char *function, const char *expression)
 {
     ESP_LOGE("UPDI", "UPDI_ERROR_CHECK failed at %p", __builtin_return_address(0));
@@ -27,9 +44,84 @@ void _UPDI_error_check_failed(const char *file, int line, const char *function,
 uart_port_t UPDI_uart_num;
 bool UPDI_callback_registered;
 uint32_t UPDI_uart_callback_id;
+
+//single producer (the uart_listen task) single consumer (the programming task) ring.
+//head and tail are free running, only the producer moves head and only the consumer moves tail
+static_assert((UPDI_RX_BUFFER_LENGTH & (UPDI_RX_BUFFER_LENGTH - 1)) == 0, "UPDI_RX_BUFFER_LENGTH must be a power of 2");
 uint8_t UPDI_rx_buffer[UPDI_RX_BUFFER_LENGTH];
-volatile size_t UPDI_rx_buffer_index = 0;
-volatile size_t UPDI_rx_buffer_length = 0;
+std::atomic<size_t> UPDI_rx_head(0);
+std::atomic<size_t> UPDI_rx_tail(0);
+std::atomic<TaskHandle_t> UPDI_rx_waiter(nullptr);
+uint32_t UPDI_rx_dropped = 0;
+
+static void UPDI_RxPush(void *context, const uint8_t *data, size_t length)
+{
+    const size_t head = UPDI_rx_head.load(std::memory_order_relaxed);
+    const size_t tail = UPDI_rx_tail.load(std::memory_order_acquire);
+    const size_t space = UPDI_RX_BUFFER_LENGTH - (head - tail);
+    if(length > space)
+    {
+        UPDI_rx_dropped += length - space;
+        length = space;
+    }
+
+    const size_t offset = head & (UPDI_RX_BUFFER_LENGTH - 1);
+    const size_t first = length < UPDI_RX_BUFFER_LENGTH - offset? length : UPDI_RX_BUFFER_LENGTH - offset;
+    memcpy(&UPDI_rx_buffer[offset], data, first);
+    memcpy(UPDI_rx_buffer, data + first, length - first);
+    UPDI_rx_head.store(head + length, std::memory_order_release);
+
+    TaskHandle_t waiter = UPDI_rx_waiter.load();
+    if(waiter != nullptr)
+        xTaskNotifyGive(waiter);
+}
+
+extern "C" bool UPDI_ReadN(uint8_t *data, size_t length, TickType_t timeout)
+{
+    TimeOut_t timeOut;
+    vTaskSetTimeOutState(&timeOut);
+    while(length > 0)
+    {
+        const size_t tail = UPDI_rx_tail.load(std::memory_order_relaxed);
+        const size_t available = UPDI_rx_head.load(std::memory_order_acquire) - tail;
+        if(available == 0)
+        {
+            //publish the waiter before re-checking so a push in between is not missed
+            UPDI_rx_waiter.store(xTaskGetCurrentTaskHandle());
+            if(UPDI_rx_head.load(std::memory_order_acquire) == tail)
+            {
+                if(xTaskCheckForTimeOut(&timeOut, &timeout) == pdTRUE)
+                {
+                    UPDI_rx_waiter.store(nullptr);
+                    return false;
+                }
+                ulTaskNotifyTake(pdTRUE, timeout);
+            }
+            UPDI_rx_waiter.store(nullptr);
+            continue;
+        }
+
+        const size_t chunk = available < length? available : length;
+        const size_t offset = tail & (UPDI_RX_BUFFER_LENGTH - 1);
+        const size_t first = chunk < UPDI_RX_BUFFER_LENGTH - offset? chunk : UPDI_RX_BUFFER_LENGTH - offset;
+        memcpy(data, &UPDI_rx_buffer[offset], first);
+        memcpy(data + first, UPDI_rx_buffer, chunk - first);
+        UPDI_rx_tail.store(tail + chunk, std::memory_order_release);
+
+        data += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+extern "C" void UPDI_RxFlush(TickType_t settle)
+{
+    uint8_t val;
+    do
+    {
+        UPDI_rx_tail.store(UPDI_rx_head.load(std::memory_order_acquire), std::memory_order_release);
+    } while(UPDI_ReadN(&val, 1, settle));
+}
 
 bool ack_disabled = false;
 extern "C" bool UPDI_ReadAck()
@@ -49,8 +141,7 @@ bool UPDI_DisableAck()
     ack_disabled = true;
     uint8_t CTRLACheck = 0x0C;
     //clear read buffer
-    uint8_t val;
-    while(UPDI_Read(&val)) ;
+    UPDI_RxFlush(UPDI_RX_SETTLE_TICKS);
     UPDI_ERROR_CHECK(UPDI_LDCS(0x2, &CTRLACheck));
     UPDI_ERROR_CHECK(CTRLACheck == CTRLA);
     return true;
@@ -65,15 +156,14 @@ bool UPDI_EnableAck()
     ack_disabled = false;
     uint8_t CTRLACheck = 0x06;
     //clear read buffer
-    uint8_t val;
-    while(UPDI_Read(&val)) ;
+    UPDI_RxFlush(UPDI_RX_SETTLE_TICKS);
     UPDI_ERROR_CHECK(UPDI_LDCS(0x2, &CTRLACheck));
     UPDI_ERROR_CHECK(CTRLACheck == CTRLA);
     return true;
 }
 
-extern void uart_listen_remove_callback(uart_port_t uart_num, uint32_t callback_iterator);
-extern uint32_t uart_listen_add_callback(uart_port_t uart_num, std::function<void(const uint8_t *, size_t)> callback);
+extern "C" void uart_listen_remove_callback(uart_port_t uart_num, uint32_t callback_id);
+extern "C" uint32_t uart_listen_add_callback(uart_port_t uart_num, void (*callback)(void *, const uint8_t *, size_t), void *context);
 
 bool UPDI_Enable(uart_port_t uart_num, gpio_num_t tx_pin, gpio_num_t rx_pin)
 {
@@ -114,17 +204,8 @@ bool UPDI_Enable(uart_port_t uart_num, gpio_num_t tx_pin, gpio_num_t rx_pin)
     if(UPDI_callback_registered) {
         uart_listen_remove_callback(UPDI_uart_num, UPDI_uart_callback_id);
     }
-    UPDI_uart_callback_id = uart_listen_add_callback(uart_num, [](const uint8_t *rx_buffer, size_t len) {
-        size_t index = 0;
-        while(len > 0) {
-            UPDI_rx_buffer[(UPDI_rx_buffer_index + UPDI_rx_buffer_length) % UPDI_RX_BUFFER_LENGTH] = rx_buffer[index];
-            UPDI_rx_buffer_length++;
-            len--;
-            index++;
-        }
-    });
-    UPDI_rx_buffer_index = 0;
-    UPDI_rx_buffer_length = 0;
+    UPDI_uart_callback_id = uart_listen_add_callback(uart_num, UPDI_RxPush, 0);
+    UPDI_rx_tail.store(UPDI_rx_head.load());
     UPDI_callback_registered = true;
 
     UPDI_uart_num = uart_num;
@@ -140,8 +221,7 @@ bool UPDI_Enable(uart_port_t uart_num, gpio_num_t tx_pin, gpio_num_t rx_pin)
     uart_set_baudrate(UPDI_uart_num, 100000);
 
     //clear read buffer. this could get filled by who knows what before we get to here
-    uint8_t val;
-    while(UPDI_Read(&val)) ;
+    UPDI_RxFlush(UPDI_RX_SETTLE_TICKS);
 
     //remove guard time and verify
     ack_disabled = false;
@@ -200,9 +280,106 @@ bool UPDI_NVMProg()
     return ASI_SYS_STATUS & 0x8;
 }
 
+//queue the pointer and REPEAT header of a ptr++ burst of length bytes in front of the opcode
+static size_t UPDI_BurstHeader(uint8_t *frame, uint32_t address, uint32_t length, uint8_t opcode)
+{
+    size_t i = 0;
+    frame[i++] = UPDI_SYNCH;
+    frame[i++] = UPDI_ST_PTR_16;
+    frame[i++] = address & 0xFF;
+    frame[i++] = (address >> 8) & 0xFF;
+    frame[i++] = UPDI_SYNCH;
+    frame[i++] = UPDI_REPEAT_8;
+    frame[i++] = length - 1;
+    frame[i++] = UPDI_SYNCH;
+    frame[i++] = opcode;
+    return i;
+}
+
+//read length bytes starting at address with a single REPEAT + LD *ptr++ burst
+static bool UPDI_LDBurst(uint32_t address, uint8_t *data, uint32_t length)
+{
+    uint8_t frame[UPDI_BURST_HEADER_LENGTH];
+    UPDI_BurstHeader(frame, address, length, UPDI_LD_PTR_INC_8);
+    //the pointer store is acknowledged before REPEAT is accepted
+    UPDI_ERROR_CHECK(UPDI_WriteN(frame, 4));
+    UPDI_ERROR_CHECK(UPDI_ReadAck());
+    UPDI_ERROR_CHECK(UPDI_WriteN(frame + 4, UPDI_BURST_HEADER_LENGTH - 4));
+    return UPDI_ReadN(data, length, UPDI_READ_TIMEOUT_TICKS);
+}
+
+static bool UPDI_WaitNVMReady()
+{
+    uint8_t NVMCTRL_STATUS = 0;
+    uint32_t i = 0;
+    UPDI_ERROR_CHECK(UPDI_LDSB(UPDI_NVMCTRL_STATUS, &NVMCTRL_STATUS));
+    while((NVMCTRL_STATUS & 0x3) != 0 && i++<UPDI_NVM_READY_POLLS) 
+        UPDI_ERROR_CHECK(UPDI_LDSB(UPDI_NVMCTRL_STATUS, &NVMCTRL_STATUS));
+    return (NVMCTRL_STATUS & 0x3) == 0;
+}
+
+bool UPDI_HighSpeed()
+{
+    //raise the UPDI clock so it can follow the faster baud rate
+    uint8_t ASI_CTRLA = UPDI_FAST_CLKSEL;
+    UPDI_STCS(UPDI_ASI_CTRLA, ASI_CTRLA);
+    UPDI_ERROR_CHECK(UPDI_LDCS(UPDI_ASI_CTRLA, &ASI_CTRLA));
+    UPDI_ERROR_CHECK((ASI_CTRLA & 0x3) == UPDI_FAST_CLKSEL);
+
+    uart_set_baudrate(UPDI_uart_num, UPDI_FAST_BAUD);
+    UPDI_RxFlush(UPDI_RX_SETTLE_TICKS);
+
+    //verify the link at the new baud rate, otherwise fall back to 100k
+    uint8_t CTRLA = 0;
+    if(UPDI_LDCS(0x2, &CTRLA) && CTRLA == 0x06)
+        return true;
+
+    ESP_LOGW("UPDI", "%d baud not accepted, falling back to 100000", UPDI_FAST_BAUD);
+    uart_set_baudrate(UPDI_uart_num, 100000);
+    UPDI_Break();
+    UPDI_Idle();
+    UPDI_RxFlush(UPDI_RX_SETTLE_TICKS);
+    CTRLA = 0;
+    UPDI_ERROR_CHECK(UPDI_LDCS(0x2, &CTRLA));
+    UPDI_ERROR_CHECK(CTRLA == 0x06);
+    return false;
+}
+
+//load a page with one REPEAT + ST *ptr++ burst and start writing it. the page buffer can't be written while
+//the NVM is busy, so the frame is built before waiting for the previous page to finish
+static bool UPDI_WritePage(uint32_t address, const uint8_t *data, uint32_t length)
+{
+    uint8_t frame[UPDI_BURST_HEADER_LENGTH + UPDI_PAGE_SIZE];
+    const size_t headerLength = UPDI_BurstHeader(frame, address, length, UPDI_ST_PTR_INC_8);
+    memcpy(frame + headerLength, data, length);
+
+    //wait for ready
+    UPDI_ERROR_CHECK(UPDI_WaitNVMReady());
+
+    UPDI_ERROR_CHECK(UPDI_WriteN(frame, headerLength + length));
+
+    UPDI_ERROR_CHECK(UPDI_STSB(UPDI_NVMCTRL_CTRLA, 0x3));
+    return true;
+}
+
+static bool UPDI_VerifyPage(uint32_t address, const uint8_t *data, uint32_t length)
+{
+    uint8_t verifybuf[UPDI_PAGE_SIZE];
+    UPDI_ERROR_CHECK(UPDI_LDBurst(address, verifybuf, length));
+
+    if(memcmp(verifybuf, data, length) != 0)
+    {
+        ESP_LOGE("UPDI", "UPDI verification failed @ %04X", (unsigned int)address);
+        ESP_LOG_BUFFER_HEXDUMP("UPDI read", verifybuf, length, ESP_LOG_ERROR);
+        ESP_LOG_BUFFER_HEXDUMP("UPDI expected", data, length, ESP_LOG_ERROR);
+        return false;
+    }
+    return true;
+}
+
 bool UPDI_WriteFlashOrEEPROM(uint32_t address, uint8_t *data, uint32_t length) 
 {
-    UPDI_ERROR_CHECK(UPDI_STSB(0x1000, 0x4));
+    UPDI_ERROR_CHECK(UPDI_STSB(UPDI_NVMCTRL_CTRLA, 0x4));
 
     //program
     UPDI_DisableAck();
@@ -211,81 +388,35 @@ bool UPDI_WriteFlashOrEEPROM(uint32_t address, uint8_t *data, uint32_t length)
     uint32_t lengthI = length;
     while(lengthI > 0) 
     {
-        //wait for ready
-        uint8_t NVMCTRL_STATUS = 0;
-        uint32_t i = 0;
-        UPDI_ERROR_CHECK(UPDI_LDSB(0x1002, &NVMCTRL_STATUS));
-        while((NVMCTRL_STATUS & 0x3) != 0 && i++<1000) 
-        {
-            esp_rom_delay_us(100);
-            UPDI_ERROR_CHECK(UPDI_LDSB(0x1002, &NVMCTRL_STATUS));
-        }
-        UPDI_ERROR_CHECK((NVMCTRL_STATUS & 0x3) == 0);
-
-        uint32_t pagelength = 64 - (addressI % 64);
+        uint32_t pagelength = UPDI_PAGE_SIZE - (addressI % UPDI_PAGE_SIZE);
         if(lengthI < pagelength)
             pagelength = lengthI;
-        
-        UPDI_ERROR_CHECK(UPDI_ST(addressI, dataI, pagelength));
 
-        UPDI_ERROR_CHECK(UPDI_STSB(0x1000, 0x3));
+        UPDI_ERROR_CHECK(UPDI_WritePage(addressI, dataI, pagelength));
 
         addressI += pagelength;
         dataI += pagelength;
         lengthI -= pagelength;
     }
+    UPDI_ERROR_CHECK(UPDI_WaitNVMReady());
     UPDI_EnableAck();
 
-    //verify
-    uint8_t verifybuf[length];
-    UPDI_ERROR_CHECK(UPDI_LD(address, verifybuf, length));
+    //verify a page at a time
     addressI = address;
-    if(memcmp(verifybuf, data, length) != 0)
+    dataI = data;
+    lengthI = length;
+    while(lengthI > 0) 
     {
-        ESP_LOGE("UPDI", "UPDI verification failed");
-        for(int a = 0; a < length; a+=16) 
-        {
-            ESP_LOGE("UPDI", "%04X\t%02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X| %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X",
-                (unsigned int)addressI,
-                verifybuf[a],   verifybuf[a+1], verifybuf[a+2],  verifybuf[a+3],  verifybuf[a+4],  verifybuf[a+5],  verifybuf[a+6],  verifybuf[a+7],
-                verifybuf[a+8], verifybuf[a+9], verifybuf[a+10], verifybuf[a+11], verifybuf[a+12], verifybuf[a+13], verifybuf[a+14], verifybuf[a+15],
-                data[a],   data[a+1], data[a+2],  data[a+3],  data[a+4],  data[a+5],  data[a+6],  data[a+7],
-                data[a+8], data[a+9], data[a+10], data[a+11], data[a+12], data[a+13], data[a+14], data[a+15]);
-            addressI += 16;
-        }
-        return false;
-    }
+        uint32_t pagelength = UPDI_PAGE_SIZE - (addressI % UPDI_PAGE_SIZE);
+        if(lengthI < pagelength)
+            pagelength = lengthI;
+
+        UPDI_ERROR_CHECK(UPDI_VerifyPage(addressI, dataI, pagelength));
 
-    // uint8_t verifybuf[512];
-    // addressI = address;
-    // dataI = data;
-    // lengthI = length;
-    // while(lengthI > 0) 
-    // {
-    //     uint32_t pagelength = 512 - (addressI % 512);
-    //     if(lengthI < pagelength)
-    //         pagelength = lengthI;
-
-    //     UPDI_ERROR_CHECK(UPDI_LD(addressI, verifybuf, pagelength));
-
-    //     if(memcmp(verifybuf, dataI, pagelength) != 0)
-    //     {
-    //         ESP_LOGE("UPDI", "UPDI verification failed @ %04X", (unsigned int)addressI);
-    //         for(int a = 0; a < pagelength; a+=16) 
-    //         {
-    //             ESP_LOGE("UPDI", "%02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X| %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X",
-    //                 verifybuf[a],   verifybuf[a+1], verifybuf[a+2],  verifybuf[a+3],  verifybuf[a+4],  verifybuf[a+5],  verifybuf[a+6],  verifybuf[a+7],
-    //                 verifybuf[a+8], verifybuf[a+9], verifybuf[a+10], verifybuf[a+11], verifybuf[a+12], verifybuf[a+13], verifybuf[a+14], verifybuf[a+15],
-    //                 dataI[a],   dataI[a+1], dataI[a+2],  dataI[a+3],  dataI[a+4],  dataI[a+5],  dataI[a+6],  dataI[a+7],
-    //                 dataI[a+8], dataI[a+9], dataI[a+10], dataI[a+11], dataI[a+12], dataI[a+13], dataI[a+14], dataI[a+15]);
-    //         }
-    //         return false;
-    //     }
-
-    //     addressI += pagelength;
-    //     dataI += pagelength;
-    //     lengthI -= pagelength;
-    // }
+        addressI += pagelength;
+        dataI += pagelength;
+        lengthI -= pagelength;
+    }
 
     return true;
 }
@@ -299,10 +430,161 @@ bool UPDI_Program(uart_port_t uart_num, gpio_num_t tx_pin, gpio_num_t rx_pin, ui
     if(!UPDI_EraseChip()) UPDI_ERROR_CHECK(UPDI_EraseChip());
     ESP_LOGI("UPDI", "nvm");
     if(!UPDI_NVMProg()) UPDI_ERROR_CHECK(UPDI_NVMProg());
+#if UPDI_FAST_BAUD > 0
+    ESP_LOGI("UPDI", "high speed");
+    UPDI_HighSpeed();
+#endif
     ESP_LOGI("UPDI", "flash");
-    UPDI_ERROR_CHECK(UPDI_WriteFlashOrEEPROM(0x8000, data, length));
+    UPDI_ERROR_CHECK(UPDI_WriteFlashOrEEPROM(UPDI_FLASH_START, data, length));
     ESP_LOGI("UPDI", "reset");
     UPDI_ERROR_CHECK(UPDI_Reset());
     ESP_LOGI("UPDI", "success!");
     return true;
-}
\ No newline at end of file
+}
+
+//streaming programming. pages are written and verified as soon as they are complete.
+//in delta mode the chip is not erased and pages whose contents already match are skipped
+uint32_t UPDI_stream_address;
+uint8_t UPDI_stream_page[UPDI_PAGE_SIZE];
+uint32_t UPDI_stream_page_length;
+bool UPDI_stream_delta;
+uint32_t UPDI_stream_pages_written;
+uint32_t UPDI_stream_pages_skipped;
+
+static bool UPDI_PageMatches(uint32_t address, const uint8_t *data, uint32_t length)
+{
+    uint8_t readbuf[UPDI_PAGE_SIZE];
+    return UPDI_LDBurst(address, readbuf, length) && memcmp(readbuf, data, length) == 0;
+}
+
+static bool UPDI_PageBlank(uint32_t address)
+{
+    uint8_t readbuf[UPDI_PAGE_SIZE];
+    if(!UPDI_LDBurst(address, readbuf, UPDI_PAGE_SIZE))
+        return false;
+    for(uint32_t i = 0; i < UPDI_PAGE_SIZE; i++)
+        if(readbuf[i] != 0xFF)
+            return false;
+    return true;
+}
+
+static bool UPDI_ErasePage(uint32_t address)
+{
+    UPDI_ERROR_CHECK(UPDI_WaitNVMReady());
+    //a dummy write into the page selects it for the erase
+    UPDI_ERROR_CHECK(UPDI_STSB(address, 0xFF));
+    UPDI_ERROR_CHECK(UPDI_STSB(UPDI_NVMCTRL_CTRLA, 0x2));
+    return UPDI_WaitNVMReady();
+}
+
+static bool UPDI_StreamFlushPage()
+{
+    if(UPDI_stream_page_length == 0)
+        return true;
+    if(UPDI_stream_delta && UPDI_PageMatches(UPDI_stream_address, UPDI_stream_page, UPDI_stream_page_length))
+    {
+        UPDI_stream_pages_skipped++;
+    }
+    else
+    {
+        //erase and write page, so only the pages that differ are erased
+        UPDI_ERROR_CHECK(UPDI_WritePage(UPDI_stream_address, UPDI_stream_page, UPDI_stream_page_length));
+        UPDI_ERROR_CHECK(UPDI_WaitNVMReady());
+        UPDI_ERROR_CHECK(UPDI_VerifyPage(UPDI_stream_address, UPDI_stream_page, UPDI_stream_page_length));
+        UPDI_stream_pages_written++;
+    }
+    UPDI_stream_address += UPDI_stream_page_length;
+    UPDI_stream_page_length = 0;
+    return true;
+}
+
+bool UPDI_ProgramBegin(uart_port_t uart_num, gpio_num_t tx_pin, gpio_num_t rx_pin, bool delta)
+{
+    ESP_LOGI("UPDI", "programming attiny");
+    ESP_LOGI("UPDI", "enable");
+    UPDI_ERROR_CHECK(UPDI_Enable(uart_num, tx_pin, rx_pin));
+    //a locked chip can't be read back or entered without a chip erase
+    if(delta && !UPDI_NVMProg())
+    {
+        ESP_LOGW("UPDI", "NVM programming refused, falling back to chip erase");
+        delta = false;
+    }
+    if(!delta)
+    {
+        ESP_LOGI("UPDI", "erase");
+        if(!UPDI_EraseChip()) UPDI_ERROR_CHECK(UPDI_EraseChip());
+        ESP_LOGI("UPDI", "nvm");
+        if(!UPDI_NVMProg()) UPDI_ERROR_CHECK(UPDI_NVMProg());
+    }
+#if UPDI_FAST_BAUD > 0
+    ESP_LOGI("UPDI", "high speed");
+    UPDI_HighSpeed();
+#endif
+    ESP_LOGI("UPDI", "flash");
+    UPDI_ERROR_CHECK(UPDI_STSB(UPDI_NVMCTRL_CTRLA, 0x4));
+    UPDI_DisableAck();
+    UPDI_stream_address = UPDI_FLASH_START;
+    UPDI_stream_page_length = 0;
+    UPDI_stream_delta = delta;
+    UPDI_stream_pages_written = 0;
+    UPDI_stream_pages_skipped = 0;
+    return true;
+}
+
+bool UPDI_ProgramWrite(const uint8_t *data, uint32_t length)
+{
+    while(length > 0)
+    {
+        uint32_t chunk = UPDI_PAGE_SIZE - UPDI_stream_page_length;
+        if(length < chunk)
+            chunk = length;
+        memcpy(&UPDI_stream_page[UPDI_stream_page_length], data, chunk);
+        UPDI_stream_page_length += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if(UPDI_stream_page_length == UPDI_PAGE_SIZE)
+            UPDI_ERROR_CHECK(UPDI_StreamFlushPage());
+    }
+    return true;
+}
+
+bool UPDI_ProgramEnd()
+{
+    UPDI_ERROR_CHECK(UPDI_StreamFlushPage());
+
+    //the chip wasn't erased, so erase whatever a previous longer image left behind
+    if(UPDI_stream_delta)
+    {
+        for(uint32_t address = (UPDI_stream_address + UPDI_PAGE_SIZE - 1) & ~(UPDI_PAGE_SIZE - 1); address < UPDI_FLASH_START + UPDI_FLASH_SIZE; address += UPDI_PAGE_SIZE)
+        {
+            if(!UPDI_PageBlank(address))
+            {
+                UPDI_ERROR_CHECK(UPDI_ErasePage(address));
+                UPDI_stream_pages_written++;
+            }
+        }
+    }
+    ESP_LOGI("UPDI", "%u pages written, %u unchanged", (unsigned int)UPDI_stream_pages_written, (unsigned int)UPDI_stream_pages_skipped);
+
+    UPDI_EnableAck();
+    ESP_LOGI("UPDI", "reset");
+    UPDI_ERROR_CHECK(UPDI_Reset());
+    ESP_LOGI("UPDI", "success!");
+    return true;
+}
+
+bool UPDI_ProgramAbort()
+{
+    UPDI_stream_page_length = 0;
+    UPDI_EnableAck();
+    ESP_LOGI("UPDI", "abort, %u pages written", (unsigned int)UPDI_stream_pages_written);
+    return UPDI_Reset();
+}
+
+bool UPDI_Provision(uart_port_t uart_num, gpio_num_t tx_pin, gpio_num_t rx_pin, const uint8_t *data, uint32_t length)
+{
+    UPDI_ERROR_CHECK(UPDI_ProgramBegin(uart_num, tx_pin, rx_pin, true));
+    UPDI_ERROR_CHECK(UPDI_ProgramWrite(data, length));
+    return UPDI_ProgramEnd();
+}
@@ -9,13 +9,31 @@
 extern "C" {
 #endif
 
-#define UPDI_RX_BUFFER_LENGTH 1024
+#define UPDI_RX_BUFFER_LENGTH 1024 //must be a power of 2
+#define UPDI_READ_TIMEOUT_TICKS 100
+#define UPDI_RX_SETTLE_TICKS 2 //quiet time after which a flush considers the line drained
+#define UPDI_FAST_BAUD 500000 //baud rate negotiated for programming. 0 keeps programming at 100k
 extern uart_port_t UPDI_uart_num;
-extern uint8_t UPDI_rx_buffer[];
-extern volatile size_t UPDI_rx_buffer_index;
-extern volatile size_t UPDI_rx_buffer_length;
+
+//blocks until length bytes have been received or timeout ticks have passed
+bool UPDI_ReadN(uint8_t *data, size_t length, TickType_t timeout);
+//writes length bytes and checks their echo on the shared line
+bool UPDI_WriteN(const uint8_t *data, size_t length);
+//discards everything received so far plus whatever arrives within settle ticks
+void UPDI_RxFlush(TickType_t settle);
 
 bool UPDI_Program(uart_port_t uart_num, gpio_num_t tx_pin, gpio_num_t rx_pin, uint8_t *data, uint32_t length);
+//streaming version of UPDI_Program. Begin enables and erases, Write programs and verifies each page as soon
+//as it is complete, End writes the last partial page and resets the ATTiny.
+//with delta the chip is not erased, pages that already match are skipped and only differing pages are rewritten
+bool UPDI_ProgramBegin(uart_port_t uart_num, gpio_num_t tx_pin, gpio_num_t rx_pin, bool delta);
+bool UPDI_ProgramWrite(const uint8_t *data, uint32_t length);
+bool UPDI_ProgramEnd();
+//leaves programming after a failed Begin or Write. nothing more is written or erased, the ATTiny is reset
+//with whatever its flash holds by then
+bool UPDI_ProgramAbort();
+//delta program an image, which only touches flash when the ATTiny doesn't already hold it
+bool UPDI_Provision(uart_port_t uart_num, gpio_num_t tx_pin, gpio_num_t rx_pin, const uint8_t *data, uint32_t length);
 bool UPDI_Enable(uart_port_t uart_num, gpio_num_t tx_pin, gpio_num_t rx_pin);
 bool UPDI_Reset();
 
@@ -0,0 +1,352 @@
+#include "ATTinyLink.h"
+#include <cstring>
+#include "esp_heap_caps.h"
+#include "esp_attr.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#include "profiler.h"
+
+#ifdef ATTINYLINK_H
+namespace EmbeddedIOServices
+{
+	ATTinyLinkBus::ATTinyLinkBus() :
+		_count(0),
+		_next(0),
+		_busy(false),
+		_lock(portMUX_INITIALIZER_UNLOCKED)
+	{
+	}
+
+	bool ATTinyLinkBus::Add(ATTinyLink *link)
+	{
+		portENTER_CRITICAL(&_lock);
+		const bool added = _count < ATTINYLINK_MAX_BUS_LINKS;
+		if(added)
+			_links[_count++] = link;
+		portEXIT_CRITICAL(&_lock);
+		return added;
+	}
+
+	void IRAM_ATTR ATTinyLinkBus::Schedule()
+	{
+		//a link whose transaction fails to queue gives the bus back and the links after it get their turn.
+		//it keeps wanting the bus and retries on its next kick
+		for(uint8_t attempt = 0; attempt < ATTINYLINK_MAX_BUS_LINKS; attempt++)
+		{
+			ATTinyLink *link = 0;
+			portENTER_CRITICAL_SAFE(&_lock);
+			if(!_busy)
+			{
+				for(uint8_t n = 0; n < _count; n++)
+				{
+					const uint8_t i = (_next + n) % _count;
+					if(_links[i]->Wants())
+					{
+						link = _links[i];
+						_next = (i + 1) % _count;
+						_busy = true;
+						break;
+					}
+				}
+			}
+			portEXIT_CRITICAL_SAFE(&_lock);
+			if(link == 0 || link->Queue(link->_nextIndex) == ESP_OK)
+				return;
+			portENTER_CRITICAL_SAFE(&_lock);
+			_busy = false;
+			portEXIT_CRITICAL_SAFE(&_lock);
+		}
+	}
+
+	void IRAM_ATTR ATTinyLinkBus::Complete()
+	{
+		portENTER_CRITICAL_SAFE(&_lock);
+		_busy = false;
+		portEXIT_CRITICAL_SAFE(&_lock);
+		Schedule();
+	}
+
+	ATTinyLink::ATTinyLink(ATTiny427ExpanderUpdateService *updateService, DigitalService_ATTiny427Expander *digitalService) :
+		_updateService(updateService),
+		_digitalService(digitalService),
+		_spi(0),
+		_rxLength{0, 0},
+		_rxSequence(0),
+		_rxConsumed(0),
+		_txLength{0, 0},
+		_txPublished(0),
+		_bus(0),
+		_nextIndex(0),
+		_txPending(false),
+		_refreshDue(false),
+		_fastPoll(0),
+		_refreshRate(0),
+		_refreshTimer(0),
+		_rateTransactionCount(0),
+		_rateTime(0),
+		_notifyTask(0),
+		_frameTask(0),
+		_imageMutex(0),
+		TransactionCount(0),
+		QueueFailures(0),
+		TransactionsPerSecond(0),
+		IsrCyclesMax(0)
+	{
+		std::memset(_transaction, 0, sizeof(_transaction));
+		for(uint8_t i = 0; i < 2; i++)
+		{
+			_dmaIn[i] = (uint8_t *)heap_caps_calloc(1, ATTINYLINK_FRAME_SIZE, MALLOC_CAP_DMA);
+			_dmaOut[i] = (uint8_t *)heap_caps_calloc(1, ATTINYLINK_FRAME_SIZE, MALLOC_CAP_DMA);
+			_txFrame[i] = (uint8_t *)calloc(1, ATTINYLINK_FRAME_SIZE);
+			_transaction[i].rx_buffer = _dmaIn[i];
+			_transaction[i].tx_buffer = _dmaOut[i];
+			_transaction[i].user = this;
+		}
+		_rxFrame = (uint8_t *)calloc(1, ATTINYLINK_FRAME_SIZE);
+	}
+
+	ATTinyLink::~ATTinyLink()
+	{
+		if(_refreshTimer != 0)
+		{
+			esp_timer_stop(_refreshTimer);
+			esp_timer_delete(_refreshTimer);
+		}
+		if(_frameTask != 0)
+			vTaskDelete(_frameTask);
+		if(_imageMutex != 0)
+			vSemaphoreDelete(_imageMutex);
+		for(uint8_t i = 0; i < 2; i++)
+		{
+			heap_caps_free(_dmaIn[i]);
+			heap_caps_free(_dmaOut[i]);
+			free(_txFrame[i]);
+		}
+		free(_rxFrame);
+	}
+
+	esp_err_t ATTinyLink::Begin(spi_device_handle_t spi, ATTinyLinkBus *bus)
+	{
+		if(!bus->Add(this))
+			return ESP_ERR_NO_MEM;
+		_bus = bus;
+		Transmit();
+		//the first frame goes out even when the image encodes the same as the empty one
+		_txPending.store(true, std::memory_order_release);
+		_spi = spi;
+		Kick();
+		return ESP_OK;
+	}
+
+	bool ATTinyLink::Receive()
+	{
+		uint32_t sequence;
+		size_t length;
+		//copy the frame out, retry if the ISR reused its buffer while copying
+		do
+		{
+			sequence = _rxSequence.load(std::memory_order_acquire);
+			if(sequence == _rxConsumed)
+				return false;
+			const uint8_t index = (sequence - 1) & 1;
+			length = _rxLength[index];
+			std::memcpy(_rxFrame, _dmaIn[index], length);
+		} while(_rxSequence.load(std::memory_order_acquire) != sequence);
+		_rxConsumed = sequence;
+		const uint32_t startCycles = profiler_start();
+
+		const int64_t now = esp_timer_get_time();
+		if(now - _rateTime >= 1000000)
+		{
+			const uint32_t transactionCount = TransactionCount.load(std::memory_order_relaxed);
+			TransactionsPerSecond = (uint64_t)(transactionCount - _rateTransactionCount) * 1000000 / (now - _rateTime);
+			_rateTransactionCount = transactionCount;
+			_rateTime = now;
+		}
+
+		_updateService->Receive(_rxFrame, length);
+		_digitalService->Update();
+		profiler_end(PROFILER_STAGE_ATTINY_FRAME, startCycles);
+		return true;
+	}
+
+	void ATTinyLink::Transmit()
+	{
+		const uint8_t published = _txPublished.load(std::memory_order_relaxed);
+		const uint8_t index = published ^ 1;
+		_txLength[index] = _updateService->Transmit(_txFrame[index]);
+		const bool changed = _txLength[index] != _txLength[published] || std::memcmp(_txFrame[index], _txFrame[published], _txLength[index]) != 0;
+		if(!changed)
+		{
+			//retries a transaction that failed to queue, a no-op while the bus is busy or nothing is wanted
+			Kick();
+			return;
+		}
+		_txPublished.store(index, std::memory_order_release);
+
+		//send changed outputs now instead of waiting for the next refresh
+		_txPending.store(true, std::memory_order_release);
+		Kick();
+	}
+
+	void ATTinyLink::SetRefreshRate(uint32_t transactionsPerSecond)
+	{
+		//the refresh timer counts whole microseconds, faster rates free run
+		_refreshRate = transactionsPerSecond > 1000000? 0 : transactionsPerSecond;
+		if(_refreshTimer == 0)
+		{
+			const esp_timer_create_args_t timerArgs = {
+				.callback = RefreshTimerCallBack,
+				.arg = this,
+				.dispatch_method = ESP_TIMER_TASK,
+				.name = "attiny_refresh",
+				.skip_unhandled_events = true
+			};
+			ESP_ERROR_CHECK(esp_timer_create(&timerArgs, &_refreshTimer));
+		}
+		esp_timer_stop(_refreshTimer);
+		if(_refreshRate != 0)
+			ESP_ERROR_CHECK(esp_timer_start_periodic(_refreshTimer, 1000000 / _refreshRate));
+		Kick();
+	}
+
+	void ATTinyLink::AttachFastPoll()
+	{
+		_fastPoll.fetch_add(1, std::memory_order_acq_rel);
+		Kick();
+	}
+
+	void ATTinyLink::DetachFastPoll()
+	{
+		_fastPoll.fetch_sub(1, std::memory_order_acq_rel);
+	}
+
+	esp_err_t ATTinyLink::StartFrameTask(UBaseType_t priority, BaseType_t core)
+	{
+		if(_frameTask != 0)
+			return ESP_ERR_INVALID_STATE;
+		_imageMutex = xSemaphoreCreateMutex();
+		if(_imageMutex == 0)
+			return ESP_ERR_NO_MEM;
+		if(xTaskCreatePinnedToCore(FrameTask, "attiny_frame", 4096, this, priority, &_frameTask, core) != pdPASS)
+			return ESP_ERR_NO_MEM;
+		_notifyTask = _frameTask;
+		return ESP_OK;
+	}
+
+	void ATTinyLink::SetNotifyTask(TaskHandle_t task)
+	{
+		if(_frameTask == 0)
+			_notifyTask = task;
+	}
+
+	void ATTinyLink::FrameTask(void *arg)
+	{
+		ATTinyLink *link = reinterpret_cast<ATTinyLink *>(arg);
+		while(1)
+		{
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			xSemaphoreTake(link->_imageMutex, portMAX_DELAY);
+			if(link->Receive())
+				link->Transmit();
+			xSemaphoreGive(link->_imageMutex);
+		}
+	}
+
+	void ATTinyLink::BeginAccess()
+	{
+		if(_frameTask != 0)
+			xSemaphoreTake(_imageMutex, portMAX_DELAY);
+		else
+			Receive();
+	}
+
+	void ATTinyLink::EndAccess()
+	{
+		Transmit();
+		if(_frameTask != 0)
+			xSemaphoreGive(_imageMutex);
+	}
+
+	float ATTinyLink::IsrTimeMax()
+	{
+		return (float)IsrCyclesMax / esp_rom_get_cpu_ticks_per_us();
+	}
+
+	void ATTinyLink::Kick()
+	{
+		if(_spi != 0)
+			_bus->Schedule();
+	}
+
+	bool IRAM_ATTR ATTinyLink::Wants()
+	{
+		return _refreshRate == 0 ||
+			_fastPoll.load(std::memory_order_relaxed) > 0 ||
+			_txPending.load(std::memory_order_acquire) ||
+			_refreshDue.load(std::memory_order_acquire);
+	}
+
+	void ATTinyLink::RefreshTimerCallBack(void *arg)
+	{
+		ATTinyLink *link = reinterpret_cast<ATTinyLink *>(arg);
+		link->_refreshDue.store(true, std::memory_order_release);
+		link->Kick();
+	}
+
+	esp_err_t IRAM_ATTR ATTinyLink::Queue(uint8_t index)
+	{
+		//whatever is published now goes out, so a pending change or refresh is served by this transaction
+		const bool txPending = _txPending.exchange(false, std::memory_order_relaxed);
+		const bool refreshDue = _refreshDue.exchange(false, std::memory_order_relaxed);
+		const uint8_t published = _txPublished.load(std::memory_order_acquire);
+		const size_t length = _txLength[published];
+		std::memcpy(_dmaOut[index], _txFrame[published], length);
+		_transaction[index].length = length * 8;
+		_transaction[index].rxlength = 0;
+		const esp_err_t ret = spi_device_queue_trans(_spi, &_transaction[index], 0);
+		if(ret != ESP_OK)
+		{
+			//nothing went out, the change or refresh is still owed
+			QueueFailures.fetch_add(1, std::memory_order_relaxed);
+			if(txPending)
+				_txPending.store(true, std::memory_order_release);
+			if(refreshDue)
+				_refreshDue.store(true, std::memory_order_release);
+		}
+		return ret;
+	}
+
+	void IRAM_ATTR ATTinyLink::TransactionComplete(spi_transaction_t *t)
+	{
+		const uint32_t startCycles = esp_cpu_get_cycle_count();
+		const uint8_t index = t == &_transaction[0]? 0 : 1;
+		_rxLength[index] = (t->rxlength != 0? t->rxlength : t->length) / 8;
+		_rxSequence.fetch_add(1, std::memory_order_release);
+		TransactionCount.fetch_add(1, std::memory_order_relaxed);
+		profiler_count(PROFILER_COUNTER_SPI_TRANSACTIONS, 1);
+
+		//the completed buffers are left alone until the other transaction completes
+		_nextIndex = index ^ 1;
+		_bus->Complete();
+
+		if(_notifyTask != 0)
+		{
+			BaseType_t higherPriorityTaskWoken = pdFALSE;
+			vTaskNotifyGiveFromISR(_notifyTask, &higherPriorityTaskWoken);
+			if(higherPriorityTaskWoken == pdTRUE)
+				portYIELD_FROM_ISR();
+		}
+
+		const uint32_t cycles = esp_cpu_get_cycle_count() - startCycles;
+		if(cycles > IsrCyclesMax)
+			IsrCyclesMax = cycles;
+		profiler_record(PROFILER_STAGE_ATTINY_ISR, cycles);
+	}
+
+	void IRAM_ATTR ATTinyLink::TransactionCompleteCallBack(spi_transaction_t *t)
+	{
+		reinterpret_cast<ATTinyLink *>(t->user)->TransactionComplete(t);
+	}
+}
+#endif
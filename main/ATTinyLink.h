@@ -0,0 +1,135 @@
+#include <atomic>
+#include "driver/spi_master.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "ATTiny427ExpanderUpdateService.h"
+#include "DigitalService_ATTiny427Expander.h"
+
+#ifndef ATTINYLINK_H
+#define ATTINYLINK_H
+
+#define ATTINYLINK_FRAME_SIZE 1024
+#define ATTINYLINK_MAX_BUS_LINKS 4
+
+namespace EmbeddedIOServices
+{
+	class ATTinyLink;
+
+	// Arbitrates the ATTiny links sharing one SPI bus. Only one transaction is on the bus at a time and when it
+	// completes the bus goes to the next link that wants one, round robin, so a free running or fast polling device
+	// can't starve the others. Every link on a bus keeps its own DMA buffers and CS line
+	class ATTinyLinkBus
+	{
+	protected:
+		ATTinyLink *_links[ATTINYLINK_MAX_BUS_LINKS];
+		uint8_t _count;
+		uint8_t _next;
+		bool _busy;
+		portMUX_TYPE _lock;
+	public:
+		ATTinyLinkBus();
+		bool Add(ATTinyLink *link);
+		// task or ISR context. starts a transaction for the next link that wants one if the bus is free
+		void Schedule();
+		// ISR context. the transaction on the bus completed
+		void Complete();
+	};
+
+	// SPI frame exchange with the ATTiny427 using a ping-pong pair of DMA buffers.
+	// The SPI post callback only swaps buffers: it publishes the received frame under a sequence number and queues
+	// the last frame published by Transmit. The register image is only ever touched by the task calling Receive/Transmit,
+	// so neither side blocks the other. Written for the single core C6, the ISR can never be interrupted by the task.
+	class ATTinyLink
+	{
+	protected:
+		ATTiny427ExpanderUpdateService *_updateService;
+		DigitalService_ATTiny427Expander *_digitalService;
+		spi_device_handle_t _spi;
+		spi_transaction_t _transaction[2];
+		uint8_t *_dmaIn[2];
+		uint8_t *_dmaOut[2];
+
+		//frames received by the ISR. frame n is in _dmaIn[(n - 1) & 1]
+		size_t _rxLength[2];
+		std::atomic<uint32_t> _rxSequence;
+		uint32_t _rxConsumed;
+		uint8_t *_rxFrame;
+
+		//frames encoded by the task, the ISR always sends _txFrame[_txPublished]
+		uint8_t *_txFrame[2];
+		size_t _txLength[2];
+		std::atomic<uint8_t> _txPublished;
+
+		//scheduler. the bus runs at most one transaction of the link, _nextIndex is the buffer pair to use next.
+		//the link wants the bus while free running, fast polling, or with a changed frame or refresh due
+		ATTinyLinkBus *_bus;
+		uint8_t _nextIndex;
+		std::atomic<bool> _txPending;
+		std::atomic<bool> _refreshDue;
+		std::atomic<uint16_t> _fastPoll;
+		uint32_t _refreshRate;
+		esp_timer_handle_t _refreshTimer;
+
+		//achieved transaction rate
+		uint32_t _rateTransactionCount;
+		int64_t _rateTime;
+
+		//deferred frame processing. the ISR notifies _notifyTask on every received frame
+		TaskHandle_t _notifyTask;
+		TaskHandle_t _frameTask;
+		SemaphoreHandle_t _imageMutex;
+
+		// ISR or task context, with the bus reserved for this link
+		esp_err_t Queue(uint8_t index);
+		void Kick();
+		bool Wants();
+		friend class ATTinyLinkBus;
+		static void RefreshTimerCallBack(void *arg);
+		static void FrameTask(void *arg);
+	public:
+		std::atomic<uint32_t> TransactionCount;
+		// transactions spi_device_queue_trans refused, the bus was handed on each time
+		std::atomic<uint32_t> QueueFailures;
+		uint32_t TransactionsPerSecond;
+		uint32_t IsrCyclesMax;
+
+		ATTinyLink(ATTiny427ExpanderUpdateService *updateService, DigitalService_ATTiny427Expander *digitalService);
+		~ATTinyLink();
+		// bus is shared by every link on the same SPI host
+		esp_err_t Begin(spi_device_handle_t spi, ATTinyLinkBus *bus);
+
+		// task context. decodes the newest received frame into the register image and runs the digital service update.
+		// returns false when no new frame arrived since the last call
+		bool Receive();
+		// task context. encodes the register image and publishes it as the next frame to send
+		void Transmit();
+
+		// target transactions per second. 0, or more than 1000000, free runs back to back transactions.
+		// when scheduled, a changed output frame is sent immediately and unchanged frames only at the refresh rate
+		void SetRefreshRate(uint32_t transactionsPerSecond);
+		// free run while at least one fast poll request is held, used while ATTiny input interrupts are attached
+		void AttachFastPoll();
+		void DetachFastPoll();
+
+		// process frames in a pinned task of the given priority as soon as the ISR hands them over, instead of in Loop().
+		// the task and the loop then serialize register image access with a priority inheriting mutex, the ISR never takes it
+		esp_err_t StartFrameTask(UBaseType_t priority, BaseType_t core);
+		// task to notify when a frame is received while no frame task is running
+		void SetNotifyTask(TaskHandle_t task);
+
+		// wrap all register image access from the loop. without a frame task this decodes the newest frame,
+		// and encodes and publishes the next one. with one it excludes the frame task from the register image
+		void BeginAccess();
+		void EndAccess();
+
+		// worst case post callback execution time
+		float IsrTimeMax();
+
+		void TransactionComplete(spi_transaction_t *t);
+		// use as the post_cb of the ATTiny spi device
+		static void TransactionCompleteCallBack(spi_transaction_t *t);
+	};
+}
+#endif
@@ -1,5 +1,7 @@
 #include "Esp32IdfAnalogService.h"
 #include "AnalogService_ATTiny427Expander.h"
+#include "ExpanderPinMap.h"
+
 #ifndef ANALOGSERVICE_EXPANDER_H
 #define ANALOGSERVICE_EXPANDER_H
 namespace EmbeddedIOServices
@@ -8,11 +10,22 @@ namespace EmbeddedIOServices
 	{
 	protected:
 		Esp32::Esp32IdfAnalogService *_esp32AnalogService;
-		AnalogService_ATTiny427Expander *_attinyAnalogService;
+		AnalogService_ATTiny427Expander *_attinyAnalogServices[EXPANDER_ATTINY_DEVICES];
 	public:
-		AnalogService_Expander(Esp32::Esp32IdfAnalogService *esp32AnalogService, AnalogService_ATTiny427Expander *attinyAnalogService);
+		// attinyAnalogServices holds one entry per ATTiny device
+		AnalogService_Expander(Esp32::Esp32IdfAnalogService *esp32AnalogService, AnalogService_ATTiny427Expander *const *attinyAnalogServices);
 		void InitPin(analogpin_t pin);
 		float ReadPin(analogpin_t pin);
+
+		// compile time routed version of ReadPin. the ATTiny backend is called non-virtually
+		template<analogpin_t pin>
+		inline float ReadPin()
+		{
+			constexpr ExpanderPinRoute route = ExpanderPinMap[pin];
+			if constexpr (route.SensePin != EXPANDER_PIN_NONE)
+				return _attinyAnalogServices[route.ATTinyDevice]->AnalogService_ATTiny427Expander::ReadPin(route.SensePin);
+			return 0;
+		}
 	};
 }
 #endif
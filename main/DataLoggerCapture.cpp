@@ -0,0 +1,75 @@
+#include "DataLoggerCapture.h"
+#include <cstring>
+#include "esp_timer.h"
+
+using namespace OperationArchitecture;
+
+#ifdef DATALOGGERCAPTURE_H
+static_assert(sizeof(uint32_t) + sizeof(Variable) <= DATA_LOGGER_MAX_PAYLOAD, "a Variable record must fit DATA_LOGGER_MAX_PAYLOAD");
+
+namespace EmbeddedIOServices
+{
+	DataLoggerCapture::DataLoggerCapture(VariableStore *store, DigitalService_Expander *digitalService, const data_logger_config_t *config) :
+		_store(store),
+		_digitalService(digitalService),
+		_periodUs(config->period_us),
+		_edgePinMask(config->edge_pin_mask),
+		_count(0),
+		_sentSequence(0),
+		_sendAll(true),
+		_levels(0),
+		_nextTime(0)
+	{
+		for(uint16_t i = 0; i < config->variable_count; i++)
+		{
+			const uint16_t slot = _store->Track(config->variable_ids[i]);
+			if(slot == VARIABLESTORE_SLOT_NONE)
+				continue;
+			_store->Watch(slot);
+			_slots[_count++] = slot;
+		}
+		if(_edgePinMask != 0)
+		{
+			//the first levels are logged as edges so the log starts from a known state
+			_levels = ~_digitalService->ReadPins(_edgePinMask) & _edgePinMask;
+		}
+	}
+
+	void DataLoggerCapture::Update()
+	{
+		if(_edgePinMask != 0)
+		{
+			const ExpanderPinMask levels = _digitalService->ReadPins(_edgePinMask);
+			ExpanderPinMask changed = levels ^ _levels;
+			_levels = levels;
+			while(changed != 0)
+			{
+				const uint8_t pin = __builtin_ctzll(changed);
+				changed &= changed - 1;
+				const uint8_t edge[2] = { pin, static_cast<uint8_t>((levels >> pin) & 1) };
+				data_logger_record(DATA_LOGGER_RECORD_EDGE, edge, sizeof(edge));
+			}
+		}
+
+		if(_count == 0)
+			return;
+		const int64_t now = esp_timer_get_time();
+		if(now < _nextTime)
+			return;
+		_nextTime = now + _periodUs;
+
+		uint8_t record[sizeof(uint32_t) + sizeof(Variable)];
+		for(uint16_t i = 0; i < _count; i++)
+		{
+			if(!_sendAll && !_store->ChangedSince(_slots[i], _sentSequence))
+				continue;
+			const uint32_t id = _store->Id(_slots[i]);
+			std::memcpy(record, &id, sizeof(id));
+			std::memcpy(record + sizeof(id), &_store->Snapshot(_slots[i]), sizeof(Variable));
+			data_logger_record(DATA_LOGGER_RECORD_VARIABLE, record, sizeof(record));
+		}
+		_sentSequence = _store->Sequence();
+		_sendAll = false;
+	}
+}
+#endif
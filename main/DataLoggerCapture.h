@@ -0,0 +1,35 @@
+#include <cstdint>
+#include "data_logger.h"
+#include "VariableStore.h"
+#include "DigitalService_Expander.h"
+
+#ifndef DATALOGGERCAPTURE_H
+#define DATALOGGERCAPTURE_H
+
+namespace EmbeddedIOServices
+{
+	// Feeds the data logger from the loop. Variables are read from the VariableStore snapshot and only logged when
+	// they changed, edges are found by comparing one batched read of the configured pins against the previous loop.
+	// Everything is resolved in the constructor, Update() only copies into the logger's preallocated blocks
+	class DataLoggerCapture
+	{
+	protected:
+		VariableStore *_store;
+		DigitalService_Expander *_digitalService;
+		uint32_t _periodUs;
+		ExpanderPinMask _edgePinMask;
+		uint16_t _count;
+		uint16_t _slots[DATA_LOGGER_MAX_VARIABLES];
+		uint32_t _sentSequence;
+		bool _sendAll;
+		ExpanderPinMask _levels;
+		int64_t _nextTime;
+	public:
+		// loop context, the configured variables are watched for as long as the capture runs
+		DataLoggerCapture(VariableStore *store, DigitalService_Expander *digitalService, const data_logger_config_t *config);
+
+		// loop context, after the store's Scan()
+		void Update();
+	};
+}
+#endif
@@ -5,215 +5,198 @@ using namespace Esp32;
 #ifdef DIGITALSERVICE_EXPANDER_H
 namespace EmbeddedIOServices
 {
-    DigitalService_Expander::DigitalService_Expander(Esp32IdfDigitalService *esp32DigitalService, DigitalService_ATTiny427Expander *attinyDigitalService) :
+    DigitalService_Expander::DigitalService_Expander(Esp32IdfDigitalService *esp32DigitalService, DigitalService_ATTiny427Expander *const *attinyDigitalServices, ATTinyLink *const *attinyLinks) :
 		_esp32DigitalService(esp32DigitalService),
-		_attinyDigitalService(attinyDigitalService)
+		_attinyInterruptMask(0)
     {
+		for(uint8_t device = 0; device < EXPANDER_ATTINY_DEVICES; device++)
+		{
+			_attinyDigitalServices[device] = attinyDigitalServices[device];
+			_attinyLinks[device] = attinyLinks != 0? attinyLinks[device] : 0;
+		}
     }
 	
 	void DigitalService_Expander::InitPin(digitalpin_t pin, PinDirection direction)
 	{
-        switch(pin)
-        {
-            case 1:
-				_attinyDigitalService->WritePin(6, 1);
-				_attinyDigitalService->InitPin(6, Out);
-				_attinyDigitalService->InitPin(9, direction);
-				_attinyDigitalService->InitPin(19, In);
-				break;
-            case 3:
-				_esp32DigitalService->InitPin(4, direction);
-				_attinyDigitalService->InitPin(8, In);
-				break;
-            case 4:
-				_attinyDigitalService->InitPin(10, direction);
-				_attinyDigitalService->InitPin(13, In);
-				break;
-            case 5:
-				_esp32DigitalService->InitPin(18, direction);
-				if(In5 == (direction == In))
-					_attinyDigitalService->InitPassthrough(7, 12, false);
-				else
-					_attinyDigitalService->InitPassthrough(12, 7, true);
-				break;
-            case 6:
-				_esp32DigitalService->InitPin(19, direction);
-				if(In6 == (direction == In))
-					_attinyDigitalService->InitPassthrough(5, 14, false);
-				else
-					_attinyDigitalService->InitPassthrough(14, 5, true);
-				break;
-            case 7:
-				_esp32DigitalService->InitPin(20, direction);
-				if(In7 == (direction == In))
-					_attinyDigitalService->InitPassthrough(18, 15, false);
-				else
-					_attinyDigitalService->InitPassthrough(15, 18, true);
-				break;
-            case 10:
+		const ExpanderPinRoute &route = GetExpanderPinRoute(pin);
+		if(direction == Out && route.OutBackend == ExpanderBackend_None)
+			return;
+		if(direction == In && route.InBackend == ExpanderBackend_None)
+			return;
+		if(!ExpanderPinClaim(pin, direction == Out? ExpanderPinMode_DigitalOut : ExpanderPinMode_DigitalIn))
+			return;
+
+		if(route.DisableCAN2)
+		{
+			_attinyDigitalServices[0]->DigitalService_ATTiny427Expander::WritePin(EXPANDER_ATTINY_CAN2_DISABLE_PIN, 1);
+			_attinyDigitalServices[0]->DigitalService_ATTiny427Expander::InitPin(EXPANDER_ATTINY_CAN2_DISABLE_PIN, Out);
+		}
+
+		switch(route.OutBackend)
+		{
+			case ExpanderBackend_Esp32:
+				if(direction == Out && route.OutPresetHigh)
+					_esp32DigitalService->Esp32IdfDigitalService::WritePin(route.OutPin, 1);
+				_esp32DigitalService->Esp32IdfDigitalService::InitPin(route.OutPin, direction);
+				_rawGpioOut[pin] = {};
 				if(direction == Out)
 				{
-					_esp32DigitalService->WritePin(3, 1);
-					_esp32DigitalService->InitPin(3, Out);
-					_attinyDigitalService->WritePin(6, 1);
-					_attinyDigitalService->InitPin(6, Out);
+					_rawGpioOut[pin].Mask = 1UL << route.OutPin;
+					if(route.OutInverted)
+					{
+						_rawGpioOut[pin].HighRegister = GPIO_OUT_W1TC_REG;
+						_rawGpioOut[pin].LowRegister = GPIO_OUT_W1TS_REG;
+					}
 				}
 				break;
-			case 12:
-				_esp32DigitalService->InitPin(9, direction);
-				break;
-			case 13:
-				_esp32DigitalService->InitPin(17, direction);
-				break;
-			case 14:
-				_esp32DigitalService->InitPin(16, direction);
-				break;
-			case 15:
-				_esp32DigitalService->InitPin(5, direction);
+			case ExpanderBackend_ATTiny:
+				_attinyDigitalServices[route.ATTinyDevice]->DigitalService_ATTiny427Expander::InitPin(route.OutPin, direction);
 				break;
-            case 16:
-				_esp32DigitalService->InitPin(21, direction);
-				if(In16 == (direction == In))
-					_attinyDigitalService->InitPassthrough(17, 20., false);
-				else
-					_attinyDigitalService->InitPassthrough(20, 17, true);
+			default:
 				break;
-        }
+		}
+
+		//input read on a separate ATTiny pin
+		if(route.InBackend == ExpanderBackend_ATTiny && route.InPin != route.OutPin)
+			_attinyDigitalServices[route.ATTinyDevice]->DigitalService_ATTiny427Expander::InitPin(route.InPin, In);
+
+		//ATTiny passes the connector through to the ESP32 pin
+		if(route.BridgePin != EXPANDER_PIN_NONE)
+		{
+			if(direction == In)
+				_attinyDigitalServices[route.ATTinyDevice]->InitPassthrough(route.SensePin, route.BridgePin, false);
+			else
+				_attinyDigitalServices[route.ATTinyDevice]->InitPassthrough(route.BridgePin, route.SensePin, true);
+		}
 	}
 	bool DigitalService_Expander::ReadPin(digitalpin_t pin)
 	{
-        switch(pin)
-        {
-            case 1:
-				return _attinyDigitalService->ReadPin(19);
-            case 3:
-				return _attinyDigitalService->ReadPin(8);
-            case 4:
-				return _attinyDigitalService->ReadPin(13);
-            case 5:
-				if(In5)
-					return _esp32DigitalService->ReadPin(18);
-				return _attinyDigitalService->ReadPin(7);
-            case 6:
-				if(In6)
-					return _esp32DigitalService->ReadPin(19);
-				return _attinyDigitalService->ReadPin(5);
-            case 7:
-				if(In7)
-					return _esp32DigitalService->ReadPin(20);
-				return _attinyDigitalService->ReadPin(18);
-            case 12:
-				return _esp32DigitalService->ReadPin(9);
-            case 13:
-				return _esp32DigitalService->ReadPin(17);
-            case 14:
-				return _esp32DigitalService->ReadPin(16);
-            case 15:
-				return _esp32DigitalService->ReadPin(5);
-            case 16:
-				if(In16)
-					return _esp32DigitalService->ReadPin(21);
-				return _attinyDigitalService->ReadPin(17);
-        }
-		return false;
+		const ExpanderPinRoute &route = GetExpanderPinRoute(pin);
+		switch(route.InBackend)
+		{
+			case ExpanderBackend_Esp32:
+#if DIGITALSERVICE_EXPANDER_RAW_GPIO
+				return (REG_READ(GPIO_IN_REG) >> route.InPin) & 1;
+#else
+				return _esp32DigitalService->Esp32IdfDigitalService::ReadPin(route.InPin);
+#endif
+			case ExpanderBackend_ATTiny:
+				return _attinyDigitalServices[route.ATTinyDevice]->DigitalService_ATTiny427Expander::ReadPin(route.InPin);
+			default:
+				return false;
+		}
 	}
 	void DigitalService_Expander::WritePin(digitalpin_t pin, bool value)
 	{
-        switch(pin)
-        {
-            case 1:
-				return _attinyDigitalService->WritePin(9, !value);
-            case 3:
-				return _esp32DigitalService->WritePin(4, value);
-            case 4:
-				return _attinyDigitalService->WritePin(10, value);
-            case 5:
-				return _esp32DigitalService->WritePin(18, !value);
-            case 6:
-				return _esp32DigitalService->WritePin(19, !value);
-            case 7:
-				return _esp32DigitalService->WritePin(20, !value);
-			case 10:
-				return _esp32DigitalService->WritePin(3, value);
-			case 12:
-				return _esp32DigitalService->WritePin(9, value);
-			case 13:
-				return _esp32DigitalService->WritePin(17, value);
-			case 14:
-				return _esp32DigitalService->WritePin(16, value);
-			case 15:
-				return _esp32DigitalService->WritePin(5, value);
-            case 16:
-				return _esp32DigitalService->WritePin(21, !value);
-        }
+#if DIGITALSERVICE_EXPANDER_RAW_GPIO
+		//a single register write for initialized ESP32 outputs
+		if(pin < EXPANDER_PIN_COUNT && _rawGpioOut[pin].Mask != 0)
+		{
+			const RawGpioOut &raw = _rawGpioOut[pin];
+			REG_WRITE(value? raw.HighRegister : raw.LowRegister, raw.Mask);
+			return;
+		}
+#endif
+		const ExpanderPinRoute &route = GetExpanderPinRoute(pin);
+		switch(route.OutBackend)
+		{
+			case ExpanderBackend_Esp32:
+				return _esp32DigitalService->Esp32IdfDigitalService::WritePin(route.OutPin, value != route.OutInverted);
+			case ExpanderBackend_ATTiny:
+				return _attinyDigitalServices[route.ATTinyDevice]->DigitalService_ATTiny427Expander::WritePin(route.OutPin, value != route.OutInverted);
+			default:
+				return;
+		}
+	}
+	ExpanderPinMask DigitalService_Expander::ReadPins(ExpanderPinMask pinMask)
+	{
+		//one snapshot of the ESP32 inputs, only taken when an ESP32 pin is requested
+		const uint32_t esp32In = (pinMask & ExpanderPinMaskEsp32In)? REG_READ(GPIO_IN_REG) : 0;
+
+		ExpanderPinMask values = 0;
+		ExpanderPinMask remaining = pinMask & (ExpanderPinMaskEsp32In | ExpanderPinMaskATTinyIn);
+		while(remaining != 0)
+		{
+			const uint8_t pin = __builtin_ctzll(remaining);
+			remaining &= remaining - 1;
+			const ExpanderPinRoute &route = ExpanderPinMap[pin];
+			bool value;
+			if(route.InBackend == ExpanderBackend_Esp32)
+				value = (esp32In >> route.InPin) & 1;
+			else
+				value = _attinyDigitalServices[route.ATTinyDevice]->DigitalService_ATTiny427Expander::ReadPin(route.InPin);
+			values |= static_cast<ExpanderPinMask>(value) << pin;
+		}
+		return values;
+	}
+	void DigitalService_Expander::WritePins(ExpanderPinMask pinMask, ExpanderPinMask values)
+	{
+		uint32_t esp32Set = 0;
+		uint32_t esp32Clear = 0;
+		ExpanderPinMask remaining = pinMask & (ExpanderPinMaskEsp32Out | ExpanderPinMaskATTinyOut);
+		while(remaining != 0)
+		{
+			const uint8_t pin = __builtin_ctzll(remaining);
+			remaining &= remaining - 1;
+			const ExpanderPinRoute &route = ExpanderPinMap[pin];
+			const bool value = ((values >> pin) & 1) != route.OutInverted;
+			if(route.OutBackend == ExpanderBackend_Esp32)
+			{
+				if(value)
+					esp32Set |= 1UL << route.OutPin;
+				else
+					esp32Clear |= 1UL << route.OutPin;
+			}
+			else
+			{
+				_attinyDigitalServices[route.ATTinyDevice]->DigitalService_ATTiny427Expander::WritePin(route.OutPin, value);
+			}
+		}
+
+		//all ESP32 outputs change in the same two register writes
+		if(esp32Set != 0)
+			REG_WRITE(GPIO_OUT_W1TS_REG, esp32Set);
+		if(esp32Clear != 0)
+			REG_WRITE(GPIO_OUT_W1TC_REG, esp32Clear);
 	}
 	void DigitalService_Expander::AttachInterrupt(digitalpin_t pin, callback_t callBack)
 	{
-        switch(pin)
-        {
-            case 1:
-				return _attinyDigitalService->AttachInterrupt(19, callBack);
-            case 3:
-				return _attinyDigitalService->AttachInterrupt(8, callBack);
-            case 4:
-				return _attinyDigitalService->AttachInterrupt(13, callBack);
-            case 5:
-				if(In5)
-					return _esp32DigitalService->AttachInterrupt(18, callBack);
-				return _attinyDigitalService->AttachInterrupt(7, callBack);
-            case 6:
-				if(In6)
-					return _esp32DigitalService->AttachInterrupt(19, callBack);
-				return _attinyDigitalService->AttachInterrupt(5, callBack);
-            case 7:
-				if(In7)
-					return _esp32DigitalService->AttachInterrupt(20, callBack);
-				return _attinyDigitalService->AttachInterrupt(18, callBack);
-            case 12:
-				return _esp32DigitalService->AttachInterrupt(9, callBack);
-            case 13:
-				return _esp32DigitalService->AttachInterrupt(17, callBack);
-            case 14:
-				return _esp32DigitalService->AttachInterrupt(16, callBack);
-            case 15:
-				return _esp32DigitalService->AttachInterrupt(5, callBack);
-            case 16:
-				if(In16)
-					return _esp32DigitalService->AttachInterrupt(21, callBack);
-				return _attinyDigitalService->AttachInterrupt(17, callBack);
-        }
+		const ExpanderPinRoute &route = GetExpanderPinRoute(pin);
+		switch(route.InBackend)
+		{
+			case ExpanderBackend_Esp32:
+				return _esp32DigitalService->AttachInterrupt(route.InPin, callBack);
+			case ExpanderBackend_ATTiny:
+				_attinyDigitalServices[route.ATTinyDevice]->AttachInterrupt(route.InPin, callBack);
+				//ATTiny inputs are only seen as fast as the link polls
+				if(_attinyLinks[route.ATTinyDevice] != 0 && !(_attinyInterruptMask & ExpanderPinBit(pin)))
+					_attinyLinks[route.ATTinyDevice]->AttachFastPoll();
+				_attinyInterruptMask |= ExpanderPinBit(pin);
+				return;
+			default:
+				return;
+		}
 	}
 	void DigitalService_Expander::DetachInterrupt(digitalpin_t pin)
 	{
-        switch(pin)
-        {
-            case 1:
-				return _attinyDigitalService->DetachInterrupt(19);
-            case 3:
-				return _attinyDigitalService->DetachInterrupt(8);
-            case 4:
-				return _attinyDigitalService->DetachInterrupt(13);
-            case 5:
-				_esp32DigitalService->DetachInterrupt(18);
-				return _attinyDigitalService->DetachInterrupt(7);
-            case 6:
-				_esp32DigitalService->DetachInterrupt(19);
-				return _attinyDigitalService->DetachInterrupt(5);
-            case 7:
-				_esp32DigitalService->DetachInterrupt(20);
-				return _attinyDigitalService->DetachInterrupt(18);
-            case 12:
-				return _esp32DigitalService->DetachInterrupt(9);
-            case 13:
-				return _esp32DigitalService->DetachInterrupt(17);
-            case 14:
-				return _esp32DigitalService->DetachInterrupt(16);
-            case 15:
-				return _esp32DigitalService->DetachInterrupt(5);
-            case 16:
-				_esp32DigitalService->DetachInterrupt(21);
-				return _attinyDigitalService->DetachInterrupt(17);
-        }
+		const ExpanderPinRoute &route = GetExpanderPinRoute(pin);
+		switch(route.InBackend)
+		{
+			case ExpanderBackend_Esp32:
+				_esp32DigitalService->DetachInterrupt(route.InPin);
+				break;
+			case ExpanderBackend_ATTiny:
+				_attinyDigitalServices[route.ATTinyDevice]->DetachInterrupt(route.InPin);
+				if(_attinyLinks[route.ATTinyDevice] != 0 && (_attinyInterruptMask & ExpanderPinBit(pin)))
+					_attinyLinks[route.ATTinyDevice]->DetachFastPoll();
+				_attinyInterruptMask &= ~ExpanderPinBit(pin);
+				break;
+			default:
+				return;
+		}
+		//passthrough pins may have had the interrupt attached on the ATTiny side
+		if(route.BridgePin != EXPANDER_PIN_NONE)
+			_attinyDigitalServices[route.ATTinyDevice]->DetachInterrupt(route.SensePin);
 	}
 }
 #endif
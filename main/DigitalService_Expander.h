@@ -1,26 +1,75 @@
 #include "Esp32IdfDigitalService.h"
 #include "DigitalService_ATTiny427Expander.h"
+#include "ExpanderPinMap.h"
+#include "ATTinyLink.h"
+#include "soc/soc.h"
+#include "soc/gpio_reg.h"
 
 #ifndef DIGITALSERVICE_EXPANDER_H
 #define DIGITALSERVICE_EXPANDER_H
+
+//1 drives ESP32 routed pins straight through the GPIO registers instead of the IDF gpio driver
+#ifndef DIGITALSERVICE_EXPANDER_RAW_GPIO
+#define DIGITALSERVICE_EXPANDER_RAW_GPIO 1
+#endif
 namespace EmbeddedIOServices
 {
 	class DigitalService_Expander : public IDigitalService
 	{
 	protected:
 		Esp32::Esp32IdfDigitalService *_esp32DigitalService;
-		DigitalService_ATTiny427Expander *_attinyDigitalService;
-		bool In5 : 1;
-		bool In6 : 1;
-		bool In7 : 1;
-		bool In16 : 1;
+		DigitalService_ATTiny427Expander *_attinyDigitalServices[EXPANDER_ATTINY_DEVICES];
+		ATTinyLink *_attinyLinks[EXPANDER_ATTINY_DEVICES];
+		ExpanderPinMask _attinyInterruptMask;
+
+		// register writes for an ESP32 output, resolved in InitPin with the board inversion folded into which
+		// register a high or low goes to. Mask 0 until the pin is initialized as an output
+		struct RawGpioOut
+		{
+			uint32_t Mask = 0;
+			uint32_t HighRegister = GPIO_OUT_W1TS_REG;
+			uint32_t LowRegister = GPIO_OUT_W1TC_REG;
+		};
+		RawGpioOut _rawGpioOut[EXPANDER_PIN_COUNT];
 	public:
-		DigitalService_Expander(Esp32::Esp32IdfDigitalService *esp32DigitalService, DigitalService_ATTiny427Expander *attinyDigitalService);
+		// attinyDigitalServices and attinyLinks hold one entry per ATTiny device
+		DigitalService_Expander(Esp32::Esp32IdfDigitalService *esp32DigitalService, DigitalService_ATTiny427Expander *const *attinyDigitalServices, ATTinyLink *const *attinyLinks = 0);
 		void InitPin(digitalpin_t pin, PinDirection direction);
 		bool ReadPin(digitalpin_t pin);
 		void WritePin(digitalpin_t pin, bool value);
 		void AttachInterrupt(digitalpin_t pin, callback_t callBack);
 		void DetachInterrupt(digitalpin_t pin);
+
+		// batched versions of ReadPin/WritePin. bit n of the masks is expander pin n.
+		// ESP32 pins are resolved with a single GPIO register access, ATTiny pins in one pass over the register image
+		ExpanderPinMask ReadPins(ExpanderPinMask pinMask);
+		void WritePins(ExpanderPinMask pinMask, ExpanderPinMask values);
+
+		// compile time routed versions of ReadPin/WritePin for callers that know the expander pin up front.
+		// the route is resolved at compile time and the backend is called non-virtually
+		template<digitalpin_t pin>
+		inline bool ReadPin()
+		{
+			constexpr ExpanderPinRoute route = ExpanderPinMap[pin];
+			if constexpr (route.InBackend == ExpanderBackend_Esp32 && DIGITALSERVICE_EXPANDER_RAW_GPIO)
+				return (REG_READ(GPIO_IN_REG) >> route.InPin) & 1;
+			else if constexpr (route.InBackend == ExpanderBackend_Esp32)
+				return _esp32DigitalService->Esp32::Esp32IdfDigitalService::ReadPin(route.InPin);
+			else if constexpr (route.InBackend == ExpanderBackend_ATTiny)
+				return _attinyDigitalServices[route.ATTinyDevice]->DigitalService_ATTiny427Expander::ReadPin(route.InPin);
+			return false;
+		}
+		template<digitalpin_t pin>
+		inline void WritePin(bool value)
+		{
+			constexpr ExpanderPinRoute route = ExpanderPinMap[pin];
+			if constexpr (route.OutBackend == ExpanderBackend_Esp32 && DIGITALSERVICE_EXPANDER_RAW_GPIO)
+				REG_WRITE((value != route.OutInverted)? GPIO_OUT_W1TS_REG : GPIO_OUT_W1TC_REG, 1UL << route.OutPin);
+			else if constexpr (route.OutBackend == ExpanderBackend_Esp32)
+				_esp32DigitalService->Esp32::Esp32IdfDigitalService::WritePin(route.OutPin, value != route.OutInverted);
+			else if constexpr (route.OutBackend == ExpanderBackend_ATTiny)
+				_attinyDigitalServices[route.ATTinyDevice]->DigitalService_ATTiny427Expander::WritePin(route.OutPin, value != route.OutInverted);
+		}
 	};
 }
 #endif
@@ -0,0 +1,129 @@
+#include <stdint.h>
+
+#ifndef EXPANDERPINMAP_H
+#define EXPANDERPINMAP_H
+
+#define EXPANDER_PIN_COUNT 17
+#define EXPANDER_PIN_NONE 0xFF
+#define EXPANDER_ATTINY_CAN2_DISABLE_PIN 6 //on ATTiny device 0
+#define EXPANDER_ATTINY_DEVICES 1 //ATTiny427s on the SPI bus, each with its own CS line
+
+namespace EmbeddedIOServices
+{
+	enum ExpanderBackend : uint8_t
+	{
+		ExpanderBackend_None = 0,
+		ExpanderBackend_Esp32 = 1,
+		ExpanderBackend_ATTiny = 2
+	};
+
+	// Board routing of a single expander pin. This is the only place the board pin map lives,
+	// the Digital, Analog and Pwm expander services all dispatch from it. ATTiny pins are addressed as
+	// (ATTinyDevice, pin), pins of additional ATTiny devices are added as routes with their ATTinyDevice set.
+	struct ExpanderPinRoute
+	{
+		ExpanderBackend OutBackend = ExpanderBackend_None;	// backend driving the pin when it is an output
+		uint8_t OutPin = EXPANDER_PIN_NONE;					// native pin on OutBackend
+		bool OutInverted = false;							// digital writes are inverted by the board
+		bool PwmOutInverted = false;						// pwm writes are inverted by the board
+		bool OutPresetHigh = false;							// drive high before switching to output (shared with a CAN TX line)
+		ExpanderBackend InBackend = ExpanderBackend_None;	// backend reading the pin when it is an input
+		uint8_t InPin = EXPANDER_PIN_NONE;					// native pin on InBackend
+		uint8_t SensePin = EXPANDER_PIN_NONE;				// ATTiny pin wired to the connector, used for analog and as the passthrough source
+		uint8_t BridgePin = EXPANDER_PIN_NONE;				// ATTiny pin wired to the ESP32 pin when the ATTiny passes the signal through
+		bool DisableCAN2 = false;							// connector is shared with the CAN2 transceiver, which must be put in standby
+		bool Pwm = false;									// pin is pwm capable
+		uint8_t ATTinyDevice = 0;							// ATTiny serving the ATTiny pins of this route
+	};
+
+	inline constexpr ExpanderPinRoute ExpanderPinMap[EXPANDER_PIN_COUNT] =
+	{
+		/* 0 */ {},
+		/* 1 */ { .OutBackend = ExpanderBackend_ATTiny, .OutPin = 9, .OutInverted = true, .InBackend = ExpanderBackend_ATTiny, .InPin = 19, .SensePin = 19, .DisableCAN2 = true, .Pwm = true },
+		/* 2 */ {},
+		/* 3 */ { .OutBackend = ExpanderBackend_Esp32, .OutPin = 4, .PwmOutInverted = true, .InBackend = ExpanderBackend_ATTiny, .InPin = 8, .SensePin = 8, .Pwm = true },
+		/* 4 */ { .OutBackend = ExpanderBackend_ATTiny, .OutPin = 10, .InBackend = ExpanderBackend_ATTiny, .InPin = 13, .SensePin = 13, .Pwm = true },
+		/* 5 */ { .OutBackend = ExpanderBackend_Esp32, .OutPin = 18, .OutInverted = true, .PwmOutInverted = true, .InBackend = ExpanderBackend_Esp32, .InPin = 18, .SensePin = 7, .BridgePin = 12, .Pwm = true },
+		/* 6 */ { .OutBackend = ExpanderBackend_Esp32, .OutPin = 19, .OutInverted = true, .PwmOutInverted = true, .InBackend = ExpanderBackend_Esp32, .InPin = 19, .SensePin = 5, .BridgePin = 14, .Pwm = true },
+		/* 7 */ { .OutBackend = ExpanderBackend_Esp32, .OutPin = 20, .OutInverted = true, .PwmOutInverted = true, .InBackend = ExpanderBackend_Esp32, .InPin = 20, .SensePin = 18, .BridgePin = 15, .Pwm = true },
+		/* 8 */ {},
+		/* 9 */ {},
+		/* 10 */ { .OutBackend = ExpanderBackend_Esp32, .OutPin = 3, .PwmOutInverted = true, .OutPresetHigh = true, .DisableCAN2 = true, .Pwm = true },
+		/* 11 */ {},
+		/* 12 */ { .OutBackend = ExpanderBackend_Esp32, .OutPin = 9, .InBackend = ExpanderBackend_Esp32, .InPin = 9 },
+		/* 13 */ { .OutBackend = ExpanderBackend_Esp32, .OutPin = 17, .InBackend = ExpanderBackend_Esp32, .InPin = 17, .Pwm = true },
+		/* 14 */ { .OutBackend = ExpanderBackend_Esp32, .OutPin = 16, .InBackend = ExpanderBackend_Esp32, .InPin = 16, .Pwm = true },
+		/* 15 */ { .OutBackend = ExpanderBackend_Esp32, .OutPin = 5, .InBackend = ExpanderBackend_Esp32, .InPin = 5 },
+		/* 16 */ { .OutBackend = ExpanderBackend_Esp32, .OutPin = 21, .OutInverted = true, .PwmOutInverted = true, .InBackend = ExpanderBackend_Esp32, .InPin = 21, .SensePin = 17, .BridgePin = 20, .Pwm = true }
+	};
+
+	inline constexpr ExpanderPinRoute ExpanderPinRouteNone = {};
+
+	// bit n is expander pin n. wide enough for the routes of more ATTiny devices than the board has
+	typedef uint64_t ExpanderPinMask;
+	static_assert(EXPANDER_PIN_COUNT <= 64, "expander pin masks are 64 bits");
+	constexpr ExpanderPinMask ExpanderPinBit(uint16_t pin)
+	{
+		return static_cast<ExpanderPinMask>(1) << pin;
+	}
+
+	// masks of expander pins grouped by the backend that serves them
+	constexpr ExpanderPinMask ExpanderPinMaskOut(ExpanderBackend backend)
+	{
+		ExpanderPinMask mask = 0;
+		for(uint8_t pin = 0; pin < EXPANDER_PIN_COUNT; pin++)
+			if(ExpanderPinMap[pin].OutBackend == backend)
+				mask |= ExpanderPinBit(pin);
+		return mask;
+	}
+	constexpr ExpanderPinMask ExpanderPinMaskIn(ExpanderBackend backend)
+	{
+		ExpanderPinMask mask = 0;
+		for(uint8_t pin = 0; pin < EXPANDER_PIN_COUNT; pin++)
+			if(ExpanderPinMap[pin].InBackend == backend)
+				mask |= ExpanderPinBit(pin);
+		return mask;
+	}
+	inline constexpr ExpanderPinMask ExpanderPinMaskEsp32Out = ExpanderPinMaskOut(ExpanderBackend_Esp32);
+	inline constexpr ExpanderPinMask ExpanderPinMaskATTinyOut = ExpanderPinMaskOut(ExpanderBackend_ATTiny);
+	inline constexpr ExpanderPinMask ExpanderPinMaskEsp32In = ExpanderPinMaskIn(ExpanderBackend_Esp32);
+	inline constexpr ExpanderPinMask ExpanderPinMaskATTinyIn = ExpanderPinMaskIn(ExpanderBackend_ATTiny);
+
+	inline constexpr const ExpanderPinRoute &GetExpanderPinRoute(uint16_t pin)
+	{
+		return pin < EXPANDER_PIN_COUNT? ExpanderPinMap[pin] : ExpanderPinRouteNone;
+	}
+
+	enum ExpanderPinMode : uint8_t
+	{
+		ExpanderPinMode_None = 0,
+		ExpanderPinMode_DigitalIn = 1,
+		ExpanderPinMode_DigitalOut = 2,
+		ExpanderPinMode_Analog = 3,
+		ExpanderPinMode_PwmIn = 4,
+		ExpanderPinMode_PwmOut = 5,
+		ExpanderPinMode_TimedOut = 6
+	};
+
+	// mode each expander pin was last initialized to, shared by the expander services. a reloaded config
+	// only re-initializes pins whose mode changed, so unchanged outputs keep being driven across the swap
+	struct ExpanderPinState
+	{
+		ExpanderPinMode Mode = ExpanderPinMode_None;
+		uint16_t MinFrequency = 0;
+	};
+	inline ExpanderPinState ExpanderPinStates[EXPANDER_PIN_COUNT];
+
+	// records the mode of pin. returns false when the pin is already initialized that way and InitPin can be skipped
+	inline bool ExpanderPinClaim(uint16_t pin, ExpanderPinMode mode, uint16_t minFrequency = 0)
+	{
+		if(pin >= EXPANDER_PIN_COUNT)
+			return false;
+		ExpanderPinState &state = ExpanderPinStates[pin];
+		if(state.Mode == mode && state.MinFrequency == minFrequency)
+			return false;
+		state = { mode, minFrequency };
+		return true;
+	}
+}
+#endif
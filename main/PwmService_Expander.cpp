@@ -5,147 +5,149 @@ using namespace Esp32;
 #ifdef PWMSERVICE_EXPANDER_H
 namespace EmbeddedIOServices
 {
-    PwmService_Expander::PwmService_Expander(Esp32IdfPwmService *esp32PwmService, PwmService_ATTiny427Expander *attinyPwmService, DigitalService_ATTiny427Expander *attinyDigitalService) :
+    PwmService_Expander::PwmService_Expander(Esp32IdfPwmService *esp32PwmService, PwmService_ATTiny427Expander *const *attinyPwmServices, DigitalService_ATTiny427Expander *const *attinyDigitalServices) :
 		_esp32PwmService(esp32PwmService),
-		_attinyPwmService(attinyPwmService),
-		_attinyDigitalService(attinyDigitalService)
+		_writtenMask(0)
     {
+		for(uint8_t device = 0; device < EXPANDER_ATTINY_DEVICES; device++)
+		{
+			_attinyPwmServices[device] = attinyPwmServices[device];
+			_attinyDigitalServices[device] = attinyDigitalServices[device];
+		}
+		for(pwmpin_t pin = 0; pin < EXPANDER_PIN_COUNT; pin++)
+		{
+			_capture[pin] = -1;
+			_timedOutput[pin] = -1;
+		}
     }
+
+	void PwmService_Expander::ReleaseTimed(pwmpin_t pin)
+	{
+		timed_io_capture_release(_capture[pin]);
+		timed_io_output_release(_timedOutput[pin]);
+		_capture[pin] = -1;
+		_timedOutput[pin] = -1;
+	}
 	
 	void PwmService_Expander::InitPin(pwmpin_t pin, PinDirection direction, uint16_t minFrequency)
 	{
-        switch(pin)
-        {
-			case 1:
-				if(direction == Out)
-				{
-					_attinyDigitalService->InitPin(6, Out);
-					_attinyDigitalService->WritePin(6, true);//disable CAN2
-					_attinyPwmService->InitPin(9, Out, minFrequency);
-				}
-				else
-				{
-					_attinyPwmService->InitPin(19, In, minFrequency);
-				}
-				break;
-			case 3:
-				if(direction == Out)
-				{
-					_esp32PwmService->InitPin(4, Out, minFrequency);
-				}
-				else
-				{
-					_attinyPwmService->InitPin(8, In, minFrequency);
-				}
-				break;
-			case 4:
-				if(direction == Out)
-				{
-					_attinyPwmService->InitPin(10, Out, minFrequency);
-				}
-				else
-				{
-					_attinyPwmService->InitPin(13, In, minFrequency);
-				}
-				break;
-			case 5:
-				if(direction == Out)
-				{
-					_attinyDigitalService->InitPassthrough(12,7,true);
-					_esp32PwmService->InitPin(18, Out, minFrequency);
-				}
-				else
-				{
-					_attinyDigitalService->InitPassthrough(7,12,false);
-					_esp32PwmService->InitPin(18, In, minFrequency);
-				}
-				break;
-			case 10:
-				if(direction == Out)
-				{
-					_esp32PwmService->InitPin(3, Out, minFrequency);
-					_attinyDigitalService->InitPin(6, Out);
-					_attinyDigitalService->WritePin(6, true);//disable CAN2
-				}
-				break;
-			case 13:
-					_esp32PwmService->InitPin(17, direction, minFrequency);
-				break;
-			case 14:
-					_esp32PwmService->InitPin(16, direction, minFrequency);
-				break;
-        }
+		const ExpanderPinRoute &route = GetExpanderPinRoute(pin);
+		if(!route.Pwm)
+			return;
+		if(direction == Out && route.OutBackend == ExpanderBackend_None)
+			return;
+		if(direction == In && route.InBackend == ExpanderBackend_None)
+			return;
+		if(!ExpanderPinClaim(pin, direction == Out? ExpanderPinMode_PwmOut : ExpanderPinMode_PwmIn, minFrequency))
+			return;
+		ReleaseTimed(pin);
+		_writtenMask &= ~ExpanderPinBit(pin);
+
+		if(route.DisableCAN2)
+		{
+			_attinyDigitalServices[0]->DigitalService_ATTiny427Expander::WritePin(EXPANDER_ATTINY_CAN2_DISABLE_PIN, true);
+			_attinyDigitalServices[0]->DigitalService_ATTiny427Expander::InitPin(EXPANDER_ATTINY_CAN2_DISABLE_PIN, Out);
+		}
+
+		//ATTiny passes the connector through to the ESP32 pin
+		if(route.BridgePin != EXPANDER_PIN_NONE)
+		{
+			if(direction == In)
+				_attinyDigitalServices[route.ATTinyDevice]->InitPassthrough(route.SensePin, route.BridgePin, false);
+			else
+				_attinyDigitalServices[route.ATTinyDevice]->InitPassthrough(route.BridgePin, route.SensePin, true);
+		}
+
+		const ExpanderBackend backend = direction == Out? route.OutBackend : route.InBackend;
+		const uint8_t nativePin = direction == Out? route.OutPin : route.InPin;
+		switch(backend)
+		{
+			case ExpanderBackend_Esp32:
+				//inputs are timestamped by MCPWM capture while channels last. quiet for two periods of minFrequency reads 0
+				if(direction == In)
+					_capture[pin] = timed_io_capture_init(static_cast<gpio_num_t>(nativePin), minFrequency > 0? 2000000 / minFrequency : 1000000);
+				if(_capture[pin] < 0)
+					_esp32PwmService->Esp32IdfPwmService::InitPin(nativePin, direction, minFrequency);
+				break;
+			case ExpanderBackend_ATTiny:
+				_attinyPwmServices[route.ATTinyDevice]->PwmService_ATTiny427Expander::InitPin(nativePin, direction, minFrequency);
+				break;
+			default:
+				break;
+		}
 	}
 	PwmValue PwmService_Expander::ReadPin(pwmpin_t pin)
 	{
-		PwmValue value = PwmValue();
-        switch(pin)
-        {
-			case 1:
-				value = _attinyPwmService->ReadPin(19);
-				break;
-			case 3:
-				value = _attinyPwmService->ReadPin(8);
-				break;
-			case 4:
-				value = _attinyPwmService->ReadPin(13);
-				break;
-			case 5:
-				value = _esp32PwmService->ReadPin(18);
-				break;
-			case 6:
-				value = _esp32PwmService->ReadPin(19);
-				break;
-			case 7:
-				value = _esp32PwmService->ReadPin(20);
-				break;
-			case 13:
-				value = _esp32PwmService->ReadPin(17);
-				break;
-			case 14:
-				value = _esp32PwmService->ReadPin(16);
-				break;
-			case 16:
-				value = _esp32PwmService->ReadPin(21);
-				break;
-        }
-		return value;
+		const ExpanderPinRoute &route = GetExpanderPinRoute(pin);
+		if(!route.Pwm)
+			return PwmValue();
+		switch(route.InBackend)
+		{
+			case ExpanderBackend_Esp32:
+				if(_capture[pin] >= 0)
+				{
+					float period;
+					float pulseWidth;
+					timed_io_capture_read(_capture[pin], &period, &pulseWidth);
+					return { period, pulseWidth };
+				}
+				return _esp32PwmService->Esp32IdfPwmService::ReadPin(route.InPin);
+			case ExpanderBackend_ATTiny:
+				return _attinyPwmServices[route.ATTinyDevice]->PwmService_ATTiny427Expander::ReadPin(route.InPin);
+			default:
+				return PwmValue();
+		}
 	}
 	void PwmService_Expander::WritePin(pwmpin_t pin, PwmValue value)
 	{
-        switch(pin)
-        {
-			case 1:
-				_attinyPwmService->WritePin(9, value);
-				break;
-			case 3:
-				_esp32PwmService->WritePin(4, { value.Period, value.Period - value.PulseWidth });
-				break;
-			case 4:
-				_attinyPwmService->WritePin(10, value);
-				break;
-			case 5:
-				_esp32PwmService->WritePin(18, { value.Period, value.Period - value.PulseWidth });
-				break;
-			case 6:
-				_esp32PwmService->WritePin(19, { value.Period, value.Period - value.PulseWidth });
-				break;
-			case 7:
-				_esp32PwmService->WritePin(20, { value.Period, value.Period - value.PulseWidth });
-				break;
-			case 10:
-				_esp32PwmService->WritePin(3, { value.Period, value.Period - value.PulseWidth });
-				break;
-			case 13:
-				_esp32PwmService->WritePin(17, value);
-				break;
-			case 14:
-				_esp32PwmService->WritePin(16, value);
-				break;
-			case 16:
-				_esp32PwmService->WritePin(21, { value.Period, value.Period - value.PulseWidth });
-				break;
-        }
+		const ExpanderPinRoute &route = GetExpanderPinRoute(pin);
+		if(!route.Pwm || _timedOutput[pin] >= 0)
+			return;
+		//configs write every loop, only changes reach the backends
+		if((_writtenMask & ExpanderPinBit(pin)) && _written[pin].Period == value.Period && _written[pin].PulseWidth == value.PulseWidth)
+			return;
+		_written[pin] = value;
+		_writtenMask |= ExpanderPinBit(pin);
+		if(route.PwmOutInverted)
+			value = { value.Period, value.Period - value.PulseWidth };
+		switch(route.OutBackend)
+		{
+			case ExpanderBackend_Esp32:
+				_esp32PwmService->Esp32IdfPwmService::WritePin(route.OutPin, value);
+				break;
+			case ExpanderBackend_ATTiny:
+				_attinyPwmServices[route.ATTinyDevice]->PwmService_ATTiny427Expander::WritePin(route.OutPin, value);
+				break;
+			default:
+				break;
+		}
+	}
+	esp_err_t PwmService_Expander::ScheduleEdges(pwmpin_t pin, const timed_io_edge_t *edges, size_t count)
+	{
+		const ExpanderPinRoute &route = GetExpanderPinRoute(pin);
+		if(route.OutBackend != ExpanderBackend_Esp32 || count > TIMED_IO_MAX_EDGES)
+			return ESP_ERR_INVALID_ARG;
+
+		if(_timedOutput[pin] < 0)
+		{
+			if(route.DisableCAN2)
+			{
+				_attinyDigitalServices[0]->DigitalService_ATTiny427Expander::WritePin(EXPANDER_ATTINY_CAN2_DISABLE_PIN, true);
+				_attinyDigitalServices[0]->DigitalService_ATTiny427Expander::InitPin(EXPANDER_ATTINY_CAN2_DISABLE_PIN, Out);
+			}
+			ExpanderPinClaim(pin, ExpanderPinMode_TimedOut);
+			ReleaseTimed(pin);
+			_writtenMask &= ~ExpanderPinBit(pin);
+			_timedOutput[pin] = timed_io_output_init(static_cast<gpio_num_t>(route.OutPin), route.OutInverted);
+			if(_timedOutput[pin] < 0)
+				return ESP_ERR_NOT_FOUND;
+		}
+
+		//RMT drives the pin like a GPIO, so the digital inversion of the board applies
+		timed_io_edge_t native[TIMED_IO_MAX_EDGES];
+		for(size_t i = 0; i < count; i++)
+			native[i] = { edges[i].time_ns, edges[i].level != route.OutInverted };
+		return timed_io_output_schedule(_timedOutput[pin], native, count);
 	}
 }
 #endif
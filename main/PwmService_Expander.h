@@ -1,6 +1,8 @@
 #include "Esp32IdfPwmService.h"
 #include "PwmService_ATTiny427Expander.h"
 #include "DigitalService_ATTiny427Expander.h"
+#include "ExpanderPinMap.h"
+#include "timed_io.h"
 
 #ifndef PWMSERVICE_EXPANDER_H
 #define PWMSERVICE_EXPANDER_H
@@ -10,13 +12,27 @@ namespace EmbeddedIOServices
 	{
 	protected:
 		Esp32::Esp32IdfPwmService *_esp32PwmService;
-		PwmService_ATTiny427Expander *_attinyPwmService;
-		DigitalService_ATTiny427Expander *_attinyDigitalService;
+		PwmService_ATTiny427Expander *_attinyPwmServices[EXPANDER_ATTINY_DEVICES];
+		DigitalService_ATTiny427Expander *_attinyDigitalServices[EXPANDER_ATTINY_DEVICES];
+
+		//last value written per pin, bit n of _writtenMask is set while _written[n] is current
+		PwmValue _written[EXPANDER_PIN_COUNT];
+		ExpanderPinMask _writtenMask;
+		//ESP32 inputs measured by MCPWM capture and outputs handed to RMT, -1 when the pin has none
+		timed_io_handle_t _capture[EXPANDER_PIN_COUNT];
+		timed_io_handle_t _timedOutput[EXPANDER_PIN_COUNT];
+
+		void ReleaseTimed(pwmpin_t pin);
 	public:
-		PwmService_Expander(Esp32::Esp32IdfPwmService *esp32PwmService, PwmService_ATTiny427Expander *attinyPwmService, DigitalService_ATTiny427Expander *attinyDigitalService);
+		// attinyPwmServices and attinyDigitalServices hold one entry per ATTiny device
+		PwmService_Expander(Esp32::Esp32IdfPwmService *esp32PwmService, PwmService_ATTiny427Expander *const *attinyPwmServices, DigitalService_ATTiny427Expander *const *attinyDigitalServices);
 		void InitPin(pwmpin_t pin, PinDirection direction, uint16_t minFrequency);
 		PwmValue ReadPin(pwmpin_t pin);
 		void WritePin(pwmpin_t pin, PwmValue value);
+
+		// plays an absolute time edge list on an ESP32 routed output, levels are before the board inversion.
+		// the pin leaves pwm for RMT on the first call and returns to pwm on its next InitPin
+		esp_err_t ScheduleEdges(pwmpin_t pin, const timed_io_edge_t *edges, size_t count);
 	};
 }
 #endif
@@ -0,0 +1,77 @@
+#include "VariableStore.h"
+#include <cstring>
+
+using namespace OperationArchitecture;
+
+#ifdef VARIABLESTORE_H
+namespace EmbeddedIOServices
+{
+	VariableStore::VariableStore(GeneratorMap<Variable> *variableMap) :
+		_variableMap(variableMap),
+		_watchedCount(0),
+		_count(0),
+		_sequence(1)
+	{
+		std::memset(_changed, 0, sizeof(_changed));
+		std::memset(_watchers, 0, sizeof(_watchers));
+	}
+
+	uint16_t VariableStore::Track(uint32_t id)
+	{
+		const uint16_t count = _count.load(std::memory_order_relaxed);
+		for(uint16_t slot = 0; slot < count; slot++)
+		{
+			if(_ids[slot] == id)
+				return slot;
+		}
+		if(count >= VARIABLESTORE_MAX_VARIABLES)
+			return VARIABLESTORE_SLOT_NONE;
+
+		const uint16_t slot = count;
+		_ids[slot] = id;
+		_variables[slot] = _variableMap->GenerateValue(id);
+		std::memcpy(&_snapshot[slot], _variables[slot], sizeof(Variable));
+		//a new slot counts as changed so consumers pick up its first value
+		_changed[slot] = _sequence;
+		_count.store(count + 1, std::memory_order_release);
+		return slot;
+	}
+
+	void VariableStore::Watch(uint16_t slot)
+	{
+		if(_watchers[slot]++ != 0)
+			return;
+		//the snapshot went stale while nobody watched, start from the current value
+		std::memcpy(&_snapshot[slot], _variables[slot], sizeof(Variable));
+		_changed[slot] = _sequence;
+		_watched[_watchedCount++] = slot;
+	}
+
+	void VariableStore::Unwatch(uint16_t slot)
+	{
+		if(_watchers[slot] == 0 || --_watchers[slot] != 0)
+			return;
+		for(uint16_t i = 0; i < _watchedCount; i++)
+		{
+			if(_watched[i] == slot)
+			{
+				_watched[i] = _watched[--_watchedCount];
+				return;
+			}
+		}
+	}
+
+	void VariableStore::Scan()
+	{
+		_sequence++;
+		for(uint16_t i = 0; i < _watchedCount; i++)
+		{
+			const uint16_t slot = _watched[i];
+			if(std::memcmp(&_snapshot[slot], _variables[slot], sizeof(Variable)) == 0)
+				continue;
+			std::memcpy(&_snapshot[slot], _variables[slot], sizeof(Variable));
+			_changed[slot] = _sequence;
+		}
+	}
+}
+#endif
@@ -0,0 +1,59 @@
+#include <atomic>
+#include <cstdint>
+#include "GeneratorMap.h"
+#include "Variable.h"
+
+#ifndef VARIABLESTORE_H
+#define VARIABLESTORE_H
+
+#define VARIABLESTORE_MAX_VARIABLES 256
+#define VARIABLESTORE_SLOT_NONE 0xFFFF
+
+namespace EmbeddedIOServices
+{
+	// Slot indexed view of the variables that streaming and logging read every loop. The variables themselves stay where
+	// the GeneratorMap ExpanderMain and the EFIGenie handler are built on puts them, the store only resolves each id once
+	// into a stable slot and keeps a snapshot of the slots a consumer watches. Scan() refreshes only those once per loop
+	// and stamps every slot that changed with the scan sequence, so any number of consumers can find changed values by
+	// comparing against the sequence they last saw, without touching the map or the live variables
+	class VariableStore
+	{
+	protected:
+		OperationArchitecture::GeneratorMap<OperationArchitecture::Variable> *_variableMap;
+		uint32_t _ids[VARIABLESTORE_MAX_VARIABLES];
+		OperationArchitecture::Variable *_variables[VARIABLESTORE_MAX_VARIABLES];
+		OperationArchitecture::Variable _snapshot[VARIABLESTORE_MAX_VARIABLES];
+		uint32_t _changed[VARIABLESTORE_MAX_VARIABLES];
+		//loop context. consumers per slot and the slots with at least one, in no particular order
+		uint8_t _watchers[VARIABLESTORE_MAX_VARIABLES];
+		uint16_t _watched[VARIABLESTORE_MAX_VARIABLES];
+		uint16_t _watchedCount;
+		//published after the slot is filled, Track may run on another task than Scan
+		std::atomic<uint16_t> _count;
+		uint32_t _sequence;
+	public:
+		VariableStore(OperationArchitecture::GeneratorMap<OperationArchitecture::Variable> *variableMap);
+
+		// slot of id, allocating one the first time. VARIABLESTORE_SLOT_NONE when the store is full.
+		// not for the hot path, resolve once and keep the slot. generates into the map, so callers hold whatever
+		// serializes the map, calls are not safe against each other
+		uint16_t Track(uint32_t id);
+
+		// loop context. Scan keeps the snapshot of a slot current while at least one consumer watches it,
+		// every Watch needs a matching Unwatch
+		void Watch(uint16_t slot);
+		void Unwatch(uint16_t slot);
+
+		// loop context. copies every watched variable into the snapshot and marks the ones that changed
+		void Scan();
+
+		inline uint16_t Count() const { return _count.load(std::memory_order_acquire); }
+		inline uint32_t Id(uint16_t slot) const { return _ids[slot]; }
+		inline uint32_t Sequence() const { return _sequence; }
+		inline OperationArchitecture::Variable *Live(uint16_t slot) const { return _variables[slot]; }
+		inline const OperationArchitecture::Variable &Snapshot(uint16_t slot) const { return _snapshot[slot]; }
+		// watched slot changed in a scan after sequence
+		inline bool ChangedSince(uint16_t slot, uint32_t sequence) const { return static_cast<int32_t>(_changed[slot] - sequence) > 0; }
+	};
+}
+#endif
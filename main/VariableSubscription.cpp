@@ -0,0 +1,238 @@
+#include "VariableSubscription.h"
+#include <cstring>
+#include <cstdlib>
+#include "esp_timer.h"
+#include "http_server.h"
+
+using namespace OperationArchitecture;
+
+#ifdef VARIABLESUBSCRIPTION_H
+#define VARIABLESUBSCRIPTION_HEADER_SIZE 13
+#define VARIABLESUBSCRIPTION_COMMAND_SIZE (10 + VARIABLESUBSCRIPTION_MAX_VARIABLES * sizeof(uint32_t))
+#define VARIABLESUBSCRIPTION_FRAME_SIZE (VARIABLESUBSCRIPTION_HEADER_SIZE + VARIABLESUBSCRIPTION_MAX_VARIABLES * (1 + sizeof(Variable)))
+
+namespace EmbeddedIOServices
+{
+	VariableSubscription::VariableSubscription(VariableStore *store, SemaphoreHandle_t variableMapLock, UBaseType_t sendTaskPriority) :
+		_store(store),
+		_variableMapLock(variableMapLock),
+		_server(0),
+		_pendingReady(false),
+		_pendingLock(portMUX_INITIALIZER_UNLOCKED),
+		_sentSequence(0),
+		_sendAll(true),
+		_nextTime(0),
+		_sequence(0),
+		_frameLength(0),
+		_frameBusy(false),
+		_activeFd(-1),
+		_sendTask(0),
+		FramesSkipped(0)
+	{
+		_pending.Count = 0;
+		_pending.Fd = -1;
+		_active.Count = 0;
+		_active.Fd = -1;
+		_frame = (uint8_t *)malloc(VARIABLESUBSCRIPTION_FRAME_SIZE);
+		xTaskCreate(SendTask, "variable_subscription", 3072, this, sendTaskPriority, &_sendTask);
+	}
+
+	VariableSubscription::~VariableSubscription()
+	{
+		if(_sendTask != 0)
+			vTaskDelete(_sendTask);
+		free(_frame);
+	}
+
+	esp_err_t VariableSubscription::Register(httpd_handle_t server, const char *uri)
+	{
+		_server = server;
+		const esp_err_t ret = register_close_callback_http_server(Closed, this);
+		if(ret != ESP_OK)
+			return ret;
+		const httpd_uri_t subscribe = {
+			.uri          = uri,
+			.method       = HTTP_GET,
+			.handler      = WebSocketHandler,
+			.user_ctx     = this,
+			.is_websocket = true
+		};
+		return httpd_register_uri_handler(server, &subscribe);
+	}
+
+	esp_err_t VariableSubscription::WebSocketHandler(httpd_req_t *req)
+	{
+		//the handshake
+		if(req->method == HTTP_GET)
+			return ESP_OK;
+
+		VariableSubscription *subscription = reinterpret_cast<VariableSubscription *>(req->user_ctx);
+		uint8_t command[VARIABLESUBSCRIPTION_COMMAND_SIZE];
+		httpd_ws_frame_t frame = {};
+		esp_err_t ret = httpd_ws_recv_frame(req, &frame, 0);
+		if(ret != ESP_OK)
+			return ret;
+		//nothing valid is this long, failing closes the socket
+		if(frame.len > sizeof(command))
+			return ESP_FAIL;
+		frame.payload = command;
+		ret = httpd_ws_recv_frame(req, &frame, frame.len);
+		if(ret != ESP_OK)
+			return ret;
+		if(frame.type == HTTPD_WS_TYPE_BINARY)
+			subscription->Receive(httpd_req_to_sockfd(req), command, frame.len);
+		return ESP_OK;
+	}
+
+	void VariableSubscription::Receive(int fd, const uint8_t *command, size_t length)
+	{
+		uint32_t magic;
+		if(length < 10)
+			return;
+		std::memcpy(&magic, command, sizeof(magic));
+		if(magic != VARIABLESUBSCRIPTION_MAGIC)
+			return;
+		const uint8_t count = command[9];
+		if(count > VARIABLESUBSCRIPTION_MAX_VARIABLES || length < 10 + count * sizeof(uint32_t))
+			return;
+
+		Subscription subscription;
+		std::memcpy(&subscription.PeriodUs, command + 4, sizeof(uint32_t));
+		subscription.Flags = command[8];
+		subscription.Fd = fd;
+		//resolve the ids to store slots once, here rather than in the loop so generating never races the handler
+		subscription.Count = 0;
+		xSemaphoreTake(_variableMapLock, portMAX_DELAY);
+		for(uint8_t i = 0; i < count; i++)
+		{
+			uint32_t id;
+			std::memcpy(&id, command + 10 + i * sizeof(uint32_t), sizeof(id));
+			const uint16_t slot = _store->Track(id);
+			if(slot != VARIABLESTORE_SLOT_NONE)
+				subscription.Slots[subscription.Count++] = slot;
+		}
+		xSemaphoreGive(_variableMapLock);
+
+		//a subscription that hasn't been picked up yet is simply replaced
+		portENTER_CRITICAL(&_pendingLock);
+		_pending = subscription;
+		_pendingReady = true;
+		portEXIT_CRITICAL(&_pendingLock);
+	}
+
+	void VariableSubscription::Closed(int sockfd, void *ctx)
+	{
+		VariableSubscription *subscription = reinterpret_cast<VariableSubscription *>(ctx);
+		//_pending always holds the latest subscription, replace it with an empty one when its socket goes away
+		portENTER_CRITICAL(&subscription->_pendingLock);
+		if(subscription->_pending.Fd == sockfd)
+		{
+			subscription->_pending.Count = 0;
+			subscription->_pending.Fd = -1;
+			subscription->_pendingReady = true;
+		}
+		portEXIT_CRITICAL(&subscription->_pendingLock);
+		subscription->_activeFd.compare_exchange_strong(sockfd, -1);
+	}
+
+	void VariableSubscription::Apply()
+	{
+		for(uint8_t i = 0; i < _active.Count; i++)
+			_store->Unwatch(_active.Slots[i]);
+		portENTER_CRITICAL(&_pendingLock);
+		_active = _pending;
+		_pendingReady = false;
+		portEXIT_CRITICAL(&_pendingLock);
+		for(uint8_t i = 0; i < _active.Count; i++)
+			_store->Watch(_active.Slots[i]);
+		_activeFd.store(_active.Fd);
+		_sendAll = true;
+		_nextTime = 0;
+	}
+
+	void VariableSubscription::Update()
+	{
+		const int64_t now = esp_timer_get_time();
+		if(_frameBusy.load())
+		{
+			//count the periods that went by without a frame, not the loops
+			if(_active.Count != 0 && now >= _nextTime)
+			{
+				FramesSkipped++;
+				_nextTime = now + _active.PeriodUs;
+			}
+			return;
+		}
+		if(_pendingReady)
+			Apply();
+		if(_active.Count == 0)
+			return;
+
+		if(now < _nextTime)
+			return;
+		_nextTime = now + _active.PeriodUs;
+
+		const bool delta = _active.Flags & VARIABLESUBSCRIPTION_DELTA;
+		size_t length = VARIABLESUBSCRIPTION_HEADER_SIZE;
+		uint8_t count = 0;
+		for(uint8_t i = 0; i < _active.Count; i++)
+		{
+			if(delta && !_sendAll && !_store->ChangedSince(_active.Slots[i], _sentSequence))
+				continue;
+			_frame[length++] = i;
+			std::memcpy(_frame + length, &_store->Snapshot(_active.Slots[i]), sizeof(Variable));
+			length += sizeof(Variable);
+			count++;
+		}
+		_sentSequence = _store->Sequence();
+		_sendAll = false;
+		if(delta && count == 0)
+			return;
+
+		const uint32_t magic = VARIABLESUBSCRIPTION_MAGIC;
+		const uint32_t sequence = _sequence++;
+		const uint32_t timestamp = static_cast<uint32_t>(now);
+		std::memcpy(_frame, &magic, 4);
+		std::memcpy(_frame + 4, &sequence, 4);
+		std::memcpy(_frame + 8, &timestamp, 4);
+		_frame[12] = count;
+		_frameLength = length;
+
+		_frameBusy.store(true);
+		xTaskNotifyGive(_sendTask);
+	}
+
+	//httpd task, serialized with Closed, so a socket that is still a websocket here stays open for the send
+	void VariableSubscription::SendWork(void *arg)
+	{
+		VariableSubscription *subscription = reinterpret_cast<VariableSubscription *>(arg);
+		const int fd = subscription->_activeFd.load();
+		if(fd >= 0 && httpd_ws_get_fd_info(subscription->_server, fd) == HTTPD_WS_CLIENT_WEBSOCKET)
+		{
+			httpd_ws_frame_t frame = {
+				.final      = true,
+				.fragmented = false,
+				.type       = HTTPD_WS_TYPE_BINARY,
+				.payload    = subscription->_frame,
+				.len        = subscription->_frameLength
+			};
+			httpd_ws_send_frame_async(subscription->_server, fd, &frame);
+		}
+		subscription->_frameBusy.store(false);
+	}
+
+	//only hands the frame over, queueing work wakes the httpd task through its control socket
+	void VariableSubscription::SendTask(void *arg)
+	{
+		VariableSubscription *subscription = reinterpret_cast<VariableSubscription *>(arg);
+		while(1)
+		{
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			if(!subscription->_frameBusy.load())
+				continue;
+			if(httpd_queue_work(subscription->_server, SendWork, subscription) != ESP_OK)
+				subscription->_frameBusy.store(false);
+		}
+	}
+}
+#endif
@@ -0,0 +1,83 @@
+#include <atomic>
+#include <cstdint>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_http_server.h"
+#include "VariableStore.h"
+
+#ifndef VARIABLESUBSCRIPTION_H
+#define VARIABLESUBSCRIPTION_H
+
+#define VARIABLESUBSCRIPTION_MAX_VARIABLES 64
+#define VARIABLESUBSCRIPTION_DELTA 0x01
+// "ESUB" marks both the subscribe command and the pushed frames
+#define VARIABLESUBSCRIPTION_MAGIC 0x42555345
+
+namespace EmbeddedIOServices
+{
+	// Pushes a list of variables to a websocket client at a fixed rate instead of it polling them one by one.
+	// Subscribe command, little endian: magic(4) periodUs(4) flags(1) count(1) ids(4 * count). count 0 unsubscribes.
+	// Pushed frame: magic(4) sequence(4) timestampUs(4) count(1) then count times index(1) Variable.
+	// With VARIABLESUBSCRIPTION_DELTA only variables that changed since the last frame are sent. Values come from the
+	// VariableStore snapshot, so a frame is consistent with a single loop.
+	// Commands arrive on the websocket registered with Register(), the last one received wins. Frames are built in
+	// Loop() and handed to the httpd task, which pushes them to the subscribing socket, so sockets never block the loop.
+	// A period is skipped when the previous frame is still being sent. The subscription ends when its socket closes
+	class VariableSubscription
+	{
+	protected:
+		struct Subscription
+		{
+			uint32_t PeriodUs;
+			uint8_t Flags;
+			uint8_t Count;
+			uint16_t Slots[VARIABLESUBSCRIPTION_MAX_VARIABLES];
+			int Fd;
+		};
+
+		VariableStore *_store;
+		SemaphoreHandle_t _variableMapLock;
+		httpd_handle_t _server;
+
+		//written on the httpd task, applied by Update while no frame is being sent. both sides copy it under _pendingLock
+		Subscription _pending;
+		bool _pendingReady;
+		portMUX_TYPE _pendingLock;
+
+		//loop context
+		Subscription _active;
+		uint32_t _sentSequence;
+		bool _sendAll;
+		int64_t _nextTime;
+		uint32_t _sequence;
+
+		//frame handed to the httpd task, and the socket it goes to. -1 once that socket closed
+		uint8_t *_frame;
+		size_t _frameLength;
+		std::atomic<bool> _frameBusy;
+		std::atomic<int> _activeFd;
+		TaskHandle_t _sendTask;
+
+		void Receive(int fd, const uint8_t *command, size_t length);
+		void Apply();
+		static esp_err_t WebSocketHandler(httpd_req_t *req);
+		static void Closed(int sockfd, void *ctx);
+		static void SendWork(void *arg);
+		static void SendTask(void *arg);
+	public:
+		// elapsed periods no frame went out for because the previous one was still being sent
+		uint32_t FramesSkipped;
+
+		// variableMapLock is held while ids are resolved, it must cover anything else generating into the store's map
+		VariableSubscription(VariableStore *store, SemaphoreHandle_t variableMapLock, UBaseType_t sendTaskPriority);
+		~VariableSubscription();
+
+		// registers the websocket uri subscribe commands are sent on
+		esp_err_t Register(httpd_handle_t server, const char *uri);
+
+		// loop context, after the store's Scan(). builds and queues a frame once the period has elapsed
+		void Update();
+	};
+}
+#endif
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <string.h>
+#include "can_filter.h"
+#include "esp_log.h"
+
+typedef struct
+{
+    uint8_t channel;
+    uint8_t extended;
+    uint16_t reserved;
+    uint32_t id;
+} can_filter_record_t;
+
+typedef struct
+{
+    bool enabled;
+    uint32_t standard[2048 / 32]; //bitmap of consumed 11 bit ids
+    uint32_t extended[CAN_FILTER_MAX_IDS]; //consumed 29 bit ids
+    size_t extended_count;
+} can_filter_channel_t;
+
+static const char *TAG = "CAN_FILTER";
+
+static can_filter_channel_t can_filter_channels[CAN_FILTER_CHANNELS];
+
+esp_err_t can_filter_load(const char *path, uint32_t config_crc)
+{
+    memset(can_filter_channels, 0, sizeof(can_filter_channels));
+
+    FILE *fd = fopen(path, "r");
+    if(fd == NULL)
+        return ESP_ERR_NOT_FOUND;
+
+    //a list generated for another config may leave out ids this one consumes
+    can_filter_header_t header;
+    if(fread(&header, sizeof(header), 1, fd) != 1 || header.magic != CAN_FILTER_MAGIC || header.config_crc != config_crc)
+    {
+        ESP_LOGW(TAG, "%s does not belong to the active config, accepting every id", path);
+        fclose(fd);
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    can_filter_record_t record;
+    while(fread(&record, sizeof(record), 1, fd) == 1)
+    {
+        if(record.channel >= CAN_FILTER_CHANNELS)
+            continue;
+        can_filter_channel_t *channel = &can_filter_channels[record.channel];
+        channel->enabled = true;
+        if(record.extended)
+        {
+            if(channel->extended_count < CAN_FILTER_MAX_IDS)
+                channel->extended[channel->extended_count++] = record.id & 0x1FFFFFFF;
+            else
+                ESP_LOGW(TAG, "too many ids on channel %d, dropping %08lX", record.channel, (unsigned long)record.id);
+        }
+        else
+        {
+            const uint32_t id = record.id & 0x7FF;
+            channel->standard[id / 32] |= 1UL << (id % 32);
+        }
+    }
+    fclose(fd);
+    return ESP_OK;
+}
+
+//code/mask accumulator. a set mask bit is don't care, like the TWAI acceptance mask
+typedef struct
+{
+    bool empty;
+    uint32_t code;
+    uint32_t mask;
+} can_filter_fit_t;
+
+static void can_filter_fit_add(can_filter_fit_t *fit, uint32_t code, uint32_t mask)
+{
+    if(fit->empty)
+    {
+        fit->empty = false;
+        fit->code = code & ~mask;
+        fit->mask = mask;
+        return;
+    }
+    fit->mask |= mask | (fit->code ^ code);
+    fit->code &= ~fit->mask;
+}
+
+static uint32_t can_filter_fit_cost(const can_filter_fit_t *fit, uint32_t idBits)
+{
+    //how many ids of the compared bits get through
+    return fit->empty? 0 : 1UL << __builtin_popcount(fit->mask & idBits);
+}
+
+twai_filter_config_t can_filter_config(uint8_t channel)
+{
+    const twai_filter_config_t acceptAll = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+    if(channel >= CAN_FILTER_CHANNELS || !can_filter_channels[channel].enabled)
+        return acceptAll;
+    const can_filter_channel_t *c = &can_filter_channels[channel];
+
+    //single filter mode. standard ids sit in bits 31:21, extended ids in bits 31:3.
+    //for standard frames RTR and the first two data bytes are don't care, for extended frames RTR is
+    can_filter_fit_t single = { .empty = true };
+    uint16_t standard[CAN_FILTER_MAX_IDS];
+    size_t standard_count = 0;
+    for(uint32_t id = 0; id < 2048; id++)
+    {
+        if(c->standard[id / 32] & (1UL << (id % 32)))
+        {
+            //too many ids to be worth splitting, the single filter still covers all of them
+            if(standard_count < CAN_FILTER_MAX_IDS)
+                standard[standard_count] = id;
+            standard_count++;
+            can_filter_fit_add(&single, id << 21, 0x001FFFFF);
+        }
+    }
+    for(size_t i = 0; i < c->extended_count; i++)
+        can_filter_fit_add(&single, c->extended[i] << 3, 0x00000007);
+    twai_filter_config_t config = { .acceptance_code = single.code, .acceptance_mask = single.mask, .single_filter = true };
+    if(c->extended_count > 0 || standard_count < 2 || standard_count > CAN_FILTER_MAX_IDS)
+        return config;
+
+    //dual filter mode for standard ids only. filter 1 compares bits 31:21, filter 2 bits 15:5.
+    //split the sorted ids where the two filters let the fewest ids through together
+    uint32_t best = can_filter_fit_cost(&single, 0xFFE00000);
+    for(size_t split = 1; split < standard_count; split++)
+    {
+        can_filter_fit_t first = { .empty = true };
+        can_filter_fit_t second = { .empty = true };
+        for(size_t i = 0; i < split; i++)
+            can_filter_fit_add(&first, standard[i], 0);
+        for(size_t i = split; i < standard_count; i++)
+            can_filter_fit_add(&second, standard[i], 0);
+        const uint32_t cost = can_filter_fit_cost(&first, 0x7FF) + can_filter_fit_cost(&second, 0x7FF);
+        if(cost < best)
+        {
+            best = cost;
+            config.acceptance_code = (first.code << 21) | (second.code << 5);
+            config.acceptance_mask = (first.mask << 21) | 0x001F0000 | (second.mask << 5) | 0x0000001F;
+            config.single_filter = false;
+        }
+    }
+    return config;
+}
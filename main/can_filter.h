@@ -0,0 +1,39 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "driver/twai.h"
+
+#ifndef CAN_FILTER_H
+#define CAN_FILTER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CAN_FILTER_CHANNELS 2
+#define CAN_FILTER_MAX_IDS 64 //per channel
+
+// list of consumed ids written next to config.bin. a can_filter_header_t naming the config the list was generated for,
+// then records of { uint8_t channel, uint8_t extended, uint16_t reserved, uint32_t id }.
+// without it, or when it belongs to another config, every channel accepts everything
+#define CAN_FILTER_FILE "/SPIFFS/canfilter.bin"
+#define CAN_FILTER_MAGIC 0x464E4143 // "CANF"
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t config_crc; // config_partition_crc() of the config whose ids are listed
+} can_filter_header_t;
+
+// loads the id lists when the file belongs to config_crc, otherwise leaves every channel accepting everything.
+// the filters only take effect when the TWAI drivers are installed with can_filter_config
+esp_err_t can_filter_load(const char *path, uint32_t config_crc);
+
+// best fitting hardware acceptance filter for a channel, single or dual filter mode, whichever lets fewer ids through
+twai_filter_config_t can_filter_config(uint8_t channel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
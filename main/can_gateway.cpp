@@ -0,0 +1,358 @@
+#include "can_gateway.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+
+static_assert((CAN_GATEWAY_RING_LENGTH & (CAN_GATEWAY_RING_LENGTH - 1)) == 0, "CAN_GATEWAY_RING_LENGTH must be a power of 2");
+
+//single producer (TWAI RX) single consumer (gateway task) ring per channel. head and tail are free running
+typedef struct
+{
+    can_gateway_frame_t frames[CAN_GATEWAY_RING_LENGTH];
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+    uint32_t dropped;
+} can_gateway_ring_t;
+
+static can_gateway_ring_t can_gateway_rings[CAN_GATEWAY_CHANNELS];
+static std::atomic<bool> can_gateway_streaming(false);
+static uint32_t can_gateway_tcp_dropped;
+
+extern "C" {
+    bool IRAM_ATTR can_gateway_receive(uint8_t channel, uint32_t id, const uint8_t *data, uint8_t length)
+    {
+        if(channel >= CAN_GATEWAY_CHANNELS || !can_gateway_streaming.load(std::memory_order_relaxed))
+            return false;
+        can_gateway_ring_t *ring = &can_gateway_rings[channel];
+        const uint32_t head = ring->head.load(std::memory_order_relaxed);
+        if(head - ring->tail.load(std::memory_order_acquire) >= CAN_GATEWAY_RING_LENGTH)
+        {
+            ring->dropped++;
+            return false;
+        }
+
+        can_gateway_frame_t *frame = &ring->frames[head & (CAN_GATEWAY_RING_LENGTH - 1)];
+        frame->timestamp_us = (uint32_t)esp_timer_get_time();
+        frame->id = id;
+        frame->channel = channel;
+        frame->length = length > 8? 8 : length;
+        memcpy(frame->data, data, frame->length);
+        ring->head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    uint32_t can_gateway_dropped(uint8_t channel)
+    {
+        return channel < CAN_GATEWAY_CHANNELS? can_gateway_rings[channel].dropped : 0;
+    }
+
+    uint32_t can_gateway_tcp_dropped_packets()
+    {
+        return can_gateway_tcp_dropped;
+    }
+}
+
+static size_t can_gateway_encode(can_gateway_format_t format, const can_gateway_frame_t *frame, char *out)
+{
+    if(format == CAN_GATEWAY_FORMAT_BINARY)
+    {
+        memcpy(out, frame, sizeof(can_gateway_frame_t));
+        return sizeof(can_gateway_frame_t);
+    }
+
+    static const char hex[] = "0123456789ABCDEF";
+    size_t i = 0;
+    const bool extended = frame->id & CAN_GATEWAY_ID_EXTENDED;
+    const bool rtr = frame->id & CAN_GATEWAY_ID_RTR;
+    out[i++] = rtr? (extended? 'R' : 'r') : (extended? 'T' : 't');
+    const uint32_t id = frame->id & CAN_GATEWAY_ID_MASK;
+    for(int shift = extended? 28 : 8; shift >= 0; shift -= 4)
+        out[i++] = hex[(id >> shift) & 0xF];
+    out[i++] = '0' + frame->length;
+    if(!rtr)
+    {
+        for(uint8_t b = 0; b < frame->length; b++)
+        {
+            out[i++] = hex[frame->data[b] >> 4];
+            out[i++] = hex[frame->data[b] & 0xF];
+        }
+    }
+    //standard SLCAN timestamp, milliseconds wrapping at 60000
+    const uint32_t timestamp_ms = (frame->timestamp_us / 1000) % 60000;
+    for(int shift = 12; shift >= 0; shift -= 4)
+        out[i++] = hex[(timestamp_ms >> shift) & 0xF];
+    out[i++] = '\r';
+    return i;
+}
+
+static int can_gateway_hex(char c)
+{
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+//parse one SLCAN transmit line without the trailing \r. the channel is given as an optional trailing digit
+static bool can_gateway_parse_slcan(const char *line, size_t length, can_gateway_frame_t *frame)
+{
+    if(length < 1)
+        return false;
+    const char type = line[0];
+    const bool extended = type == 'T' || type == 'R';
+    const bool rtr = type == 'r' || type == 'R';
+    if(!extended && !rtr && type != 't')
+        return false;
+
+    const size_t idLength = extended? 8 : 3;
+    if(length < 1 + idLength + 1)
+        return false;
+    uint32_t id = 0;
+    for(size_t i = 1; i <= idLength; i++)
+    {
+        const int nibble = can_gateway_hex(line[i]);
+        if(nibble < 0)
+            return false;
+        id = (id << 4) | nibble;
+    }
+    const int dlc = can_gateway_hex(line[1 + idLength]);
+    if(dlc < 0 || dlc > 8)
+        return false;
+
+    size_t i = 2 + idLength;
+    memset(frame, 0, sizeof(can_gateway_frame_t));
+    if(!rtr)
+    {
+        if(length < i + dlc * 2)
+            return false;
+        for(int b = 0; b < dlc; b++, i += 2)
+        {
+            const int high = can_gateway_hex(line[i]);
+            const int low = can_gateway_hex(line[i + 1]);
+            if(high < 0 || low < 0)
+                return false;
+            frame->data[b] = (high << 4) | low;
+        }
+    }
+    if(i < length)
+        frame->channel = can_gateway_hex(line[i]);
+    frame->id = (id & CAN_GATEWAY_ID_MASK) | (extended? CAN_GATEWAY_ID_EXTENDED : 0) | (rtr? CAN_GATEWAY_ID_RTR : 0);
+    frame->length = dlc;
+    return frame->channel < CAN_GATEWAY_CHANNELS;
+}
+
+//hands every complete frame in data to transmit and returns the bytes consumed
+static size_t can_gateway_parse(const can_gateway_config_t *config, const char *data, size_t length)
+{
+    can_gateway_frame_t frame;
+    size_t consumed = 0;
+    if(config->format == CAN_GATEWAY_FORMAT_BINARY)
+    {
+        while(length - consumed >= sizeof(can_gateway_frame_t))
+        {
+            memcpy(&frame, data + consumed, sizeof(can_gateway_frame_t));
+            consumed += sizeof(can_gateway_frame_t);
+            if(config->transmit != 0 && frame.channel < CAN_GATEWAY_CHANNELS && frame.length <= 8)
+                config->transmit(&frame);
+        }
+        return consumed;
+    }
+
+    for(size_t i = 0; i < length; i++)
+    {
+        if(data[i] != '\r' && data[i] != '\n')
+            continue;
+        if(config->transmit != 0 && can_gateway_parse_slcan(data + consumed, i - consumed, &frame))
+            config->transmit(&frame);
+        consumed = i + 1;
+    }
+    return consumed;
+}
+
+extern "C" {
+    void can_gateway(void *arg)
+    {
+        const can_gateway_config_t *config = (const can_gateway_config_t *)arg;
+
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(config->port);
+
+        struct sockaddr_in udp_peer = {};
+        bool udp_peer_valid = false;
+        int tcp_client = -1;
+        size_t tcp_rx_length = 0;
+        size_t tcp_tx_length = 0;
+        size_t packet_length = 0;
+        int64_t last_flush = 0;
+        bool backlog = false;
+        int opt = 1;
+
+        char *packet = (char *)malloc(CAN_GATEWAY_PACKET_SIZE);
+        char *rx = (char *)malloc(CAN_GATEWAY_PACKET_SIZE);
+        //bytes the tcp client hasn't taken yet, sent before anything newer
+        char *tcp_tx = (char *)malloc(CAN_GATEWAY_TCP_BACKLOG);
+        int udp_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+        int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+        if(packet == 0 || rx == 0 || tcp_tx == 0 || udp_sock < 0 || listen_sock < 0)
+        {
+            ESP_LOGE("CAN_GATEWAY", "Unable to create sockets: errno %d", errno);
+            goto can_gateway_cleanup;
+        }
+        setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if(bind(udp_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_sock, 1) != 0)
+        {
+            ESP_LOGE("CAN_GATEWAY", "Unable to bind port %d: errno %d", config->port, errno);
+            goto can_gateway_cleanup;
+        }
+
+        while(1)
+        {
+            fd_set readfds;
+            fd_set writefds;
+            FD_ZERO(&readfds);
+            FD_ZERO(&writefds);
+            FD_SET(udp_sock, &readfds);
+            FD_SET(listen_sock, &readfds);
+            int maxfd = udp_sock > listen_sock? udp_sock : listen_sock;
+            if(tcp_client >= 0)
+            {
+                FD_SET(tcp_client, &readfds);
+                //wake as soon as the client can take more of the backlog
+                if(tcp_tx_length > 0)
+                    FD_SET(tcp_client, &writefds);
+                if(tcp_client > maxfd)
+                    maxfd = tcp_client;
+            }
+
+            //don't wait when the last pass left frames in the rings
+            struct timeval timeout = { .tv_sec = 0, .tv_usec = backlog? 0 : CAN_GATEWAY_FLUSH_US / 2 };
+            if(select(maxfd + 1, &readfds, &writefds, NULL, &timeout) > 0)
+            {
+                if(FD_ISSET(udp_sock, &readfds))
+                {
+                    socklen_t peer_length = sizeof(udp_peer);
+                    const int len = recvfrom(udp_sock, rx, CAN_GATEWAY_PACKET_SIZE, 0, (struct sockaddr *)&udp_peer, &peer_length);
+                    if(len >= 0)
+                    {
+                        //any datagram subscribes its sender to the stream
+                        udp_peer_valid = true;
+                        can_gateway_parse(config, rx, len);
+                    }
+                }
+                if(FD_ISSET(listen_sock, &readfds))
+                {
+                    const int sock = accept(listen_sock, NULL, NULL);
+                    if(sock >= 0)
+                    {
+                        //the newest client takes over the stream
+                        if(tcp_client >= 0)
+                            close(tcp_client);
+                        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+                        tcp_client = sock;
+                        tcp_rx_length = 0;
+                        tcp_tx_length = 0;
+                    }
+                }
+                if(tcp_client >= 0 && FD_ISSET(tcp_client, &readfds))
+                {
+                    const int len = recv(tcp_client, rx + tcp_rx_length, CAN_GATEWAY_PACKET_SIZE - tcp_rx_length, 0);
+                    if(len <= 0)
+                    {
+                        close(tcp_client);
+                        tcp_client = -1;
+                    }
+                    else
+                    {
+                        tcp_rx_length += len;
+                        const size_t consumed = can_gateway_parse(config, rx, tcp_rx_length);
+                        tcp_rx_length -= consumed;
+                        memmove(rx, rx + consumed, tcp_rx_length);
+                        //a line that doesn't fit the buffer is garbage
+                        if(tcp_rx_length == CAN_GATEWAY_PACKET_SIZE)
+                            tcp_rx_length = 0;
+                    }
+                }
+            }
+
+            can_gateway_streaming.store(udp_peer_valid || tcp_client >= 0);
+
+            //batch frames from both channels into packets
+            bool flush = false;
+            char encoded[40];
+            for(uint8_t channel = 0; channel < CAN_GATEWAY_CHANNELS && !flush; channel++)
+            {
+                can_gateway_ring_t *ring = &can_gateway_rings[channel];
+                uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+                const uint32_t head = ring->head.load(std::memory_order_acquire);
+                while(tail != head)
+                {
+                    const size_t length = can_gateway_encode(config->format, &ring->frames[tail & (CAN_GATEWAY_RING_LENGTH - 1)], encoded);
+                    if(packet_length + length > CAN_GATEWAY_PACKET_SIZE)
+                    {
+                        flush = true;
+                        break;
+                    }
+                    memcpy(packet + packet_length, encoded, length);
+                    packet_length += length;
+                    tail++;
+                }
+                ring->tail.store(tail, std::memory_order_release);
+            }
+
+            const int64_t now = esp_timer_get_time();
+            if(packet_length > 0 && (flush || now - last_flush >= CAN_GATEWAY_FLUSH_US))
+            {
+                if(udp_peer_valid)
+                    sendto(udp_sock, packet, packet_length, MSG_DONTWAIT, (struct sockaddr *)&udp_peer, sizeof(udp_peer));
+                //packets hold whole frames, so a client too slow for the backlog loses whole packets and stays in sync
+                if(tcp_client >= 0)
+                {
+                    if(tcp_tx_length + packet_length <= CAN_GATEWAY_TCP_BACKLOG)
+                    {
+                        memcpy(tcp_tx + tcp_tx_length, packet, packet_length);
+                        tcp_tx_length += packet_length;
+                    }
+                    else
+                    {
+                        can_gateway_tcp_dropped++;
+                    }
+                }
+                packet_length = 0;
+                last_flush = now;
+            }
+            if(tcp_client >= 0 && tcp_tx_length > 0)
+            {
+                const int sent = send(tcp_client, tcp_tx, tcp_tx_length, MSG_DONTWAIT);
+                if(sent > 0)
+                {
+                    tcp_tx_length -= sent;
+                    memmove(tcp_tx, tcp_tx + sent, tcp_tx_length);
+                }
+                else if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    close(tcp_client);
+                    tcp_client = -1;
+                }
+            }
+            backlog = flush;
+        }
+
+can_gateway_cleanup:
+        if(udp_sock >= 0)
+            close(udp_sock);
+        if(listen_sock >= 0)
+            close(listen_sock);
+        free(packet);
+        free(rx);
+        free(tcp_tx);
+        vTaskDelete(NULL);
+    }
+}
@@ -0,0 +1,63 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_attr.h"
+
+#ifndef CAN_GATEWAY_H
+#define CAN_GATEWAY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CAN_GATEWAY_CHANNELS 2
+#define CAN_GATEWAY_RING_LENGTH 256 //frames buffered per channel, must be a power of 2
+#define CAN_GATEWAY_PACKET_SIZE 1400 //frames are batched until a packet is this full
+#define CAN_GATEWAY_FLUSH_US 2000 //or this long after the last flush
+#define CAN_GATEWAY_TCP_BACKLOG (4 * CAN_GATEWAY_PACKET_SIZE) //unsent bytes kept for a slow tcp client before packets are dropped
+
+#define CAN_GATEWAY_ID_EXTENDED 0x80000000
+#define CAN_GATEWAY_ID_RTR 0x40000000
+#define CAN_GATEWAY_ID_MASK 0x1FFFFFFF
+
+typedef enum
+{
+    CAN_GATEWAY_FORMAT_SLCAN = 0, //t/T/r/R lines with the standard 4 digit hex millisecond timestamp (0 to 59999) appended
+    CAN_GATEWAY_FORMAT_BINARY //packed can_gateway_frame_t records, little endian, with the full microsecond timestamp
+} can_gateway_format_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t timestamp_us;
+    uint32_t id; //CAN_GATEWAY_ID_EXTENDED and CAN_GATEWAY_ID_RTR flags or'd with the identifier
+    uint8_t channel;
+    uint8_t length;
+    uint8_t data[8];
+} can_gateway_frame_t;
+
+// called for every frame a client asks to transmit. returns false when the frame could not be queued
+typedef bool (*can_gateway_transmit_t)(const can_gateway_frame_t *frame);
+
+typedef struct
+{
+    uint16_t port; //udp and tcp port. udp streams to the last peer that sent a datagram
+    can_gateway_format_t format;
+    can_gateway_transmit_t transmit;
+} can_gateway_config_t;
+
+// queues a received frame. lock free, one producer per channel, safe from the TWAI RX ISR
+bool IRAM_ATTR can_gateway_receive(uint8_t channel, uint32_t id, const uint8_t *data, uint8_t length);
+
+// dropped frames per channel since start
+uint32_t can_gateway_dropped(uint8_t channel);
+// packets a tcp client was too slow to take
+uint32_t can_gateway_tcp_dropped_packets();
+
+// gateway task. arg is a can_gateway_config_t that must outlive the task
+void can_gateway(void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
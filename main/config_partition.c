@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "config_partition.h"
+#include "esp_partition.h"
+#include "spi_flash_mmap.h"
+#include "esp_rom_crc.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#define CONFIG_SLOT_MAGIC 0x47464345 // "ECFG"
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t length;
+    uint32_t crc;
+} config_slot_header_t;
+
+typedef struct
+{
+    uint32_t sector; // sector index inside the slot data
+    uint8_t *data;
+} config_cache_sector_t;
+
+static const char *TAG = "CONFIG_PARTITION";
+
+static const esp_partition_t *config_partition = NULL;
+static const uint8_t *config_map = NULL;
+static esp_partition_mmap_handle_t config_map_handle;
+static size_t config_slot_size = 0;
+static int config_active_slot = -1;
+static uint32_t config_active_sequence = 0;
+
+static int config_write_slot = -1;
+static size_t config_write_length = 0;
+static size_t config_write_offset = 0;
+static uint32_t config_write_crc = 0;
+
+static config_cache_sector_t config_cache[CONFIG_PARTITION_CACHE_SECTORS];
+static size_t config_cache_count = 0;
+static TickType_t config_cache_last_write = 0;
+static SemaphoreHandle_t config_cache_lock = NULL;
+static TaskHandle_t config_flush_task_handle = NULL;
+
+static const config_slot_header_t *config_slot_header(int slot)
+{
+    return (const config_slot_header_t *)(config_map + slot * config_slot_size);
+}
+
+static const uint8_t *config_slot_data(int slot)
+{
+    return config_map + slot * config_slot_size + SPI_FLASH_SEC_SIZE;
+}
+
+static size_t config_slot_offset(int slot)
+{
+    return slot * config_slot_size;
+}
+
+/* false if the slot is empty or does not match its data */
+static bool config_slot_valid(int slot)
+{
+    const config_slot_header_t *header = config_slot_header(slot);
+    if (header->magic != CONFIG_SLOT_MAGIC || header->length > config_partition_max_length())
+        return false;
+    return esp_rom_crc32_le(0, config_slot_data(slot), header->length) == header->crc;
+}
+
+static void config_select_active_slot()
+{
+    config_active_slot = -1;
+    for (int slot = 0; slot < 2; slot++) {
+        if (!config_slot_valid(slot))
+            continue;
+        const uint32_t sequence = config_slot_header(slot)->sequence;
+        if (config_active_slot < 0 || (int32_t)(sequence - config_active_sequence) > 0) {
+            config_active_slot = slot;
+            config_active_sequence = sequence;
+        }
+    }
+}
+
+esp_err_t config_partition_init()
+{
+    if (config_partition)
+        return ESP_OK;
+
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, CONFIG_PARTITION_LABEL);
+    if (!partition) {
+        ESP_LOGE(TAG, "Failed to find config partition");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    const void *map;
+    esp_err_t ret = esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &map, &config_map_handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to map config partition (%s)", esp_err_to_name(ret));
+        return ret;
+    }
+
+    config_cache_lock = xSemaphoreCreateMutex();
+    config_partition = partition;
+    config_map = (const uint8_t *)map;
+    config_slot_size = partition->size / 2;
+    config_select_active_slot();
+
+    ESP_LOGI(TAG, "Config partition mapped at %p, active slot %d", config_map, config_active_slot);
+    return ESP_OK;
+}
+
+uint32_t config_partition_crc()
+{
+    if (config_active_slot < 0)
+        return 0;
+    return config_slot_header(config_active_slot)->crc;
+}
+
+size_t config_partition_max_length()
+{
+    return config_slot_size - SPI_FLASH_SEC_SIZE;
+}
+
+const void *config_partition_get(size_t *length)
+{
+    if (config_active_slot < 0)
+        return NULL;
+    if (length)
+        *length = config_slot_header(config_active_slot)->length;
+    return config_slot_data(config_active_slot);
+}
+
+esp_err_t config_partition_write_begin(size_t length)
+{
+    if (!config_partition)
+        return ESP_ERR_INVALID_STATE;
+    if (length > config_partition_max_length())
+        return ESP_ERR_INVALID_SIZE;
+
+    config_write_slot = config_active_slot == 0? 1 : 0;
+    config_write_length = length;
+    config_write_offset = 0;
+    config_write_crc = 0;
+
+    /* header sector plus only what the new config needs */
+    size_t erase_size = (SPI_FLASH_SEC_SIZE + length + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    esp_err_t ret = esp_partition_erase_range(config_partition, config_slot_offset(config_write_slot), erase_size);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to erase config slot %d (%s)", config_write_slot, esp_err_to_name(ret));
+        config_write_slot = -1;
+    }
+    return ret;
+}
+
+esp_err_t config_partition_write(const void *data, size_t length)
+{
+    if (config_write_slot < 0)
+        return ESP_ERR_INVALID_STATE;
+    if (config_write_offset + length > config_write_length)
+        return ESP_ERR_INVALID_SIZE;
+
+    esp_err_t ret = esp_partition_write(config_partition, config_slot_offset(config_write_slot) + SPI_FLASH_SEC_SIZE + config_write_offset, data, length);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write config slot %d (%s)", config_write_slot, esp_err_to_name(ret));
+        config_write_slot = -1;
+        return ret;
+    }
+    config_write_crc = esp_rom_crc32_le(config_write_crc, data, length);
+    config_write_offset += length;
+    return ESP_OK;
+}
+
+/* must be called with the cache lock held */
+static esp_err_t config_write_end_locked()
+{
+    if (config_write_slot < 0)
+        return ESP_ERR_INVALID_STATE;
+    if (config_write_offset != config_write_length) {
+        config_write_slot = -1;
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    /* header goes last, this is what commits the slot */
+    const config_slot_header_t header = {
+        .magic = CONFIG_SLOT_MAGIC,
+        .sequence = config_active_slot < 0? 1 : config_active_sequence + 1,
+        .length = config_write_length,
+        .crc = config_write_crc
+    };
+    esp_err_t ret = esp_partition_write(config_partition, config_slot_offset(config_write_slot), &header, sizeof(header));
+    const int slot = config_write_slot;
+    config_write_slot = -1;
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to commit config slot %d (%s)", slot, esp_err_to_name(ret));
+        return ret;
+    }
+    if (!config_slot_valid(slot)) {
+        ESP_LOGE(TAG, "Config slot %d failed verification", slot);
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    /* edits cached against the old slot no longer apply */
+    for (size_t i = 0; i < config_cache_count; i++)
+        free(config_cache[i].data);
+    config_cache_count = 0;
+    config_active_slot = slot;
+    config_active_sequence = header.sequence;
+
+    ESP_LOGI(TAG, "Config committed to slot %d (%u bytes)", slot, (unsigned int)header.length);
+    return ESP_OK;
+}
+
+esp_err_t config_partition_write_end()
+{
+    xSemaphoreTake(config_cache_lock, portMAX_DELAY);
+    esp_err_t ret = config_write_end_locked();
+    xSemaphoreGive(config_cache_lock);
+    return ret;
+}
+
+void config_partition_write_abort()
+{
+    config_write_slot = -1;
+}
+
+esp_err_t config_partition_import_file(const char *path)
+{
+    struct stat file_stat;
+    uint8_t chunk[512];
+    size_t chunksize;
+
+    if (stat(path, &file_stat) == -1)
+        return ESP_ERR_NOT_FOUND;
+    FILE *fd = fopen(path, "r");
+    if (!fd)
+        return ESP_FAIL;
+
+    ESP_LOGI(TAG, "Importing %s into config partition (%ld bytes)", path, file_stat.st_size);
+    esp_err_t ret = config_partition_write_begin(file_stat.st_size);
+    while (ret == ESP_OK && (chunksize = fread(chunk, 1, sizeof(chunk), fd)) > 0)
+        ret = config_partition_write(chunk, chunksize);
+    fclose(fd);
+    if (ret != ESP_OK) {
+        config_partition_write_abort();
+        return ret;
+    }
+    ret = config_partition_write_end();
+    /* imported exactly once. left on storage it would overwrite every later commit on the next load */
+    if (ret == ESP_OK && unlink(path) != 0)
+        ESP_LOGW(TAG, "Failed to remove %s after import", path);
+    return ret;
+}
+
+bool config_partition_contains(const void *address, size_t length)
+{
+    size_t active_length = 0;
+    const uint8_t *active = (const uint8_t *)config_partition_get(&active_length);
+    if (!active)
+        return false;
+    const uint8_t *destination = (const uint8_t *)address;
+    return destination >= active && destination + length <= active + active_length;
+}
+
+/* copies the active slot with the cached sectors in place into the inactive slot and makes that one active.
+ * every commit rewrites the whole config, a commit interrupted by a power loss leaves the previous slot active */
+static esp_err_t config_commit_locked()
+{
+    if (config_cache_count == 0)
+        return ESP_OK;
+
+    const int slot = config_active_slot;
+    const uint8_t *data = config_slot_data(slot);
+    const size_t length = config_slot_header(slot)->length;
+    const size_t committed = config_cache_count;
+
+    /* nothing to write when every sector was edited back to what flash already holds */
+    bool changed = false;
+    for (size_t i = 0; i < config_cache_count && !changed; i++)
+        changed = memcmp(config_cache[i].data, data + config_cache[i].sector * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE) != 0;
+    if (!changed) {
+        for (size_t i = 0; i < config_cache_count; i++)
+            free(config_cache[i].data);
+        config_cache_count = 0;
+        return ESP_OK;
+    }
+
+    esp_err_t ret = config_partition_write_begin(length);
+    for (size_t offset = 0; ret == ESP_OK && offset < length; offset += SPI_FLASH_SEC_SIZE) {
+        const uint32_t sector = offset / SPI_FLASH_SEC_SIZE;
+        const uint8_t *source = data + offset;
+        for (size_t i = 0; i < config_cache_count; i++) {
+            if (config_cache[i].sector == sector)
+                source = config_cache[i].data;
+        }
+        ret = config_partition_write(source, MIN(length - offset, SPI_FLASH_SEC_SIZE));
+    }
+    /* the new slot header goes last and frees the cache, a failed write keeps the edits cached for the next try */
+    if (ret == ESP_OK)
+        ret = config_write_end_locked();
+    else
+        config_partition_write_abort();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to commit config edits (%s)", esp_err_to_name(ret));
+        return ret;
+    }
+
+    ESP_LOGI(TAG, "Committed %u edited config sectors to slot %d", (unsigned int)committed, config_active_slot);
+    return ESP_OK;
+}
+
+esp_err_t config_partition_cache_write(const void *address, const void *data, size_t length)
+{
+    if (!config_partition_contains(address, length))
+        return ESP_ERR_INVALID_ARG;
+    if (length == 0)
+        return ESP_OK;
+
+    xSemaphoreTake(config_cache_lock, portMAX_DELAY);
+    const uint8_t *active = config_slot_data(config_active_slot);
+    size_t offset = (const uint8_t *)address - active;
+    const uint8_t *source = (const uint8_t *)data;
+    esp_err_t ret = ESP_OK;
+
+    /* a full cache is never committed from here, that would move the config to the other slot behind the back of
+     * whatever parses it in place. the write is refused whole and the flush task commits through the claim */
+    size_t new_sectors = 0;
+    for (uint32_t sector = offset / SPI_FLASH_SEC_SIZE; sector <= (offset + length - 1) / SPI_FLASH_SEC_SIZE; sector++) {
+        bool cached = false;
+        for (size_t i = 0; i < config_cache_count && !cached; i++)
+            cached = config_cache[i].sector == sector;
+        if (!cached)
+            new_sectors++;
+    }
+    if (config_cache_count + new_sectors > CONFIG_PARTITION_CACHE_SECTORS) {
+        xSemaphoreGive(config_cache_lock);
+        if (config_flush_task_handle)
+            xTaskNotifyGive(config_flush_task_handle);
+        return ESP_ERR_NO_MEM;
+    }
+
+    while (length > 0) {
+        const uint32_t sector = offset / SPI_FLASH_SEC_SIZE;
+        const size_t sector_offset = offset % SPI_FLASH_SEC_SIZE;
+        const size_t sector_length = MIN(length, SPI_FLASH_SEC_SIZE - sector_offset);
+
+        config_cache_sector_t *cached = NULL;
+        for (size_t i = 0; i < config_cache_count; i++) {
+            if (config_cache[i].sector == sector)
+                cached = &config_cache[i];
+        }
+        if (!cached) {
+            uint8_t *sector_data = (uint8_t *)malloc(SPI_FLASH_SEC_SIZE);
+            if (!sector_data) {
+                ret = ESP_ERR_NO_MEM;
+                break;
+            }
+            memcpy(sector_data, active + sector * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE);
+            cached = &config_cache[config_cache_count++];
+            cached->sector = sector;
+            cached->data = sector_data;
+        }
+        memcpy(cached->data + sector_offset, source, sector_length);
+
+        offset += sector_length;
+        source += sector_length;
+        length -= sector_length;
+    }
+    config_cache_last_write = xTaskGetTickCount();
+    xSemaphoreGive(config_cache_lock);
+    return ret;
+}
+
+bool config_partition_dirty()
+{
+    xSemaphoreTake(config_cache_lock, portMAX_DELAY);
+    const bool dirty = config_cache_count > 0;
+    xSemaphoreGive(config_cache_lock);
+    return dirty;
+}
+
+esp_err_t config_partition_commit()
+{
+    if (!config_partition)
+        return ESP_ERR_INVALID_STATE;
+    xSemaphoreTake(config_cache_lock, portMAX_DELAY);
+    esp_err_t ret = config_commit_locked();
+    xSemaphoreGive(config_cache_lock);
+    return ret;
+}
+
+void config_partition_flush_task(void *arg)
+{
+    config_partition_flush_config_t *config = (config_partition_flush_config_t *)arg;
+    const TickType_t interval = pdMS_TO_TICKS(config->commit_interval_ms);
+
+    if (!config_partition) {
+        ESP_LOGE(TAG, "Config partition not initialized");
+        vTaskDelete(NULL);
+        return;
+    }
+    config_flush_task_handle = xTaskGetCurrentTaskHandle();
+
+    while (1)
+    {
+        /* woken early by a write the full cache refused */
+        ulTaskNotifyTake(pdTRUE, interval);
+        xSemaphoreTake(config_cache_lock, portMAX_DELAY);
+        /* coalesce, only commit once the edits have settled or no more fit */
+        const bool settled = config_cache_count > 0 &&
+            (config_cache_count == CONFIG_PARTITION_CACHE_SECTORS || xTaskGetTickCount() - config_cache_last_write >= interval);
+        xSemaphoreGive(config_cache_lock);
+        /* the commit moves the config to the other slot, which the running config must be reloaded from.
+         * a reload already in progress holds the claim, the edits are committed on a later pass */
+        if (!settled || (config->claim && !config->claim()))
+            continue;
+        const esp_err_t ret = config_partition_commit();
+        if (config->committed)
+            config->committed(ret == ESP_OK);
+    }
+}
@@ -0,0 +1,63 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifndef CONFIG_PARTITION_H
+#define CONFIG_PARTITION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The config partition is split into two slots. Each slot starts with a header sector followed by the config data.
+ * Every write, uploads and committed edits alike, goes to the inactive slot and only becomes active once its header is
+ * written, so a failed or interrupted write leaves the previous config in place. */
+#define CONFIG_PARTITION_LABEL "config"
+/* number of dirty 4 KB sectors the write-back cache holds. an edit of one more is refused until they are committed */
+#define CONFIG_PARTITION_CACHE_SECTORS 4
+
+/* claim returns false while the config can't move slots, committed is called with the claim held once the commit is
+ * done. written is false when the commit failed, the claim is released by the receiver either way */
+typedef bool (*config_partition_claim_t)();
+typedef void (*config_partition_committed_t)(bool written);
+
+typedef struct
+{
+    uint32_t commit_interval_ms;
+    config_partition_claim_t claim;
+    config_partition_committed_t committed;
+} config_partition_flush_config_t;
+
+esp_err_t config_partition_init();
+/* pointer into the memory mapped active slot, stays valid until reboot. NULL when no slot is valid */
+const void *config_partition_get(size_t *length);
+/* CRC-32 (zlib) of the active config, changes with every import and commit. 0 when no slot is valid */
+uint32_t config_partition_crc();
+size_t config_partition_max_length();
+
+esp_err_t config_partition_write_begin(size_t length);
+esp_err_t config_partition_write(const void *data, size_t length);
+esp_err_t config_partition_write_end();
+void config_partition_write_abort();
+
+/* copies a config file into the inactive slot, makes it active and removes the file, so it is imported only once */
+esp_err_t config_partition_import_file(const char *path);
+
+/* write-back cache for edits of the active config. address points into the mapped active slot. edits only reach
+ * the running config once committed and reloaded. ESP_ERR_NO_MEM when the cache is full, the flush task is woken
+ * to commit it and the write can be retried after the reload */
+bool config_partition_contains(const void *address, size_t length);
+esp_err_t config_partition_cache_write(const void *address, const void *data, size_t length);
+bool config_partition_dirty();
+/* writes the active config with the cached edits into the inactive slot and makes it active. the previous slot is
+ * left untouched, anything parsed from it has to be reloaded from config_partition_get before the next write */
+esp_err_t config_partition_commit();
+/* commits the cache once it has been idle for commit_interval_ms */
+void config_partition_flush_task(void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "data_logger.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+
+#define DATA_LOGGER_RECORD_HEADER_SIZE 6
+#define DATA_LOGGER_PATH_MAX 64
+
+typedef struct __attribute__((packed))
+{
+    uint32_t period_us;
+    uint64_t edge_pin_mask;
+    uint8_t can_channel_mask;
+    uint8_t reserved[3];
+} data_logger_config_header_t;
+
+typedef struct
+{
+    uint8_t *data; //DATA_LOGGER_BLOCK_SIZE bytes, the header is filled in by the flush task
+    size_t length;
+    uint16_t records;
+    uint32_t first_timestamp_us;
+} data_logger_block_t;
+
+static const char *TAG = "DATA_LOGGER";
+
+//blocks are filled round robin. filled and flushed are free running block counts, the block filled % DATA_LOGGER_BLOCKS
+//is the one being appended to while filled - flushed < DATA_LOGGER_BLOCKS. the flush task empties a block before
+//counting it as flushed, so a block handed back to the producers is always empty
+static data_logger_block_t data_logger_blocks[DATA_LOGGER_BLOCKS];
+static uint32_t data_logger_filled;
+static uint32_t data_logger_flushed;
+static uint32_t data_logger_dropped_count;
+static uint32_t data_logger_dropped_pending;
+static uint8_t data_logger_can_channel_mask;
+static bool data_logger_running;
+static portMUX_TYPE data_logger_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t data_logger_task;
+static char data_logger_path[DATA_LOGGER_PATH_MAX];
+
+esp_err_t data_logger_load(const char *path, data_logger_config_t *config)
+{
+    memset(config, 0, sizeof(data_logger_config_t));
+
+    FILE *fd = fopen(path, "r");
+    if(fd == NULL)
+        return ESP_ERR_NOT_FOUND;
+
+    data_logger_config_header_t header;
+    if(fread(&header, sizeof(header), 1, fd) != 1)
+    {
+        fclose(fd);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    config->period_us = header.period_us;
+    config->edge_pin_mask = header.edge_pin_mask;
+    config->can_channel_mask = header.can_channel_mask;
+    uint32_t id;
+    while(fread(&id, sizeof(id), 1, fd) == 1)
+    {
+        if(config->variable_count < DATA_LOGGER_MAX_VARIABLES)
+            config->variable_ids[config->variable_count++] = id;
+        else
+            ESP_LOGW(TAG, "too many variables, dropping %lu", (unsigned long)id);
+    }
+    fclose(fd);
+    return ESP_OK;
+}
+
+static void data_logger_append(data_logger_block_t *block, uint8_t type, uint32_t timestamp, const void *payload, uint8_t length)
+{
+    uint8_t *record = block->data + sizeof(data_logger_block_header_t) + block->length;
+    if(block->length == 0)
+        block->first_timestamp_us = timestamp;
+    record[0] = type;
+    record[1] = length;
+    memcpy(record + 2, &timestamp, sizeof(timestamp));
+    memcpy(record + DATA_LOGGER_RECORD_HEADER_SIZE, payload, length);
+    block->length += DATA_LOGGER_RECORD_HEADER_SIZE + length;
+    block->records++;
+}
+
+bool IRAM_ATTR data_logger_record(data_logger_record_type_t type, const void *payload, uint8_t length)
+{
+    if(!data_logger_running || length > DATA_LOGGER_MAX_PAYLOAD)
+        return false;
+    const uint32_t timestamp = (uint32_t)esp_timer_get_time();
+    const size_t size = DATA_LOGGER_RECORD_HEADER_SIZE + length;
+    bool stored = false;
+    bool sealed = false;
+
+    portENTER_CRITICAL_SAFE(&data_logger_lock);
+    if(data_logger_filled - data_logger_flushed < DATA_LOGGER_BLOCKS)
+    {
+        data_logger_block_t *block = &data_logger_blocks[data_logger_filled % DATA_LOGGER_BLOCKS];
+        if(sizeof(data_logger_block_header_t) + block->length + size > DATA_LOGGER_BLOCK_SIZE)
+        {
+            data_logger_filled++;
+            sealed = true;
+            block = data_logger_filled - data_logger_flushed < DATA_LOGGER_BLOCKS? &data_logger_blocks[data_logger_filled % DATA_LOGGER_BLOCKS] : NULL;
+        }
+        if(block != NULL)
+        {
+            //a fresh block starts with the count of what was lost while none was free
+            if(block->length == 0 && data_logger_dropped_pending != 0)
+            {
+                data_logger_append(block, DATA_LOGGER_RECORD_DROPPED, timestamp, &data_logger_dropped_pending, sizeof(uint32_t));
+                data_logger_dropped_pending = 0;
+            }
+            data_logger_append(block, type, timestamp, payload, length);
+            stored = true;
+        }
+    }
+    if(!stored)
+    {
+        data_logger_dropped_count++;
+        data_logger_dropped_pending++;
+    }
+    portEXIT_CRITICAL_SAFE(&data_logger_lock);
+
+    if(sealed)
+    {
+        if(xPortInIsrContext())
+        {
+            BaseType_t woken = pdFALSE;
+            vTaskNotifyGiveFromISR(data_logger_task, &woken);
+            portYIELD_FROM_ISR(woken);
+        }
+        else
+        {
+            xTaskNotifyGive(data_logger_task);
+        }
+    }
+    return stored;
+}
+
+bool IRAM_ATTR data_logger_can(uint8_t channel, uint32_t id, const uint8_t *data, uint8_t length)
+{
+    if(!(data_logger_can_channel_mask & (1 << channel)))
+        return false;
+    uint8_t payload[14];
+    length = length > 8? 8 : length;
+    memcpy(payload, &id, sizeof(id));
+    payload[4] = channel;
+    payload[5] = length;
+    memcpy(payload + 6, data, length);
+    return data_logger_record(DATA_LOGGER_RECORD_CAN, payload, 6 + length);
+}
+
+uint32_t data_logger_dropped()
+{
+    return data_logger_dropped_count;
+}
+
+static FILE *data_logger_open(uint32_t *offset)
+{
+    FILE *fd = fopen(data_logger_path, "ab");
+    if(fd == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to open %s", data_logger_path);
+        return NULL;
+    }
+    //blocks are already as large as a write should be, don't copy them through a stdio buffer
+    setvbuf(fd, NULL, _IONBF, 0);
+    fseek(fd, 0, SEEK_END);
+    *offset = (uint32_t)ftell(fd);
+    return fd;
+}
+
+static FILE *data_logger_rotate(FILE *fd, uint32_t *offset)
+{
+    char old[DATA_LOGGER_PATH_MAX + 4];
+    fclose(fd);
+    snprintf(old, sizeof(old), "%s.old", data_logger_path);
+    remove(old);
+    rename(data_logger_path, old);
+    return data_logger_open(offset);
+}
+
+static void data_logger_flush_task(void *arg)
+{
+    static data_logger_index_entry_t index[DATA_LOGGER_INDEX_INTERVAL];
+    static data_logger_block_header_t index_header;
+    size_t index_count = 0;
+    uint32_t sequence = 0;
+    uint32_t offset = 0;
+    FILE *fd = data_logger_open(&offset);
+
+    while(1)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(DATA_LOGGER_FLUSH_MS));
+
+        //seal the block being filled once it is old enough, so a quiet log still reaches the file
+        portENTER_CRITICAL(&data_logger_lock);
+        if(data_logger_filled - data_logger_flushed < DATA_LOGGER_BLOCKS)
+        {
+            const data_logger_block_t *block = &data_logger_blocks[data_logger_filled % DATA_LOGGER_BLOCKS];
+            if(block->length > 0 && (uint32_t)esp_timer_get_time() - block->first_timestamp_us >= DATA_LOGGER_FLUSH_MS * 1000)
+                data_logger_filled++;
+        }
+        const uint32_t filled = data_logger_filled;
+        portEXIT_CRITICAL(&data_logger_lock);
+
+        bool written = false;
+        for(uint32_t flushed = data_logger_flushed; flushed != filled; flushed++)
+        {
+            data_logger_block_t *block = &data_logger_blocks[flushed % DATA_LOGGER_BLOCKS];
+            const size_t length = sizeof(data_logger_block_header_t) + block->length;
+            const data_logger_block_header_t header =
+            {
+                .magic = DATA_LOGGER_BLOCK_MAGIC,
+                .sequence = sequence,
+                .first_timestamp_us = block->first_timestamp_us,
+                .length = (uint16_t)block->length,
+                .records = block->records
+            };
+            memcpy(block->data, &header, sizeof(header));
+
+            if(fd != NULL && offset + length + sizeof(index_header) + sizeof(index) > DATA_LOGGER_MAX_FILE_SIZE)
+            {
+                fd = data_logger_rotate(fd, &offset);
+                index_count = 0;
+            }
+            if(fd != NULL && fwrite(block->data, 1, length, fd) == length)
+            {
+                index[index_count++] = (data_logger_index_entry_t){ .offset = offset, .sequence = sequence, .first_timestamp_us = header.first_timestamp_us };
+                offset += length;
+                written = true;
+            }
+            sequence++;
+
+            if(fd != NULL && index_count == DATA_LOGGER_INDEX_INTERVAL)
+            {
+                index_header = (data_logger_block_header_t)
+                {
+                    .magic = DATA_LOGGER_INDEX_MAGIC,
+                    .sequence = sequence,
+                    .first_timestamp_us = index[0].first_timestamp_us,
+                    .length = sizeof(index),
+                    .records = DATA_LOGGER_INDEX_INTERVAL
+                };
+                if(fwrite(&index_header, sizeof(index_header), 1, fd) == 1 && fwrite(index, sizeof(index), 1, fd) == 1)
+                    offset += sizeof(index_header) + sizeof(index);
+                index_count = 0;
+            }
+
+            portENTER_CRITICAL(&data_logger_lock);
+            block->length = 0;
+            block->records = 0;
+            data_logger_flushed = flushed + 1;
+            portEXIT_CRITICAL(&data_logger_lock);
+        }
+
+        if(written && fd != NULL)
+            fsync(fileno(fd));
+    }
+}
+
+esp_err_t data_logger_start(const char *path, uint8_t can_channel_mask, UBaseType_t priority)
+{
+    if(data_logger_running)
+        return ESP_ERR_INVALID_STATE;
+    for(size_t i = 0; i < DATA_LOGGER_BLOCKS; i++)
+    {
+        if(data_logger_blocks[i].data == NULL)
+            data_logger_blocks[i].data = (uint8_t *)malloc(DATA_LOGGER_BLOCK_SIZE);
+        if(data_logger_blocks[i].data == NULL)
+            return ESP_ERR_NO_MEM;
+    }
+    strlcpy(data_logger_path, path, sizeof(data_logger_path));
+    data_logger_can_channel_mask = can_channel_mask;
+    if(xTaskCreate(data_logger_flush_task, "data_logger", 4096, NULL, priority, &data_logger_task) != pdPASS)
+        return ESP_ERR_NO_MEM;
+    data_logger_running = true;
+    return ESP_OK;
+}
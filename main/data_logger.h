@@ -0,0 +1,85 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_attr.h"
+#include "freertos/FreeRTOS.h"
+
+#ifndef DATA_LOGGER_H
+#define DATA_LOGGER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DATA_LOGGER_BLOCKS 4 //preallocated RAM blocks, one is filled while the others wait for the flush task
+#define DATA_LOGGER_BLOCK_SIZE 4096 //bytes per block including its header, also the size of each sequential write
+#define DATA_LOGGER_FLUSH_MS 500 //a partially filled block is written once it is this old
+#define DATA_LOGGER_INDEX_INTERVAL 16 //an index block follows every this many data blocks
+#define DATA_LOGGER_MAX_FILE_SIZE (512 * 1024) //the log is rotated to <path>.old once it reaches this size
+#define DATA_LOGGER_MAX_VARIABLES 64
+#define DATA_LOGGER_MAX_PAYLOAD 32
+
+/* The log is append only. Every block is { data_logger_block_header_t, length bytes of records }. Data blocks hold
+ * records of { uint8_t type, uint8_t length, uint32_t timestamp_us, length bytes of payload }. Index blocks hold
+ * data_logger_index_entry_t for the data blocks written since the previous index block, so a reader can seek by time
+ * without walking every record. All fields are little endian */
+#define DATA_LOGGER_BLOCK_MAGIC 0x474F4C45 //"ELOG"
+#define DATA_LOGGER_INDEX_MAGIC 0x58494C45 //"ELIX"
+
+typedef enum
+{
+    DATA_LOGGER_RECORD_VARIABLE = 1, //uint32_t id, raw Variable
+    DATA_LOGGER_RECORD_EDGE = 2, //uint8_t expander pin, uint8_t level
+    DATA_LOGGER_RECORD_CAN = 3, //uint32_t id with the CAN_GATEWAY_ID flags, uint8_t channel, uint8_t length, length data bytes
+    DATA_LOGGER_RECORD_DROPPED = 4 //uint32_t records dropped since the previous block because no block was free
+} data_logger_record_type_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t first_timestamp_us;
+    uint16_t length;
+    uint16_t records;
+} data_logger_block_header_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t offset; //file offset of the block header
+    uint32_t sequence;
+    uint32_t first_timestamp_us;
+} data_logger_index_entry_t;
+
+/* what is captured. loaded from a file of { uint32_t period_us, uint64_t edge_pin_mask, uint8_t can_channel_mask,
+ * uint8_t reserved[3] } followed by uint32_t variable ids. without it nothing is logged */
+#define DATA_LOGGER_CONFIG_FILE "/SPIFFS/logger.bin"
+#define DATA_LOGGER_FILE "/SPIFFS/log.bin"
+
+typedef struct
+{
+    uint32_t period_us; //changed variables are sampled at most this often. 0 samples every Loop()
+    uint64_t edge_pin_mask; //bit n logs edges of expander pin n
+    uint8_t can_channel_mask;
+    uint16_t variable_count;
+    uint32_t variable_ids[DATA_LOGGER_MAX_VARIABLES];
+} data_logger_config_t;
+
+esp_err_t data_logger_load(const char *path, data_logger_config_t *config);
+
+/* allocates the blocks and starts the flush task appending them to path */
+esp_err_t data_logger_start(const char *path, uint8_t can_channel_mask, UBaseType_t priority);
+
+/* appends a record. never blocks or allocates, drops the record when no block is free. safe from ISRs */
+bool IRAM_ATTR data_logger_record(data_logger_record_type_t type, const void *payload, uint8_t length);
+
+/* tap for received CAN frames, logs the channels in the started can_channel_mask. safe from ISRs */
+bool IRAM_ATTR data_logger_can(uint8_t channel, uint32_t id, const uint8_t *data, uint8_t length);
+
+uint32_t data_logger_dropped();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,7 +7,11 @@
 #include "http_server.h"
 #include "ATTiny_UPDI.h"
 #include "freertos/ringbuf.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
 #include "uart_listen.h"
+#include "config_partition.h"
+#include "profiler.h"
 
 #include "esp_log.h"
 
@@ -20,13 +24,17 @@
 /* Max length a file path can have on storage */
 #define FILE_PATH_MAX (ESP_VFS_PATH_MAX + CONFIG_SPIFFS_OBJ_NAME_LEN)
 
-/* Max size of an individual file. Make sure this
- * value is same as that set in upload_script.html */
-#define MAX_FILE_SIZE   (200*1024) // 200 KB
-#define MAX_FILE_SIZE_STR "200KB"
-
 /* Scratch buffer size */
 #define SCRATCH_BUFSIZE  8192
+/* Transfer buffers kept for handlers. httpd runs one handler at a time, one buffer covers it,
+ * the upload pipeline's second buffer and anything concurrent fall back to the heap */
+#define HTTP_BUFFER_POOL_SIZE 1
+
+/* Web assets indexed at startup. Files up to HTTP_ASSET_RAM_MAX_SIZE are kept in RAM
+ * while the total stays under HTTP_ASSET_RAM_BUDGET */
+#define HTTP_ASSET_MAX 32
+#define HTTP_ASSET_RAM_MAX_SIZE (16*1024)
+#define HTTP_ASSET_RAM_BUDGET (64*1024)
 #define ATTINY_FLASH_SIZE 4096
 #define ATTINY_FLASH_SIZE_STR "4KB"
 #define W806_FLASH_SIZE 1073741824
@@ -35,9 +43,16 @@
 struct http_server_data {
     /* Base path of file storage */
     char base_path[ESP_VFS_PATH_MAX + 1];
+};
 
-    /* Scratch buffer for temporary storage during file transfer */
-    char scratch[SCRATCH_BUFSIZE];
+struct http_asset {
+    /* Path relative to the base path, without a .gz suffix */
+    char name[CONFIG_SPIFFS_OBJ_NAME_LEN + 1];
+    size_t size;
+    bool gzip;
+    char etag[20];
+    /* Whole file when it was small enough to keep in RAM */
+    char *data;
 };
 
 static const char *TAG = "HTTP_SERVER";
@@ -45,27 +60,33 @@ static const char *TAG = "HTTP_SERVER";
 #define IS_FILE_EXT(filename, ext) \
     (strcasecmp(&filename[strlen(filename) - sizeof(ext) + 1], ext) == 0)
 
-/* Set HTTP response content type according to file extension */
-static esp_err_t set_content_type_from_file(httpd_req_t *req, const char *filename)
+/* HTTP content type according to file extension */
+static const char *content_type_from_file(const char *filename)
 {
     if (IS_FILE_EXT(filename, ".pdf")) {
-        return httpd_resp_set_type(req, "application/pdf");
+        return "application/pdf";
     } else if (IS_FILE_EXT(filename, ".bin")) {
-        return httpd_resp_set_type(req, "application/octet-stream");
+        return "application/octet-stream";
     } else if (IS_FILE_EXT(filename, ".html")) {
-        return httpd_resp_set_type(req, "text/html; charset=\"UTF-8\"");
+        return "text/html; charset=\"UTF-8\"";
     } else if (IS_FILE_EXT(filename, ".css")) {
-        return httpd_resp_set_type(req, "text/css; charset=\"UTF-8\"");
+        return "text/css; charset=\"UTF-8\"";
     } else if (IS_FILE_EXT(filename, ".js")) {
-        return httpd_resp_set_type(req, "text/javascript; charset=\"UTF-8\"");
+        return "text/javascript; charset=\"UTF-8\"";
     } else if (IS_FILE_EXT(filename, ".jpeg")) {
-        return httpd_resp_set_type(req, "image/jpeg");
+        return "image/jpeg";
     } else if (IS_FILE_EXT(filename, ".ico")) {
-        return httpd_resp_set_type(req, "image/x-icon");
+        return "image/x-icon";
     }
     /* This is a limited set only */
     /* For any other type always set as plain text */
-    return httpd_resp_set_type(req, "text/plain");
+    return "text/plain";
+}
+
+/* Set HTTP response content type according to file extension */
+static esp_err_t set_content_type_from_file(httpd_req_t *req, const char *filename)
+{
+    return httpd_resp_set_type(req, content_type_from_file(filename));
 }
 
 /* Copies the full path into destination buffer and returns
@@ -102,6 +123,208 @@ static const char* get_path_from_uri(char *dest, const char *base_path, const ch
     return dest + base_pathlen;
 }
 
+/* Transfer buffers of SCRATCH_BUFSIZE, so concurrent transfers never share one.
+ * static, they live as long as the server and would only fragment the heap */
+static char http_buffer_pool_storage[HTTP_BUFFER_POOL_SIZE][SCRATCH_BUFSIZE];
+static char *http_buffer_pool[HTTP_BUFFER_POOL_SIZE];
+static bool http_buffer_pool_used[HTTP_BUFFER_POOL_SIZE];
+static portMUX_TYPE http_buffer_pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static char *http_buffer_acquire()
+{
+    char *buffer = NULL;
+    portENTER_CRITICAL(&http_buffer_pool_lock);
+    for (size_t i = 0; i < HTTP_BUFFER_POOL_SIZE && buffer == NULL; i++) {
+        if (!http_buffer_pool_used[i] && http_buffer_pool[i] != NULL) {
+            http_buffer_pool_used[i] = true;
+            buffer = http_buffer_pool[i];
+        }
+    }
+    portEXIT_CRITICAL(&http_buffer_pool_lock);
+    return buffer != NULL ? buffer : (char *)malloc(SCRATCH_BUFSIZE);
+}
+
+static void http_buffer_release(char *buffer)
+{
+    portENTER_CRITICAL(&http_buffer_pool_lock);
+    for (size_t i = 0; i < HTTP_BUFFER_POOL_SIZE; i++) {
+        if (http_buffer_pool[i] == buffer) {
+            http_buffer_pool_used[i] = false;
+            buffer = NULL;
+        }
+    }
+    portEXIT_CRITICAL(&http_buffer_pool_lock);
+    free(buffer);
+}
+
+/* Index of the web assets on storage. Built at startup and updated by the upload and delete handlers,
+ * which run on the same httpd task as the downloads reading it */
+static struct http_asset http_assets[HTTP_ASSET_MAX];
+static size_t http_asset_count = 0;
+static size_t http_asset_ram = 0;
+
+/* Only web assets are indexed. Data files like config.bin and the log change behind the server's back */
+static bool http_asset_indexable(const char *name)
+{
+    return IS_FILE_EXT(name, ".html") || IS_FILE_EXT(name, ".css") || IS_FILE_EXT(name, ".js") ||
+           IS_FILE_EXT(name, ".jpeg") || IS_FILE_EXT(name, ".ico");
+}
+
+static struct http_asset *http_asset_find(const char *name)
+{
+    for (size_t i = 0; i < http_asset_count; i++) {
+        if (strcmp(http_assets[i].name, name) == 0) {
+            return &http_assets[i];
+        }
+    }
+    return NULL;
+}
+
+static void http_asset_remove(const char *name)
+{
+    struct http_asset *asset = http_asset_find(name);
+    if (!asset) {
+        return;
+    }
+    if (asset->data) {
+        http_asset_ram -= asset->size;
+        free(asset->data);
+    }
+    *asset = http_assets[--http_asset_count];
+}
+
+/* (Re)indexes the asset stored at filepath, relative name is the part after the base path */
+static void http_asset_update(const char *filepath, const char *filename)
+{
+    char name[CONFIG_SPIFFS_OBJ_NAME_LEN + 1];
+    const size_t length = strlen(filename);
+    const bool gzip = length > 3 && strcasecmp(filename + length - 3, ".gz") == 0;
+    strlcpy(name, filename, MIN(sizeof(name), gzip ? length - 2 : length + 1));
+    if (!http_asset_indexable(name)) {
+        return;
+    }
+
+    http_asset_remove(name);
+
+    /* a plain file is served in preference to its .gz variant, like the uncached path */
+    char path[FILE_PATH_MAX];
+    strlcpy(path, filepath, MIN(sizeof(path), strlen(filepath) - (gzip ? 3 : 0) + 1));
+    struct stat file_stat;
+    bool use_gzip = false;
+    if (stat(path, &file_stat) == -1) {
+        strlcat(path, ".gz", sizeof(path));
+        if (stat(path, &file_stat) == -1) {
+            return;
+        }
+        use_gzip = true;
+    }
+    if (http_asset_count >= HTTP_ASSET_MAX) {
+        ESP_LOGW(TAG, "Asset index full, %s is served uncached", name);
+        return;
+    }
+
+    FILE *fd = fopen(path, "r");
+    if (!fd) {
+        return;
+    }
+    struct http_asset *asset = &http_assets[http_asset_count];
+    memset(asset, 0, sizeof(struct http_asset));
+    strlcpy(asset->name, name, sizeof(asset->name));
+    asset->size = file_stat.st_size;
+    asset->gzip = use_gzip;
+    if (asset->size <= HTTP_ASSET_RAM_MAX_SIZE && http_asset_ram + asset->size <= HTTP_ASSET_RAM_BUDGET) {
+        asset->data = (char *)malloc(asset->size > 0 ? asset->size : 1);
+    }
+
+    /* FNV-1a over the content, read once here so requests never touch the file to validate */
+    uint32_t hash = 2166136261u;
+    size_t offset = 0;
+    char chunk[256];
+    size_t chunksize;
+    while ((chunksize = fread(chunk, 1, sizeof(chunk), fd)) > 0) {
+        for (size_t i = 0; i < chunksize; i++) {
+            hash = (hash ^ (uint8_t)chunk[i]) * 16777619u;
+        }
+        if (asset->data && offset + chunksize <= asset->size) {
+            memcpy(asset->data + offset, chunk, chunksize);
+        }
+        offset += chunksize;
+    }
+    fclose(fd);
+    if (offset != asset->size) {
+        free(asset->data);
+        return;
+    }
+    if (asset->data) {
+        http_asset_ram += asset->size;
+    }
+    snprintf(asset->etag, sizeof(asset->etag), "\"%08lx%s\"", (unsigned long)hash, use_gzip ? "g" : "");
+    http_asset_count++;
+}
+
+static void http_asset_index(const char *base_path)
+{
+    char filepath[FILE_PATH_MAX];
+    DIR *dir = opendir(base_path);
+    if (!dir) {
+        return;
+    }
+    const size_t base_pathlen = strlen(base_path);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (base_pathlen + 1 + strlen(entry->d_name) + 1 > sizeof(filepath)) {
+            continue;
+        }
+        snprintf(filepath, sizeof(filepath), "%s/%s", base_path, entry->d_name);
+        http_asset_update(filepath, filepath + base_pathlen);
+    }
+    closedir(dir);
+    ESP_LOGI(TAG, "Indexed %u assets, %u bytes cached in RAM", (unsigned)http_asset_count, (unsigned)http_asset_ram);
+}
+
+/* Serves an indexed asset, 304 when the client already holds this version */
+static esp_err_t http_asset_send(httpd_req_t *req, const char *base_path, const struct http_asset *asset)
+{
+    char etag[sizeof(asset->etag)];
+    httpd_resp_set_hdr(req, "ETag", asset->etag);
+    /* assets are replaced in place by uploads, so browsers revalidate every time and get a 304 back */
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", etag, sizeof(etag)) == ESP_OK && strcmp(etag, asset->etag) == 0) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    set_content_type_from_file(req, asset->name);
+    if (asset->gzip) {
+        httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    }
+    if (asset->data) {
+        return httpd_resp_send(req, asset->data, asset->size);
+    }
+
+    char filepath[FILE_PATH_MAX];
+    snprintf(filepath, sizeof(filepath), "%s%s%s", base_path, asset->name, asset->gzip ? ".gz" : "");
+    FILE *fd = fopen(filepath, "r");
+    if (!fd) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file\r\n");
+        return ESP_FAIL;
+    }
+    char *chunk = http_buffer_acquire();
+    esp_err_t ret = chunk ? ESP_OK : ESP_ERR_NO_MEM;
+    size_t chunksize;
+    while (ret == ESP_OK && (chunksize = fread(chunk, 1, SCRATCH_BUFSIZE, fd)) > 0) {
+        ret = httpd_resp_send_chunk(req, chunk, chunksize);
+    }
+    fclose(fd);
+    http_buffer_release(chunk);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "File sending failed!");
+        httpd_resp_sendstr_chunk(req, NULL);
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
 /* Handler to download a file kept on the server */
 static esp_err_t download_get_handler(httpd_req_t *req)
 {
@@ -119,6 +342,12 @@ static esp_err_t download_get_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
+    const char *base_path = ((struct http_server_data *)req->user_ctx)->base_path;
+    const struct http_asset *asset = http_asset_find(filename);
+    if (asset) {
+        return http_asset_send(req, base_path, asset);
+    }
+
     set_content_type_from_file(req, filename);
     if (stat(filepath, &file_stat) == -1) {
         httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
@@ -142,17 +371,22 @@ static esp_err_t download_get_handler(httpd_req_t *req)
 
     ESP_LOGI(TAG, "Sending file : %s (%ld bytes)...", filename, file_stat.st_size);
 
-    /* Retrieve the pointer to scratch buffer for temporary storage */
-    char *chunk = ((struct http_server_data *)req->user_ctx)->scratch;
+    char *chunk = http_buffer_acquire();
+    if (!chunk) {
+        fclose(fd);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory\r\n");
+        return ESP_FAIL;
+    }
     size_t chunksize;
     do {
-        /* Read file in chunks into the scratch buffer */
+        /* Read file in chunks into the transfer buffer */
         chunksize = fread(chunk, 1, SCRATCH_BUFSIZE, fd);
 
         if (chunksize > 0) {
             /* Send the buffer contents as HTTP response chunk */
             if (httpd_resp_send_chunk(req, chunk, chunksize) != ESP_OK) {
                 fclose(fd);
+                http_buffer_release(chunk);
                 ESP_LOGE(TAG, "File sending failed!");
                 /* Abort sending file */
                 httpd_resp_sendstr_chunk(req, NULL);
@@ -167,6 +401,7 @@ static esp_err_t download_get_handler(httpd_req_t *req)
 
     /* Close file after sending complete */
     fclose(fd);
+    http_buffer_release(chunk);
     ESP_LOGI(TAG, "File sending complete");
 
     /* Respond with an empty chunk to signal HTTP response completion */
@@ -180,6 +415,14 @@ int64_t get_timestamp() {
 	return (tv.tv_sec * 1000000LL + tv.tv_usec);
 }
 
+/* Ends a chunked response whose status already went out with an error line */
+static esp_err_t http_chunked_fail(httpd_req_t *req, const char *message)
+{
+    httpd_resp_sendstr_chunk(req, message);
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_FAIL;
+}
+
 /* Handler to upload flash to ATTiny */
 static esp_err_t upload_attiny_post_handler(httpd_req_t *req)
 {
@@ -188,8 +431,6 @@ static esp_err_t upload_attiny_post_handler(httpd_req_t *req)
 
     ESP_LOGI(TAG, "Receiving Attiny Flash");
 
-    /* Retrieve the pointer to scratch buffer for temporary storage */
-    char *buf = ((struct http_server_data *)req->user_ctx)->scratch;
     int received;
 
     /* File cannot be larger than a limit */
@@ -204,45 +445,86 @@ static esp_err_t upload_attiny_post_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
+    /* Only pages that differ from what the ATTiny holds are rewritten,
+     * unless a full chip erase is requested with ?full */
+    const bool delta = strstr(req->uri, "?full") == NULL;
+
+    /* Transfer buffer of its own, a download may be using another one at the same time.
+     * taken before programming starts, so running out of memory never touches the ATTiny */
+    char *buf = http_buffer_acquire();
+    if (buf == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory\r\n");
+        return ESP_FAIL;
+    }
+
+    /* Enable and erase before the body arrives, then program
+     * each page as soon as it has been received. once the first
+     * progress chunk is out, failures end the chunked response */
+    httpd_resp_sendstr_chunk(req, "Programming Flash\r\n");
+    if (!UPDI_ProgramBegin((uart_port_t)1, tx_pin, rx_pin, delta)) {
+        httpd_resp_sendstr_chunk(req, "Failed. Retrying...\r\n");
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        if(!UPDI_ProgramBegin((uart_port_t)1, tx_pin, rx_pin, delta)) {
+            ESP_LOGE(TAG, "Program failed!");
+            UPDI_ProgramAbort();
+            http_buffer_release(buf);
+            return http_chunked_fail(req, "Failed to enable programming\r\n");
+        }
+    }
+
     /* Content length of the request gives
      * the size of the file being uploaded */
     int remaining = req->content_len;
+    char progress[32];
+    const int64_t program_start = get_timestamp();
 
     while (remaining > 0) {
 
         ESP_LOGI(TAG, "Remaining size : %d", remaining);
         /* Receive the file part by part into a buffer */
-        if ((received = httpd_req_recv(req, buf + (req->content_len - remaining), MIN(remaining, SCRATCH_BUFSIZE))) <= 0) {
+        if ((received = httpd_req_recv(req, buf, MIN(remaining, SCRATCH_BUFSIZE))) <= 0) {
             if (received == HTTPD_SOCK_ERR_TIMEOUT) {
                 /* Retry if timeout occurred */
                 continue;
             }
 
             ESP_LOGE(TAG, "File reception failed!");
-            /* Respond with 500 Internal Server Error */
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive file\r\n");
-            return ESP_FAIL;
+            /* out of programming mode without erasing the rest */
+            UPDI_ProgramAbort();
+            http_buffer_release(buf);
+            return http_chunked_fail(req, "Failed to receive file\r\n");
         }
 
+        /* Write the received part to the ATTiny */
+        const uint32_t start_cycles = profiler_start();
+        if (!UPDI_ProgramWrite((uint8_t *)buf, received)) {
+            ESP_LOGE(TAG, "Program failed!");
+            UPDI_ProgramAbort();
+            http_buffer_release(buf);
+            return http_chunked_fail(req, "Failed to program flash\r\n");
+        }
+
+        profiler_end(PROFILER_STAGE_UPDI_WRITE, start_cycles);
+        profiler_count(PROFILER_COUNTER_UPDI_BYTES, received);
+
         /* Keep track of remaining size of
          * the file left to be uploaded */
         remaining -= received;
+
+        snprintf(progress, sizeof(progress), "%d/%d\r\n", req->content_len - remaining, req->content_len);
+        httpd_resp_sendstr_chunk(req, progress);
     }
 
-    httpd_resp_sendstr_chunk(req, "Programming Flash\r\n");
-    /* Write buffer content to ATTiny. retry once if failed first time */
-    if (!UPDI_Program((uart_port_t)1, tx_pin, rx_pin, (uint8_t *)buf, req->content_len)) {
-        httpd_resp_sendstr_chunk(req, "Failed. Retrying...\r\n");
-        vTaskDelay(pdMS_TO_TICKS(1000));
-        if(!UPDI_Program((uart_port_t)1, tx_pin, rx_pin, (uint8_t *)buf, req->content_len)) {
-            ESP_LOGE(TAG, "Program failed!");
-            /* Respond with 500 Internal Server Error */
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to program flash\r\n");
-            return ESP_FAIL;
-        }
+    http_buffer_release(buf);
+    if (!UPDI_ProgramEnd()) {
+        ESP_LOGE(TAG, "Program failed!");
+        UPDI_ProgramAbort();
+        return http_chunked_fail(req, "Failed to program flash\r\n");
     }
 
-    ESP_LOGI(TAG, "File reception complete");
+    const int64_t program_time = get_timestamp() - program_start;
+    ESP_LOGI(TAG, "File reception complete, %d bytes in %lldms (%lld bytes/s)", req->content_len,
+             (long long)(program_time / 1000), program_time > 0? (long long)req->content_len * 1000000 / program_time : 0LL);
 
     /* Redirect onto root to see the updated file list */
     httpd_resp_sendstr_chunk(req, "Flash programmed successfully\r\n");
@@ -252,6 +534,156 @@ static esp_err_t upload_attiny_post_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+/* Receive pipeline for uploads. The httpd task fills one buffer from the socket while a writer task hands the other
+ * to the sink, so Wi-Fi receive overlaps the storage writes */
+typedef esp_err_t (*http_upload_sink_t)(void *ctx, const char *data, size_t length);
+
+struct http_upload_chunk {
+    char *data;
+    size_t length;
+};
+
+struct http_upload_pipeline {
+    QueueHandle_t full;
+    QueueHandle_t empty;
+    http_upload_sink_t sink;
+    void *ctx;
+    esp_err_t result;
+    TaskHandle_t receiver;
+};
+
+static void http_upload_writer_task(void *arg)
+{
+    struct http_upload_pipeline *pipeline = (struct http_upload_pipeline *)arg;
+    struct http_upload_chunk chunk;
+    while (xQueueReceive(pipeline->full, &chunk, portMAX_DELAY) == pdTRUE && chunk.data != NULL) {
+        /* after a failure the rest is drained so the receiver never waits on a buffer */
+        if (pipeline->result == ESP_OK) {
+            pipeline->result = pipeline->sink(pipeline->ctx, chunk.data, chunk.length);
+        }
+        xQueueSend(pipeline->empty, &chunk.data, portMAX_DELAY);
+    }
+    xTaskNotifyGive(pipeline->receiver);
+    vTaskDelete(NULL);
+}
+
+static esp_err_t http_upload_receive(httpd_req_t *req, http_upload_sink_t sink, void *ctx)
+{
+    struct http_upload_pipeline pipeline = {
+        .full = xQueueCreate(2, sizeof(struct http_upload_chunk)),
+        .empty = xQueueCreate(2, sizeof(char *)),
+        .sink = sink,
+        .ctx = ctx,
+        .result = ESP_OK,
+        .receiver = xTaskGetCurrentTaskHandle()
+    };
+    char *buffers[2] = { http_buffer_acquire(), http_buffer_acquire() };
+    esp_err_t ret = ESP_OK;
+    if (!pipeline.full || !pipeline.empty || !buffers[0] || !buffers[1] ||
+        xTaskCreate(http_upload_writer_task, "http_upload", 3072, &pipeline, uxTaskPriorityGet(NULL), NULL) != pdPASS) {
+        if (pipeline.full) vQueueDelete(pipeline.full);
+        if (pipeline.empty) vQueueDelete(pipeline.empty);
+        http_buffer_release(buffers[0]);
+        http_buffer_release(buffers[1]);
+        return ESP_ERR_NO_MEM;
+    }
+    xQueueSend(pipeline.empty, &buffers[0], 0);
+    xQueueSend(pipeline.empty, &buffers[1], 0);
+
+    /* Content length of the request gives
+     * the size of the file being uploaded */
+    int remaining = req->content_len;
+    while (remaining > 0 && ret == ESP_OK && pipeline.result == ESP_OK) {
+        struct http_upload_chunk chunk = { .data = NULL, .length = 0 };
+        xQueueReceive(pipeline.empty, &chunk.data, portMAX_DELAY);
+
+        /* fill the whole buffer so the sink sees few large writes */
+        while (chunk.length < SCRATCH_BUFSIZE && remaining > 0) {
+            const int received = httpd_req_recv(req, chunk.data + chunk.length, MIN(remaining, SCRATCH_BUFSIZE - chunk.length));
+            if (received == HTTPD_SOCK_ERR_TIMEOUT) {
+                /* Retry if timeout occurred */
+                continue;
+            }
+            if (received <= 0) {
+                ret = ESP_FAIL;
+                break;
+            }
+            chunk.length += received;
+            remaining -= received;
+        }
+        if (ret == ESP_OK) {
+            xQueueSend(pipeline.full, &chunk, portMAX_DELAY);
+        } else {
+            xQueueSend(pipeline.empty, &chunk.data, portMAX_DELAY);
+        }
+    }
+
+    const struct http_upload_chunk done = { .data = NULL, .length = 0 };
+    xQueueSend(pipeline.full, &done, portMAX_DELAY);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    vQueueDelete(pipeline.full);
+    vQueueDelete(pipeline.empty);
+    http_buffer_release(buffers[0]);
+    http_buffer_release(buffers[1]);
+    return ret != ESP_OK ? ret : pipeline.result;
+}
+
+static esp_err_t http_upload_file_sink(void *ctx, const char *data, size_t length)
+{
+    return fwrite(data, 1, length, (FILE *)ctx) == length ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t http_upload_partition_sink(void *ctx, const char *data, size_t length)
+{
+    return config_partition_write(data, length);
+}
+
+static http_server_config_upload_begin_t config_upload_begin = NULL;
+static http_server_config_upload_end_t config_upload_end = NULL;
+
+void register_config_upload_http_server(http_server_config_upload_begin_t begin, http_server_config_upload_end_t end)
+{
+    config_upload_begin = begin;
+    config_upload_end = end;
+}
+
+/* Writes config.bin directly into the config partition */
+static esp_err_t upload_config_partition(httpd_req_t *req, const char *filepath)
+{
+    if (config_upload_begin && !config_upload_begin()) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Config reload in progress\r\n");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Receiving config into partition (%d bytes)...", req->content_len);
+    esp_err_t ret = config_partition_write_begin(req->content_len);
+    if (ret == ESP_OK) {
+        ret = http_upload_receive(req, http_upload_partition_sink, NULL);
+        if (ret == ESP_OK) {
+            ret = config_partition_write_end();
+        } else {
+            config_partition_write_abort();
+        }
+    }
+    if (ret == ESP_OK) {
+        /* a config.bin left on storage would be imported over the partition on the next load */
+        unlink(filepath);
+    }
+    if (config_upload_end) {
+        config_upload_end(ret == ESP_OK);
+    }
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Config partition write failed (%s)", esp_err_to_name(ret));
+        httpd_resp_send_err(req, ret == ESP_ERR_INVALID_SIZE ? HTTPD_400_BAD_REQUEST : HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write config partition\r\n");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_status(req, "200");
+    httpd_resp_sendstr(req, "Config written to partition\r\n");
+    return ESP_OK;
+}
+
 /* Handler to upload a file onto the server */
 static esp_err_t upload_post_handler(httpd_req_t *req)
 {
@@ -261,7 +693,6 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
 
     char filepath[FILE_PATH_MAX];
     FILE *fd = NULL;
-    struct stat file_stat;
 
     /* Skip leading "/upload" from URI to get filename */
     /* Note sizeof() counts NULL termination hence the -1 */
@@ -280,83 +711,67 @@ static esp_err_t upload_post_handler(httpd_req_t *req)
         return ESP_FAIL;
     }
 
-    if (stat(filepath, &file_stat) == 0) {
-        ESP_LOGI(TAG, "File already exists : %s", filepath);
-        ESP_LOGI(TAG, "Delting : %s", filepath);
-        unlink(filepath);
+    /* config.bin can be written straight into the config partition the running config is parsed from */
+    if (strcmp(filename, "/config.bin") == 0 && strstr(req->uri, "?partition") != NULL) {
+        return upload_config_partition(req, filepath);
     }
 
-    /* File cannot be larger than a limit */
-    if (req->content_len > MAX_FILE_SIZE) {
-        ESP_LOGE(TAG, "File too large : %d bytes", req->content_len);
+    /* The file is received next to the one it replaces and renamed over it once complete,
+     * so a failed upload leaves the previous file in place */
+    char temppath[FILE_PATH_MAX];
+    if (strlen(filename) + sizeof(".tmp") > CONFIG_SPIFFS_OBJ_NAME_LEN || strlen(filepath) + sizeof(".tmp") > sizeof(temppath)) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long\r\n");
+        return ESP_FAIL;
+    }
+    snprintf(temppath, sizeof(temppath), "%s.tmp", filepath);
+
+    /* File cannot be larger than the storage left. The file it replaces
+     * stays until the rename, so it doesn't count as free */
+    size_t total = 0, used = 0;
+    esp_spiffs_info(NULL, &total, &used);
+    const size_t available = total > used ? total - used : 0;
+    if (req->content_len > available) {
+        ESP_LOGE(TAG, "File too large : %d bytes, %u available", req->content_len, (unsigned)available);
         /* Respond with 400 Bad Request */
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
-                            "File size must be less than "
-                            MAX_FILE_SIZE_STR "!\r\n");
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Not enough storage for file\r\n");
         /* Return failure to close underlying connection else the
          * incoming file content will keep the socket busy */
         return ESP_FAIL;
     }
 
-    fd = fopen(filepath, "w");
+    unlink(temppath);
+    fd = fopen(temppath, "w");
     if (!fd) {
-        ESP_LOGE(TAG, "Failed to create file : %s", filepath);
+        ESP_LOGE(TAG, "Failed to create file : %s", temppath);
         /* Respond with 500 Internal Server Error */
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create file\r\n");
         return ESP_FAIL;
     }
+    /* the pipeline already writes whole buffers */
+    setvbuf(fd, NULL, _IONBF, 0);
 
-    ESP_LOGI(TAG, "Receiving file : %s...", filename);
-
-    /* Retrieve the pointer to scratch buffer for temporary storage */
-    char *buf = ((struct http_server_data *)req->user_ctx)->scratch;
-    int received;
-
-    /* Content length of the request gives
-     * the size of the file being uploaded */
-    int remaining = req->content_len;
-
-    while (remaining > 0) {
-
-        ESP_LOGI(TAG, "Remaining size : %d", remaining);
-        /* Receive the file part by part into a buffer */
-        if ((received = httpd_req_recv(req, buf, MIN(remaining, SCRATCH_BUFSIZE))) <= 0) {
-            if (received == HTTPD_SOCK_ERR_TIMEOUT) {
-                /* Retry if timeout occurred */
-                continue;
-            }
-
-            /* In case of unrecoverable error,
-             * close and delete the unfinished file*/
-            fclose(fd);
-            unlink(filepath);
-
-            ESP_LOGE(TAG, "File reception failed!");
-            /* Respond with 500 Internal Server Error */
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive file\r\n");
-            return ESP_FAIL;
-        }
-
-        /* Write buffer content to file on storage */
-        if (received && (received != fwrite(buf, 1, received, fd))) {
-            /* Couldn't write everything to file!
-             * Storage may be full? */
-            fclose(fd);
-            unlink(filepath);
-
-            ESP_LOGE(TAG, "File write failed!");
-            /* Respond with 500 Internal Server Error */
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write file to storage\r\n");
-            return ESP_FAIL;
-        }
-
-        /* Keep track of remaining size of
-         * the file left to be uploaded */
-        remaining -= received;
+    ESP_LOGI(TAG, "Receiving file : %s (%d bytes)...", filename, req->content_len);
+    esp_err_t ret = http_upload_receive(req, http_upload_file_sink, fd);
+    if (fclose(fd) != 0 && ret == ESP_OK) {
+        ret = ESP_FAIL;
+    }
+    if (ret != ESP_OK) {
+        unlink(temppath);
+        ESP_LOGE(TAG, "File reception failed!");
+        /* Respond with 500 Internal Server Error */
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive file\r\n");
+        return ESP_FAIL;
     }
 
-    /* Close file upon upload completion */
-    fclose(fd);
+    /* SPIFFS rename doesn't replace an existing file */
+    unlink(filepath);
+    if (rename(temppath, filepath) != 0) {
+        unlink(temppath);
+        ESP_LOGE(TAG, "Failed to rename %s", temppath);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to write file to storage\r\n");
+        return ESP_FAIL;
+    }
+    http_asset_update(filepath, filename);
     ESP_LOGI(TAG, "File reception complete");
 
     /* Redirect onto root to see the updated file list */
@@ -398,6 +813,7 @@ static esp_err_t delete_post_handler(httpd_req_t *req)
     ESP_LOGI(TAG, "Deleting file : %s", filename);
     /* Delete file */
     unlink(filepath);
+    http_asset_update(filepath, filename);
 
     /* Redirect onto root to see the updated file list */
     httpd_resp_set_status(req, "200");
@@ -405,6 +821,32 @@ static esp_err_t delete_post_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+/* Sockets closed by the server are reported to everyone who holds on to a socket fd past its request */
+#define HTTP_CLOSE_CALLBACK_MAX 4
+static http_server_close_callback_t close_callbacks[HTTP_CLOSE_CALLBACK_MAX];
+static void *close_callback_ctx[HTTP_CLOSE_CALLBACK_MAX];
+static size_t close_callback_count = 0;
+
+esp_err_t register_close_callback_http_server(http_server_close_callback_t callback, void *ctx)
+{
+    if (close_callback_count >= HTTP_CLOSE_CALLBACK_MAX) {
+        return ESP_ERR_NO_MEM;
+    }
+    close_callback_ctx[close_callback_count] = ctx;
+    close_callbacks[close_callback_count] = callback;
+    close_callback_count++;
+    return ESP_OK;
+}
+
+/* Runs on the httpd task. With a close_fn set the server leaves closing the socket to us */
+static void http_server_close_fn(httpd_handle_t hd, int sockfd)
+{
+    for (size_t i = 0; i < close_callback_count; i++) {
+        close_callbacks[i](sockfd, close_callback_ctx[i]);
+    }
+    close(sockfd);
+}
+
 httpd_handle_t server = NULL;
 /* Function to start the file server */
 esp_err_t start_http_server()
@@ -415,6 +857,9 @@ esp_err_t start_http_server()
      * allow the same handler to respond to multiple different
      * target URIs which match the wildcard scheme */
     config.uri_match_fn = httpd_uri_match_wildcard;
+    config.close_fn = http_server_close_fn;
+    /* the file, command, stats and websocket handlers are more than the default 8 */
+    config.max_uri_handlers = 12;
 
     ESP_LOGI(TAG, "Starting HTTP Server on port: '%d'", config.server_port);
     if (httpd_start(&server, &config) != ESP_OK) {
@@ -427,6 +872,7 @@ esp_err_t start_http_server()
 
 esp_err_t register_file_handler_http_server(const char *base_path)
 {
+    static struct http_server_data server_data_storage;
     static struct http_server_data *server_data = NULL;
 
     if (server_data) {
@@ -434,15 +880,16 @@ esp_err_t register_file_handler_http_server(const char *base_path)
         return ESP_ERR_INVALID_STATE;
     }
 
-    /* Allocate memory for server data */
-    server_data = (http_server_data *)calloc(1, sizeof(struct http_server_data));
-    if (!server_data) {
-        ESP_LOGE(TAG, "Failed to allocate memory for server data");
-        return ESP_ERR_NO_MEM;
-    }
+    /* Server data is static, it is never released */
+    server_data = &server_data_storage;
     strlcpy(server_data->base_path, base_path,
             sizeof(server_data->base_path));
 
+    for (size_t i = 0; i < HTTP_BUFFER_POOL_SIZE; i++) {
+        http_buffer_pool[i] = http_buffer_pool_storage[i];
+    }
+    http_asset_index(base_path);
+
     /* URI handler for getting uploaded files */
     httpd_uri_t file_download = {
         .uri       = "/*",  // Match all URIs of type /path/to/file
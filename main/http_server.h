@@ -12,6 +12,17 @@ extern httpd_handle_t server;
 esp_err_t start_http_server();
 esp_err_t register_file_handler_http_server(const char *base_path);
 
+/* callback runs on the httpd task whenever the server closes a socket, e.g. to drop a websocket client kept by fd.
+ * register before clients can connect */
+typedef void (*http_server_close_callback_t)(int sockfd, void *ctx);
+esp_err_t register_close_callback_http_server(http_server_close_callback_t callback, void *ctx);
+
+/* POST /upload/config.bin?partition writes the config partition directly. begin may refuse the upload,
+ * end is told whether the partition now holds the new config */
+typedef bool (*http_server_config_upload_begin_t)();
+typedef void (*http_server_config_upload_end_t)(bool written);
+void register_config_upload_http_server(http_server_config_upload_begin_t begin, http_server_config_upload_end_t end);
+
 #ifdef __cplusplus
 }
 #endif
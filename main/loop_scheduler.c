@@ -0,0 +1,93 @@
+#include "loop_scheduler.h"
+#include "driver/gptimer.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+
+static const char *TAG = "LOOP_SCHEDULER";
+
+static TaskHandle_t loop_task = NULL;
+static gptimer_handle_t loop_timer = NULL;
+static TickType_t loop_max_busy_ticks;
+static TickType_t loop_blocked_tick;
+
+static bool IRAM_ATTR loop_scheduler_alarm(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *user_ctx)
+{
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    vTaskNotifyGiveFromISR(loop_task, &higher_priority_task_woken);
+    return higher_priority_task_woken == pdTRUE;
+}
+
+esp_err_t loop_scheduler_start(uint32_t rate_hz, uint32_t max_busy_ms)
+{
+    if (loop_timer) {
+        ESP_LOGE(TAG, "Loop scheduler already started");
+        return ESP_ERR_INVALID_STATE;
+    }
+    /* the alarm counts whole microseconds */
+    if (rate_hz == 0 || rate_hz > 1000000) {
+        ESP_LOGE(TAG, "Loop rate %u Hz out of range", (unsigned int)rate_hz);
+        return ESP_ERR_INVALID_ARG;
+    }
+    loop_task = xTaskGetCurrentTaskHandle();
+    loop_max_busy_ticks = pdMS_TO_TICKS(max_busy_ms) > 0? pdMS_TO_TICKS(max_busy_ms) : 1;
+    loop_blocked_tick = xTaskGetTickCount();
+
+    gptimer_config_t timer_config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = 1000000,
+    };
+    ESP_ERROR_CHECK(gptimer_new_timer(&timer_config, &loop_timer));
+
+    gptimer_alarm_config_t alarm_config = {
+        .alarm_count = 1000000 / rate_hz,
+        .reload_count = 0,
+        .flags.auto_reload_on_alarm = true,
+    };
+    ESP_ERROR_CHECK(gptimer_set_alarm_action(loop_timer, &alarm_config));
+
+    gptimer_event_callbacks_t callbacks = {
+        .on_alarm = loop_scheduler_alarm,
+    };
+    ESP_ERROR_CHECK(gptimer_register_event_callbacks(loop_timer, &callbacks, NULL));
+    ESP_ERROR_CHECK(gptimer_enable(loop_timer));
+    ESP_ERROR_CHECK(gptimer_start(loop_timer));
+
+    ESP_LOGI(TAG, "Loop scheduled at %u Hz", (unsigned int)rate_hz);
+    return ESP_OK;
+}
+
+TaskHandle_t loop_scheduler_task()
+{
+    return loop_task;
+}
+
+void loop_scheduler_wait()
+{
+    /* with notifications always pending the take never blocks, and every task below the loop starves, idle and its
+     * watchdog included. give up at least one tick once the loop ran max_busy_ms without blocking */
+    const TickType_t now = xTaskGetTickCount();
+    if (now - loop_blocked_tick >= loop_max_busy_ticks) {
+        vTaskDelay(1);
+        loop_blocked_tick = xTaskGetTickCount();
+    }
+    if (ulTaskNotifyTake(pdTRUE, 0) > 0)
+        return;
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    loop_blocked_tick = xTaskGetTickCount();
+}
+
+void loop_scheduler_notify()
+{
+    if (loop_task)
+        xTaskNotifyGive(loop_task);
+}
+
+void IRAM_ATTR loop_scheduler_notify_from_isr()
+{
+    if (!loop_task)
+        return;
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    vTaskNotifyGiveFromISR(loop_task, &higher_priority_task_woken);
+    portYIELD_FROM_ISR(higher_priority_task_woken);
+}
@@ -0,0 +1,25 @@
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#ifndef LOOP_SCHEDULER_H
+#define LOOP_SCHEDULER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// wakes the calling task at rate_hz from a GPTimer, and immediately on loop_scheduler_notify*.
+// rate_hz 1 to 1000000. the task is put to sleep for a tick once it went max_busy_ms without blocking
+esp_err_t loop_scheduler_start(uint32_t rate_hz, uint32_t max_busy_ms);
+TaskHandle_t loop_scheduler_task();
+// blocks until the next timer tick or event, or for a tick when the loop has been busy too long
+void loop_scheduler_wait();
+void loop_scheduler_notify();
+void loop_scheduler_notify_from_isr();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,19 +1,30 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <atomic>
+#include <algorithm>
 #include "esp_wifi.h"
 #include "nvs_flash.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "driver/uart.h"
 #include "driver/gpio.h"
 #include "driver/spi_master.h"
 #include "sdkconfig.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "hal/gpio_hal.h"
 #include "uart_listen.h"
 #include "sock_uart.h"
 #include "mount.h"
 #include "http_server.h"
+#include "loop_scheduler.h"
+#include "profiler.h"
+#include "memory_monitor.h"
+#include "config_partition.h"
+#include "can_gateway.h"
+#include "can_filter.h"
 #include <ATTiny_UPDI.h>
 
 #include "lwip/err.h"
@@ -35,6 +46,10 @@
 #include "AnalogService_ATTiny427Expander.h"
 #include "DigitalService_ATTiny427Expander.h"
 #include "PwmService_ATTiny427Expander.h"
+#include "ATTinyLink.h"
+#include "VariableStore.h"
+#include "VariableSubscription.h"
+#include "DataLoggerCapture.h"
 #include "Esp32IdfAnalogService.h"
 #include "Esp32IdfDigitalService.h"
 #include "Esp32IdfTimerService.h"
@@ -46,10 +61,44 @@
 #define UPDI_UART_RX_PIN 15
 #define UPDI_UART_TX_PIN 14
 
+#define UART_LISTEN_EVENT_QUEUE_SIZE 20 //0 polls the uart byte by byte
+#define UART_LISTEN_RX_FULL_THRESHOLD 64 //half of the 128 byte RX FIFO
+#define UART_LISTEN_RX_TIMEOUT 2 //symbol times. keeps UPDI echo/response latency low
+
 #define ATTINY_MISO 23
 #define ATTINY_MOSI 7
 #define ATTINY_CLK  6
 #define ATTINY_CS   22
+#define ATTINY_CS_PINS { ATTINY_CS } //one CS line per ATTiny device, in ATTinyDevice order
+#define ATTINY_REFRESH_RATE 1000 //transactions per second when outputs are unchanged. 0 to free run
+#define ATTINY_FRAME_TASK_PRIORITY 0 //0 processes ATTiny frames in Loop(), otherwise in a pinned task of this priority
+
+#define LOOP_RATE_HZ 5000 //Loop() rate without events. ATTiny frames and websocket writes wake it immediately
+#define LOOP_TASK_PRIORITY 10
+#define LOOP_MAX_BUSY_MS 10 //events back to back never let Loop() block, it then sleeps a tick after this long so the tasks below it run
+
+//stays off: Esp32IdfCANService owns the TWAI driver and has no RX hook to call can_gateway_receive from, and a second
+//twai_receive would take the frames from under it. enabled, the gateway streams only what is handed to can_gateway_receive
+#define CAN_GATEWAY_ENABLE 0
+#define CAN_GATEWAY_PORT 8002 //udp/tcp port streaming raw CAN frames
+#define CAN_GATEWAY_FORMAT CAN_GATEWAY_FORMAT_SLCAN
+
+#define VARIABLE_SUBSCRIPTION_TASK_PRIORITY 4
+#define DATA_LOGGER_TASK_PRIORITY 2 //below everything that talks to the outside, the blocks absorb the write latency
+
+#define PROFILER_REPORT_INTERVAL_MS 0 //logs loop rate, SPI transactions/s, UPDI bytes/s and stage cycle counts over the console. 0 disables
+#define PROFILER_REPORT_TASK_PRIORITY 1
+
+// not trimmed, nothing has measured them yet. GET /stats/memory reports each task's stack_high_water to size them by
+#define UPDI_ENABLE_STACK_SIZE 4096
+#define EXPANDERMAIN_STAGE_STACK_SIZE 4096
+#define CAN_GATEWAY_STACK_SIZE 4096
+#define CONFIG_FLUSH_STACK_SIZE 4096
+
+#define TIMED_OUTPUT_TIMEOUT_MS 100 //how long POST /command/timed waits for Loop() to take the edge list
+
+#define CONFIG_COMMIT_INTERVAL_MS 2000 //config edits are committed to flash once they have been idle this long
+#define EXPANDERMAIN_STAGE_TASK_PRIORITY 4 //background task parsing a reloaded config while the running one keeps driving outputs
 
 using namespace OperationArchitecture;
 using namespace EmbeddedIOServices;
@@ -57,20 +106,15 @@ using namespace EmbeddedIOOperations;
 using namespace Esp32;
 using namespace EFIGenie;
 
+#ifdef ATTINY_EMBEDDED_IMAGE
+extern const uint8_t attinyload_start[] asm("_binary_attinyload_bin_start");
+extern const uint8_t attinyload_end[]   asm("_binary_attinyload_bin_end");
+#endif
+
 //read UPDI byte
 extern "C" bool UPDI_Read(uint8_t *val)
 {
-    uint8_t timeout = 0;
-    while(UPDI_rx_buffer_length < 1 && timeout++ < 100)
-        vTaskDelay(1);
-    if(timeout > 99){
-        return false;
-    }
-    // ESP_LOGE("UPDI", "read %x %d %d %d", UPDI_rx_buffer[UPDI_rx_buffer_index], UPDI_rx_buffer_index, UPDI_rx_buffer_length, timeout);
-    *val = UPDI_rx_buffer[UPDI_rx_buffer_index++];
-    UPDI_rx_buffer_length--;
-    UPDI_rx_buffer_index %= UPDI_RX_BUFFER_LENGTH;
-    return true;
+    return UPDI_ReadN(val, 1, UPDI_READ_TIMEOUT_TICKS);
 }
 
 //write UPDI byte
@@ -84,6 +128,23 @@ extern "C" bool UPDI_Write(uint8_t val)
     return verify == val;
 }
 
+//write UPDI bytes as one burst and verify the echo
+extern "C" bool UPDI_WriteN(const uint8_t *data, size_t length)
+{
+    if(uart_write_bytes(UPDI_uart_num, data, length) != (int)length)
+        return false;
+    uint8_t verify[32];
+    while(length > 0)
+    {
+        const size_t chunk = length < sizeof(verify)? length : sizeof(verify);
+        if(!UPDI_ReadN(verify, chunk, UPDI_READ_TIMEOUT_TICKS) || memcmp(verify, data, chunk) != 0)
+            return false;
+        data += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
 //UPDI send Break
 extern "C" void UPDI_Break()
 {
@@ -143,7 +204,7 @@ extern "C"
     bool UPDI_RX_Hook(const uint8_t *data, size_t len)
     {
         if(updi_enabled != 1) {
-            xTaskCreate(UPDI_Enable_Task, "UPDI_Enable", 4096, 0, 5, NULL);
+            xTaskCreate(UPDI_Enable_Task, "UPDI_Enable", UPDI_ENABLE_STACK_SIZE, 0, 5, NULL);
         }
         updi_enabled = 1;
         return true;
@@ -155,117 +216,324 @@ extern "C"
     ICommunicationService *_communicationService;
     CommunicationHandler_EFIGenie *_efiGenieHandler;
     ExpanderMain *_expanderMain;
+    Esp32IdfCANService *_esp32CANService;
+    twai_filter_config_t _canFilters[2];
     Variable *loopTime;
+    Variable *attinyTransactionRate;
+    Variable *attinyIsrTimeMax;
+    Variable *loopExecutionMean;
+    Variable *loopExecutionMax;
+    Variable *loopPeriodMax;
     uint32_t prev;
-
-    bool loadConfig()
+    uint32_t prevCycles = 0;
+    ATTinyLink *_attinyLinks[EXPANDER_ATTINY_DEVICES];
+    ATTinyLinkBus _attinyLinkBus;
+    VariableStore *_variableStore;
+    VariableSubscription *_variableSubscription;
+    DataLoggerCapture *_dataLoggerCapture;
+    //held while ExpanderMain generates into _variableMap and while the websocket handler reads it or is rebuilt
+    SemaphoreHandle_t _variableMapLock;
+    //an edge list posted to /command/timed. the pwm service is only driven from loop context, Loop() schedules it
+    //with times relative to when it does and leaves the result for the handler
+    enum TimedOutputState : uint8_t
     {
-        const char * configPath = "/SPIFFS/config.bin";
-        FILE *fd = NULL;
-        struct stat file_stat;
+        TimedOutputState_Idle = 0,
+        TimedOutputState_Pending,
+        TimedOutputState_Done
+    };
+    struct TimedOutputRequest
+    {
+        pwmpin_t Pin;
+        size_t Count;
+        timed_io_edge_t Edges[TIMED_IO_MAX_EDGES];
+        esp_err_t Result;
+    };
+    TimedOutputRequest _timedOutputRequest;
+    std::atomic<TimedOutputState> _timedOutputState(TimedOutputState_Idle);
+
+    void *loadConfig()
+    {
+        //a config.bin uploaded to SPIFFS is moved into the config partition, then parsed in place from flash
+        config_partition_import_file("/SPIFFS/config.bin");
 
-        if(stat(configPath, &file_stat) == -1)
-            return false;
-        fd = fopen(configPath, "r");
-        if(!fd)
-            return false;
-        free(_config);
-        _config = malloc(file_stat.st_size);
-        fread(_config, 1, file_stat.st_size, fd);
-        fclose(fd);
-        return true;
+        return const_cast<void *>(config_partition_get(0));
     }
 
     bool expandermain_write(void *destination, const void *data, size_t length) {
         if(reinterpret_cast<size_t>(destination) >= 0x20000000 && reinterpret_cast<size_t>(destination) <= 0x2000FA00)
         {
             std::memcpy(destination, data, length);
+            return true;
+        }
+
+        //cached and committed to flash by the config flush task. anything outside the active config is refused
+        //instead of being dropped silently
+        return config_partition_contains(destination, length) && config_partition_cache_write(destination, data, length) == ESP_OK;
+    }
+
+    //a reload runs on the stage task: commit, import, build and set up the new instance while the running one
+    //keeps its outputs. Loop() swaps it in with one exchange and deletes the old one after it
+    std::atomic<ExpanderMain *> _stagedExpanderMain(0);
+    std::atomic<bool> _expanderMainQuit(false);
+    std::atomic<bool> _expanderMainStaging(false);
+    //held by Loop() for each iteration and by the stage task while it builds, so the services and the ATTiny
+    //register images only ever see one of them
+    SemaphoreHandle_t _serviceLock;
+
+    bool canservice_prepare(twai_filter_config_t *filters);
+    void canservice_restart(const twai_filter_config_t *filters);
+    bool expandermain_quit();
+    bool expandermain_start();
+
+    void expandermain_stage_task(void *arg)
+    {
+        config_partition_commit();
+        void *config = loadConfig();
+        if(config == 0)
+        {
+            //nothing valid to build, the running instance stays
+            _expanderMainStaging.store(false);
+            vTaskDelete(NULL);
+            return;
         }
-        else if(reinterpret_cast<size_t>(destination) >= 0x8004000 && reinterpret_cast<size_t>(destination) <= 0x8008000)
+        twai_filter_config_t filters[2];
+        const bool restartCAN = canservice_prepare(filters);
+
+        //Loop() is between two iterations while this holds the lock, the running instance only pauses
+        xSemaphoreTake(_serviceLock, portMAX_DELAY);
+        for(uint8_t device = 0; device < EXPANDER_ATTINY_DEVICES; device++)
+            _attinyLinks[device]->BeginAccess();
+        xSemaphoreTake(_variableMapLock, portMAX_DELAY);
+        if(restartCAN)
         {
-            //TODO Write to flash
+            //the running instance holds the old service, so it is retired before TWAI is reinstalled. the only reload
+            //that stops the running instance before the new one is built
+            delete _expanderMain;
+            _expanderMain = 0;
+            canservice_restart(filters);
         }
 
-        return true;
+        size_t configSize = 0;
+        memory_monitor_section_begin(MEMORY_MONITOR_SECTION_EXPANDERMAIN_PARSE);
+        ExpanderMain *staged = new ExpanderMain(config, configSize, &_embeddedIOServiceCollection, _variableMap);
+        memory_monitor_section_end(MEMORY_MONITOR_SECTION_EXPANDERMAIN_PARSE);
+        memory_monitor_section_begin(MEMORY_MONITOR_SECTION_EXPANDERMAIN_SETUP);
+        staged->Setup();
+        memory_monitor_section_end(MEMORY_MONITOR_SECTION_EXPANDERMAIN_SETUP);
+
+        //the handler reads and edits the config through addresses in the slot it was built on, so it follows the new one
+        _config = config;
+        delete _efiGenieHandler;
+        _efiGenieHandler = new CommunicationHandler_EFIGenie(_variableMap, expandermain_write, expandermain_quit, expandermain_start, _config);
+        xSemaphoreGive(_variableMapLock);
+
+        //published before the lock is given back, so the old instance never runs against the pins the new one set up
+        _stagedExpanderMain.store(staged, std::memory_order_release);
+        for(uint8_t device = 0; device < EXPANDER_ATTINY_DEVICES; device++)
+            _attinyLinks[device]->EndAccess();
+        xSemaphoreGive(_serviceLock);
+        loop_scheduler_notify();
+        vTaskDelete(NULL);
     }
 
+    //stops the running instance at the next Loop(), outputs hold their last state until expandermain_start
     bool expandermain_quit() {
-        if(_expanderMain != 0)
+        _expanderMainQuit.store(true, std::memory_order_release);
+        loop_scheduler_notify();
+        return true;
+    }
+
+    //only one reload at a time, so the slot the running instance is parsed from is never rewritten under it
+    bool expandermain_claim() {
+        return !_expanderMainStaging.exchange(true);
+    }
+
+    bool expandermain_stage() {
+        if(xTaskCreate(expandermain_stage_task, "expandermain_stage", EXPANDERMAIN_STAGE_STACK_SIZE, 0, EXPANDERMAIN_STAGE_TASK_PRIORITY, NULL) != pdPASS)
         {
-            delete _expanderMain;
-            _expanderMain = 0;
+            _expanderMainStaging.store(false);
+            return false;
         }
         return true;
     }
 
     bool expandermain_start() {
-        if(_expanderMain == 0)
-        {
-            if(!loadConfig())
-                return false;
+        return expandermain_claim() && expandermain_stage();
+    }
 
-            size_t configSize = 0;
-            _expanderMain = new ExpanderMain(&_config, configSize, &_embeddedIOServiceCollection, _variableMap);
+    //a config written into the partition, uploaded or committed edits, holds the reload claim while it is written.
+    //the running instance is still parsed from the previous slot, so it is reloaded from the new one
+    void expandermain_config_written(bool written) {
+        if(written)
+            expandermain_stage();
+        else
+            _expanderMainStaging.store(false);
+    }
 
-            _expanderMain->Setup();
+    //only lets the ids the active config consumes through the TWAI acceptance filters. loads the filters of the active
+    //config into filters[2], true when they differ from the ones the service runs with. touches no service
+    bool canservice_prepare(twai_filter_config_t *filters)
+    {
+        if(can_filter_load(CAN_FILTER_FILE, config_partition_crc()) == ESP_OK)
+            ESP_LOGI("main", "CAN acceptance filters loaded from %s", CAN_FILTER_FILE);
+        bool changed = _esp32CANService == 0;
+        for(uint8_t channel = 0; channel < 2; channel++)
+        {
+            filters[channel] = can_filter_config(channel);
+            changed |= filters[channel].acceptance_code != _canFilters[channel].acceptance_code ||
+                filters[channel].acceptance_mask != _canFilters[channel].acceptance_mask ||
+                filters[channel].single_filter != _canFilters[channel].single_filter;
         }
-        return true;
+        return changed;
     }
 
-    void Setup() 
+    //the filters can only be changed by reinstalling the drivers, so the service is rebuilt. nothing may hold the old one
+    void canservice_restart(const twai_filter_config_t *filters)
     {
-        if(!loadConfig())
-            return;
-        if(_config == 0)
+        _canFilters[0] = filters[0];
+        _canFilters[1] = filters[1];
+        delete _esp32CANService;
+        const Esp32IdfCANServiceChannelConfig canconfigs[2] 
+        {
+            {
+                .t_config = TWAI_TIMING_CONFIG_500KBITS(),
+                .f_config = filters[0],
+                .g_config = TWAI_GENERAL_CONFIG_DEFAULT_V2(0, (gpio_num_t)9, (gpio_num_t)8, TWAI_MODE_NORMAL)
+            },
+            {
+                .t_config = TWAI_TIMING_CONFIG_500KBITS(),
+                .f_config = filters[1],
+                .g_config = TWAI_GENERAL_CONFIG_DEFAULT_V2(1, (gpio_num_t)3, (gpio_num_t)2, TWAI_MODE_NORMAL)
+            }
+        };
+        _esp32CANService = new Esp32IdfCANService(canconfigs);
+        _embeddedIOServiceCollection.CANService = _esp32CANService;
+    }
+
+    //loop context, inside the ATTiny access bracket
+    void expandermain_swap()
+    {
+        if(_expanderMainQuit.exchange(false, std::memory_order_acq_rel))
+        {
+            delete _expanderMain;
+            _expanderMain = 0;
+        }
+        ExpanderMain *staged = _stagedExpanderMain.exchange(0, std::memory_order_acq_rel);
+        if(staged == 0)
             return;
-        _variableMap = new GeneratorMap<Variable>();
+        ExpanderMain *retired = _expanderMain;
+        _expanderMain = staged;
+        //the expander services only re-init pins whose mode changed, so deleting the old instance leaves the outputs
+        //the new one drives alone
+        delete retired;
+        //the slot the old instance was parsed from is free to be rewritten now
+        _expanderMainStaging.store(false);
+    }
 
-        size_t _configSize = 0;
-        _expanderMain = new ExpanderMain(reinterpret_cast<void*>(_config), _configSize, &_embeddedIOServiceCollection, _variableMap);
+    void Setup() 
+    {
+        //the websocket handlers and a reload can run as soon as they are registered, keep them out until Setup is done
+        xSemaphoreTake(_serviceLock, portMAX_DELAY);
+        xSemaphoreTake(_variableMapLock, portMAX_DELAY);
+        _config = loadConfig();
+        twai_filter_config_t filters[2];
+        if(canservice_prepare(filters))
+            canservice_restart(filters);
+        if(_config != 0)
+        {
+            size_t _configSize = 0;
+            _expanderMain = new ExpanderMain(reinterpret_cast<void*>(_config), _configSize, &_embeddedIOServiceCollection, _variableMap);
+        }
 
+        static data_logger_config_t dataLoggerConfig;
+        if(data_logger_load(DATA_LOGGER_CONFIG_FILE, &dataLoggerConfig) == ESP_OK && data_logger_start(DATA_LOGGER_FILE, dataLoggerConfig.can_channel_mask, DATA_LOGGER_TASK_PRIORITY) == ESP_OK)
+            _dataLoggerCapture = new DataLoggerCapture(_variableStore, static_cast<DigitalService_Expander *>(_embeddedIOServiceCollection.DigitalService), &dataLoggerConfig);
         _efiGenieHandler = new CommunicationHandler_EFIGenie(_variableMap, expandermain_write, expandermain_quit, expandermain_start, _config);
         // ESP_LOGI("ASDF", "_config %p ", _efiGenieHandler->_config);
-        _communicationService->RegisterReceiveCallBack([](communication_send_callback_t send, const void *data, size_t length){ return _efiGenieHandler->Receive(send, data, length);});
+        _communicationService->RegisterReceiveCallBack([](communication_send_callback_t send, const void *data, size_t length){
+            const uint32_t startCycles = profiler_start();
+            xSemaphoreTake(_variableMapLock, portMAX_DELAY);
+            const size_t handled = _efiGenieHandler->Receive(send, data, length);
+            xSemaphoreGive(_variableMapLock);
+            profiler_end(PROFILER_STAGE_WEBSOCKET_RX, startCycles);
+            loop_scheduler_notify();
+            return handled;
+        });
 
-        _expanderMain->Setup();
-        loopTime = _variableMap->GenerateValue(250);
+        if(_expanderMain != 0)
+            _expanderMain->Setup();
+        //diagnostics live in the store so they stream and log like any config variable
+        loopTime = _variableStore->Live(_variableStore->Track(250));
+        attinyTransactionRate = _variableStore->Live(_variableStore->Track(251));
+        attinyIsrTimeMax = _variableStore->Live(_variableStore->Track(252));
+        loopExecutionMean = _variableStore->Live(_variableStore->Track(253));
+        loopExecutionMax = _variableStore->Live(_variableStore->Track(254));
+        loopPeriodMax = _variableStore->Live(_variableStore->Track(255));
+        xSemaphoreGive(_variableMapLock);
+        xSemaphoreGive(_serviceLock);
     }
     void Loop() 
     {
-        if(_expanderMain != 0) {
+        const uint32_t startCycles = profiler_start();
+        if(prevCycles != 0)
+            profiler_record(PROFILER_STAGE_LOOP_PERIOD, startCycles - prevCycles);
+        prevCycles = startCycles;
+
+        xSemaphoreTake(_serviceLock, portMAX_DELAY);
+        for(uint8_t device = 0; device < EXPANDER_ATTINY_DEVICES; device++)
+            _attinyLinks[device]->BeginAccess();
+        expandermain_swap();
+        if(_timedOutputState.load(std::memory_order_acquire) == TimedOutputState_Pending)
+        {
+            const int64_t nowNs = esp_timer_get_time() * 1000;
+            for(size_t i = 0; i < _timedOutputRequest.Count; i++)
+                _timedOutputRequest.Edges[i].time_ns += nowNs;
+            _timedOutputRequest.Result = static_cast<PwmService_Expander *>(_embeddedIOServiceCollection.PwmService)->ScheduleEdges(_timedOutputRequest.Pin, _timedOutputRequest.Edges, _timedOutputRequest.Count);
+            _timedOutputState.store(TimedOutputState_Done, std::memory_order_release);
+        }
+
+        if(_expanderMain != 0)
+        {
             const tick_t now = _embeddedIOServiceCollection.TimerService->GetTick();
             *loopTime = (float)(now-prev) / _embeddedIOServiceCollection.TimerService->GetTicksPerSecond();
             prev = now;
+            //the slowest device and the worst ISR across all of them
+            uint32_t transactionRate = _attinyLinks[0]->TransactionsPerSecond;
+            float isrTimeMax = _attinyLinks[0]->IsrTimeMax();
+            for(uint8_t device = 1; device < EXPANDER_ATTINY_DEVICES; device++)
+            {
+                transactionRate = std::min(transactionRate, _attinyLinks[device]->TransactionsPerSecond);
+                isrTimeMax = std::max(isrTimeMax, _attinyLinks[device]->IsrTimeMax());
+            }
+            *attinyTransactionRate = transactionRate;
+            *attinyIsrTimeMax = isrTimeMax;
+            *loopExecutionMean = profiler_mean_us(PROFILER_STAGE_LOOP);
+            *loopExecutionMax = profiler_max_us(PROFILER_STAGE_LOOP);
+            *loopPeriodMax = profiler_max_us(PROFILER_STAGE_LOOP_PERIOD);
             _expanderMain->Loop();
         }
+        _variableStore->Scan();
+        _variableSubscription->Update();
+        if(_dataLoggerCapture != 0)
+            _dataLoggerCapture->Update();
+        for(uint8_t device = 0; device < EXPANDER_ATTINY_DEVICES; device++)
+            _attinyLinks[device]->EndAccess();
+        xSemaphoreGive(_serviceLock);
+
+        profiler_end(PROFILER_STAGE_LOOP, startCycles);
     }
 
     Esp32IdfAnalogService *_esp32AnalogService;
     Esp32IdfDigitalService *_esp32DigitalService;
     Esp32IdfPwmService *_esp32PwmService;
 
-    ATTiny427Expander_Registers _attinyRegisters(SPI);
-    ATTiny427ExpanderUpdateService *_attinyUpdateService;
-    AnalogService_ATTiny427Expander *_attinyAnalogService;
-    DigitalService_ATTiny427Expander *_attinyDigitalService;
-    PwmService_ATTiny427Expander *_attinyPwmService;
-
-    uint32_t transactionCount = 0;
-    uint32_t prevTransactionCount = 0;
-    spi_device_handle_t attinySPI;
-    DMA_ATTR uint8_t inBuffer[1024];
-    DMA_ATTR uint8_t outBuffer[1024];
-
-    void IRAM_ATTR attinyTransactionCB(spi_transaction_t *t)
-    {
-        _attinyUpdateService->Receive(inBuffer, t->rxlength / 8);
-        _attinyDigitalService->Update();
+    ATTiny427Expander_Registers *_attinyRegisters[EXPANDER_ATTINY_DEVICES];
+    ATTiny427ExpanderUpdateService *_attinyUpdateServices[EXPANDER_ATTINY_DEVICES];
+    AnalogService_ATTiny427Expander *_attinyAnalogServices[EXPANDER_ATTINY_DEVICES];
+    DigitalService_ATTiny427Expander *_attinyDigitalServices[EXPANDER_ATTINY_DEVICES];
+    PwmService_ATTiny427Expander *_attinyPwmServices[EXPANDER_ATTINY_DEVICES];
 
-        t->length = _attinyUpdateService->Transmit(outBuffer) * 8;
-        t->rxlength = 0;
-        spi_device_queue_trans(attinySPI, t, 0);
-        transactionCount++;
-    }
+    spi_device_handle_t attinySPI[EXPANDER_ATTINY_DEVICES];
 
     void app_main()
     {
@@ -284,17 +552,18 @@ extern "C"
         //initialize wifi
         wifi_init_softap();
 
-        //install uart listen services
-        uart_listen_config_t uart_listen_config[UART_NUM_MAX];
-        char uart_listen_name[UART_NUM_MAX][16];
-        for(uint8_t i = UART_NUM_0; i < UART_NUM_MAX; i++)
-        {
-            uart_listen_config[i].uart_num = (uart_port_t)i;
-            uart_listen_config[i].rx_buffer_size = 2048;
-            uart_listen_config[i].tx_buffer_size = 0;
-            sprintf(uart_listen_name[i], "uart_listen_%d", i);
-            xTaskCreate(uart_listen, uart_listen_name[i], 4096, &uart_listen_config[i], 10, NULL);
-        }
+        //configure the UPDI uart listener. no uart is listened to until something subscribes to it
+        uart_listen_config_t updi_listen_config = {
+            .uart_num = (uart_port_t)1,
+            .rx_buffer_size = 1024,
+            .tx_buffer_size = 0,
+            .event_queue_size = UART_LISTEN_EVENT_QUEUE_SIZE,
+            .rx_full_threshold = UART_LISTEN_RX_FULL_THRESHOLD,
+            .rx_timeout = UART_LISTEN_RX_TIMEOUT,
+            .stack_size = 2560,
+            .priority = 10
+        };
+        uart_listen_configure(&updi_listen_config);
 
         // uart_config_t UPDI_uart_config = {
         //     .baud_rate = 100000,
@@ -318,46 +587,52 @@ extern "C"
 
         // xTaskCreate(sock_uart, "UPDI_sock_uart", 4096, &UPDI_sock_uart_config, 5, NULL);
         
-        // vTaskDelay(pdMS_TO_TICKS(1000));
-        // size_t attinyload_bytes = attinyload_end - attinyload_start;
-        // uint8_t *attinyload = (uint8_t *)calloc(attinyload_bytes, sizeof(uint8_t));
-        // memcpy(attinyload, attinyload_start, attinyload_bytes);
-        // UPDI_Program(1, 4, 5, attinyload, attinyload_bytes);
+#ifdef ATTINY_EMBEDDED_IMAGE
+        //provision the ATTiny with the embedded image. pages that already match are not rewritten
+        vTaskDelay(pdMS_TO_TICKS(100));
+        if(!UPDI_Provision((uart_port_t)1, (gpio_num_t)UPDI_UART_TX_PIN, (gpio_num_t)UPDI_UART_RX_PIN, attinyload_start, attinyload_end - attinyload_start))
+            ESP_LOGE("main", "ATTiny provisioning failed");
+#endif
         
         // xTaskCreate(echo_task, "echo_task", 2048, NULL, 10, NULL);
 
         // mount_sd("/SD");
         start_http_server();
 
+        mount_spiffs("/SPIFFS");
+
         _esp32AnalogService = new Esp32IdfAnalogService();
         _esp32DigitalService = new Esp32IdfDigitalService();
         _esp32PwmService = new Esp32IdfPwmService();
 
-        _attinyUpdateService = new ATTiny427ExpanderUpdateService(&_attinyRegisters);
-        _attinyAnalogService = new AnalogService_ATTiny427Expander(&_attinyRegisters);
-        _attinyDigitalService = new DigitalService_ATTiny427Expander(&_attinyRegisters);
-        _attinyPwmService = new PwmService_ATTiny427Expander(&_attinyRegisters);
+        //every ATTiny gets its own register image, services and link
+        for(uint8_t device = 0; device < EXPANDER_ATTINY_DEVICES; device++)
+        {
+            _attinyRegisters[device] = new ATTiny427Expander_Registers(SPI);
+            _attinyUpdateServices[device] = new ATTiny427ExpanderUpdateService(_attinyRegisters[device]);
+            _attinyAnalogServices[device] = new AnalogService_ATTiny427Expander(_attinyRegisters[device]);
+            _attinyDigitalServices[device] = new DigitalService_ATTiny427Expander(_attinyRegisters[device]);
+            _attinyPwmServices[device] = new PwmService_ATTiny427Expander(_attinyRegisters[device]);
+            _attinyLinks[device] = new ATTinyLink(_attinyUpdateServices[device], _attinyDigitalServices[device]);
+        }
 
-        _embeddedIOServiceCollection.AnalogService = new AnalogService_Expander(_esp32AnalogService, _attinyAnalogService);
-        _embeddedIOServiceCollection.DigitalService = new DigitalService_Expander(_esp32DigitalService, _attinyDigitalService);
-        _embeddedIOServiceCollection.PwmService = new PwmService_Expander(_esp32PwmService, _attinyPwmService, _attinyDigitalService);
+        _embeddedIOServiceCollection.AnalogService = new AnalogService_Expander(_esp32AnalogService, _attinyAnalogServices);
+        _embeddedIOServiceCollection.DigitalService = new DigitalService_Expander(_esp32DigitalService, _attinyDigitalServices, _attinyLinks);
+        _embeddedIOServiceCollection.PwmService = new PwmService_Expander(_esp32PwmService, _attinyPwmServices, _attinyDigitalServices);
         _embeddedIOServiceCollection.TimerService = new Esp32IdfTimerService();
-        const Esp32IdfCANServiceChannelConfig canconfigs[2] 
-        {
-            {
-                .t_config = TWAI_TIMING_CONFIG_500KBITS(),
-                .f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL(),
-                .g_config = TWAI_GENERAL_CONFIG_DEFAULT_V2(0, (gpio_num_t)9, (gpio_num_t)8, TWAI_MODE_NORMAL)
-            },
-            {
-                .t_config = TWAI_TIMING_CONFIG_500KBITS(),
-                .f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL(),
-                .g_config = TWAI_GENERAL_CONFIG_DEFAULT_V2(1, (gpio_num_t)3, (gpio_num_t)2, TWAI_MODE_NORMAL)
-            }
-        };
-        _embeddedIOServiceCollection.CANService = new Esp32IdfCANService(canconfigs);
         _communicationService = new Esp32IdfCommunicationService_WebSocket(server, "/EFIGenieCommunication");
 
+#if CAN_GATEWAY_ENABLE
+        static_assert(CAN_GATEWAY_PORT > 0, "CAN_GATEWAY_PORT must be set when the gateway is enabled");
+        //client frames are dropped until transmit can queue them onto the service
+        static can_gateway_config_t can_gateway_config = { .port = CAN_GATEWAY_PORT, .format = CAN_GATEWAY_FORMAT, .transmit = 0 };
+        xTaskCreate(can_gateway, "can_gateway", CAN_GATEWAY_STACK_SIZE, &can_gateway_config, 5, NULL);
+#endif
+
+        //the commands below can start a reload as soon as they are registered
+        _variableMapLock = xSemaphoreCreateMutex();
+        _serviceLock = xSemaphoreCreateMutex();
+
 		const httpd_uri_t resetPost = {
             .uri       = "/command/reset",
 			.method     = HTTP_POST,
@@ -371,8 +646,102 @@ extern "C"
 
         httpd_register_uri_handler(server, &resetPost);
 
-        mount_spiffs("/SPIFFS");
+		const httpd_uri_t commitPost = {
+            .uri       = "/command/commit",
+			.method     = HTTP_POST,
+			.handler    = [](httpd_req_t *req) 
+			{
+                if(!config_partition_dirty())
+                    return httpd_resp_sendstr(req, "Nothing to commit\r\n");
+                if(!expandermain_claim())
+                    return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Config reload in progress\r\n");
+                const esp_err_t ret = config_partition_commit();
+                expandermain_config_written(ret == ESP_OK);
+                if(ret != ESP_OK)
+                    return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to commit config\r\n");
+                return httpd_resp_sendstr(req, "Config committed\r\n");
+			}
+		};
+
+        httpd_register_uri_handler(server, &commitPost);
+
+        //POST /command/timed?pin=<n> with "<offset_ns>:<level>" pairs, offsets from when Loop() takes the list. the first
+        //has to be at least TIMED_IO_LEAD_NS out. plays on ESP32 routed outputs, which leave pwm until their next InitPin
+		const httpd_uri_t timedPost = {
+            .uri       = "/command/timed",
+			.method     = HTTP_POST,
+			.handler    = [](httpd_req_t *req) 
+			{
+                char query[32];
+                char value[8];
+                if(httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK || httpd_query_key_value(query, "pin", value, sizeof(value)) != ESP_OK)
+                    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing pin\r\n");
+                char body[TIMED_IO_MAX_EDGES * 16 + 1];
+                if(req->content_len >= sizeof(body))
+                    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Too many edges\r\n");
+                size_t length = 0;
+                while(length < req->content_len)
+                {
+                    const int received = httpd_req_recv(req, body + length, req->content_len - length);
+                    if(received == HTTPD_SOCK_ERR_TIMEOUT)
+                        continue;
+                    if(received <= 0)
+                        return ESP_FAIL;
+                    length += received;
+                }
+                body[length] = 0;
+
+                //a list Loop() never got to is still owned by it
+                if(_timedOutputState.load(std::memory_order_acquire) == TimedOutputState_Pending)
+                    return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Edge list pending\r\n");
+                _timedOutputRequest.Pin = static_cast<pwmpin_t>(atoi(value));
+                _timedOutputRequest.Count = 0;
+                char *next = body;
+                while(*next != 0 && _timedOutputRequest.Count < TIMED_IO_MAX_EDGES)
+                {
+                    char *end;
+                    const long long offset = strtoll(next, &end, 10);
+                    if(end == next || *end != ':')
+                        break;
+                    _timedOutputRequest.Edges[_timedOutputRequest.Count++] = { offset, strtol(end + 1, &next, 10) != 0 };
+                    while(*next == ',' || *next == ' ' || *next == '\r' || *next == '\n')
+                        next++;
+                }
+                if(_timedOutputRequest.Count == 0 || *next != 0)
+                    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Edges are <offset_ns>:<level> pairs\r\n");
+
+                _timedOutputState.store(TimedOutputState_Pending, std::memory_order_release);
+                loop_scheduler_notify();
+                for(uint32_t waited = 0; _timedOutputState.load(std::memory_order_acquire) != TimedOutputState_Done; waited++)
+                {
+                    if(waited >= pdMS_TO_TICKS(TIMED_OUTPUT_TIMEOUT_MS))
+                        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Loop did not take the edge list\r\n");
+                    vTaskDelay(1);
+                }
+                _timedOutputState.store(TimedOutputState_Idle, std::memory_order_relaxed);
+                if(_timedOutputRequest.Result != ESP_OK)
+                    return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, esp_err_to_name(_timedOutputRequest.Result));
+                return httpd_resp_sendstr(req, "Edges scheduled\r\n");
+			}
+		};
+
+        httpd_register_uri_handler(server, &timedPost);
+        //the map and the store outlive every ExpanderMain. the subscription uri has to be registered ahead of the "/*" file handler
+        _variableMap = new GeneratorMap<Variable>();
+        _variableStore = new VariableStore(_variableMap);
+        _variableSubscription = new VariableSubscription(_variableStore, _variableMapLock, VARIABLE_SUBSCRIPTION_TASK_PRIORITY);
+        _variableSubscription->Register(server, "/VariableSubscription");
+        profiler_register_http_handler(server, "/stats");
+        memory_monitor_register_http_handler(server, "/stats/memory");
+#if PROFILER_REPORT_INTERVAL_MS > 0
+        profiler_report_start(PROFILER_REPORT_INTERVAL_MS, PROFILER_REPORT_TASK_PRIORITY);
+#endif
+
+        config_partition_init();
+        static config_partition_flush_config_t config_flush_config = { .commit_interval_ms = CONFIG_COMMIT_INTERVAL_MS, .claim = expandermain_claim, .committed = expandermain_config_written };
+        xTaskCreate(config_partition_flush_task, "config_flush", CONFIG_FLUSH_STACK_SIZE, &config_flush_config, 3, NULL);
         register_file_handler_http_server("/SPIFFS");
+        register_config_upload_http_server(expandermain_claim, expandermain_config_written);
 
         spi_bus_config_t attinybuscfg = {
             .mosi_io_num = ATTINY_MOSI,
@@ -388,29 +757,41 @@ extern "C"
             .dummy_bits = 0,
             .mode = 0,                  //SPI mode 0
             .clock_speed_hz = 2400000,  //Clock out at 2.4 MHz. Theoretical 2.5Mhz doesn't work when ATTiny is using internal oscillator. running any faster loses MSB
-            .spics_io_num = ATTINY_CS,  //CS pin
+            .spics_io_num = -1,         //CS pin, set per device
             .flags = SPI_DEVICE_POSITIVE_CS,
             .queue_size = 7,            //We want to be able to queue 7 transactions at a time
-            .post_cb = attinyTransactionCB
+            .post_cb = ATTinyLink::TransactionCompleteCallBack
         };
         //Initialize the SPI bus
         ret = spi_bus_initialize(SPI2_HOST, &attinybuscfg, SPI_DMA_CH_AUTO);
         ESP_ERROR_CHECK(ret);
-        //Attach the LCD to the SPI bus
-        ret = spi_bus_add_device(SPI2_HOST, &attinydevcfg, &attinySPI);
-        ESP_ERROR_CHECK(ret);
+        //Attach every ATTiny to the SPI bus, the link bus takes turns between them
+        static const int attinyCSPins[] = ATTINY_CS_PINS;
+        static_assert(sizeof(attinyCSPins) / sizeof(attinyCSPins[0]) == EXPANDER_ATTINY_DEVICES, "ATTINY_CS_PINS needs one CS line per ATTiny device");
+        for(uint8_t device = 0; device < EXPANDER_ATTINY_DEVICES; device++)
+        {
+            attinydevcfg.spics_io_num = attinyCSPins[device];
+            ret = spi_bus_add_device(SPI2_HOST, &attinydevcfg, &attinySPI[device]);
+            ESP_ERROR_CHECK(ret);
+
+            ESP_ERROR_CHECK(_attinyLinks[device]->Begin(attinySPI[device], &_attinyLinkBus));
+            _attinyLinks[device]->SetRefreshRate(ATTINY_REFRESH_RATE);
+            if(ATTINY_FRAME_TASK_PRIORITY > 0)
+                ESP_ERROR_CHECK(_attinyLinks[device]->StartFrameTask(ATTINY_FRAME_TASK_PRIORITY, 0));
+        }
 
-        spi_transaction_t t;
-        memset(&t, 0, sizeof(t));
-        t.rx_buffer = inBuffer;
-        t.tx_buffer = outBuffer;
-        t.length = t.rxlength = 0;
-        attinyTransactionCB(&t);
+        vTaskPrioritySet(NULL, LOOP_TASK_PRIORITY);
+        ESP_ERROR_CHECK(loop_scheduler_start(LOOP_RATE_HZ, LOOP_MAX_BUSY_MS));
+        for(uint8_t device = 0; device < EXPANDER_ATTINY_DEVICES; device++)
+            _attinyLinks[device]->SetNotifyTask(loop_scheduler_task());
 
+        memory_monitor_section_begin(MEMORY_MONITOR_SECTION_SETUP);
         Setup();
+        memory_monitor_section_end(MEMORY_MONITOR_SECTION_SETUP);
+        memory_monitor_log();
         while (1)
         {          
-            vTaskDelay(1);
+            loop_scheduler_wait();
 
             Loop();
         }
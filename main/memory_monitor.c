@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <string.h>
+#include "memory_monitor.h"
+#include "sdkconfig.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static const char *TAG = "memory_monitor";
+
+static const char *section_names[MEMORY_MONITOR_SECTION_COUNT] = {
+    "setup",
+    "expandermain_parse",
+    "expandermain_setup"
+};
+
+typedef struct
+{
+    const char *name;
+    uint32_t caps;
+} memory_monitor_heap_t;
+
+static const memory_monitor_heap_t heaps[] = {
+    { "internal", MALLOC_CAP_INTERNAL },
+    { "dma", MALLOC_CAP_DMA },
+    { "default", MALLOC_CAP_DEFAULT }
+};
+
+memory_monitor_section_stats_t memory_monitor_sections[MEMORY_MONITOR_SECTION_COUNT];
+
+// counters at the time each section was opened
+typedef struct
+{
+    uint32_t allocations;
+    uint32_t frees;
+    uint32_t allocated_bytes;
+    size_t free_heap;
+} memory_monitor_mark_t;
+
+static memory_monitor_mark_t section_marks[MEMORY_MONITOR_SECTION_COUNT];
+
+static uint32_t allocations;
+static uint32_t frees;
+static uint32_t allocated_bytes;
+
+#ifdef CONFIG_HEAP_USE_HOOKS
+// called by the heap for every allocation and free, tasks and ISRs alike
+void IRAM_ATTR esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps)
+{
+    if (ptr == NULL)
+        return;
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&allocated_bytes, size, __ATOMIC_RELAXED);
+}
+
+void IRAM_ATTR esp_heap_trace_free_hook(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+    __atomic_fetch_add(&frees, 1, __ATOMIC_RELAXED);
+}
+#endif
+
+void memory_monitor_section_begin(memory_monitor_section_t section)
+{
+    memory_monitor_mark_t *mark = &section_marks[section];
+    mark->free_heap = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    mark->allocations = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+    mark->frees = __atomic_load_n(&frees, __ATOMIC_RELAXED);
+    mark->allocated_bytes = __atomic_load_n(&allocated_bytes, __ATOMIC_RELAXED);
+}
+
+void memory_monitor_section_end(memory_monitor_section_t section)
+{
+    const memory_monitor_mark_t *mark = &section_marks[section];
+    memory_monitor_section_stats_t *stats = &memory_monitor_sections[section];
+    stats->allocations = __atomic_load_n(&allocations, __ATOMIC_RELAXED) - mark->allocations;
+    stats->frees = __atomic_load_n(&frees, __ATOMIC_RELAXED) - mark->frees;
+    stats->allocated_bytes = __atomic_load_n(&allocated_bytes, __ATOMIC_RELAXED) - mark->allocated_bytes;
+    stats->heap_delta = (int32_t)heap_caps_get_free_size(MALLOC_CAP_DEFAULT) - (int32_t)mark->free_heap;
+    stats->runs++;
+}
+
+void memory_monitor_log()
+{
+    ESP_LOGI(TAG, "internal free %u largest %u min %u, dma free %u largest %u",
+        (unsigned int)heap_caps_get_free_size(MALLOC_CAP_INTERNAL), (unsigned int)heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL),
+        (unsigned int)heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+        (unsigned int)heap_caps_get_free_size(MALLOC_CAP_DMA), (unsigned int)heap_caps_get_largest_free_block(MALLOC_CAP_DMA));
+}
+
+/* Handler to report the heap, the task stacks and the sections as JSON */
+static esp_err_t memory_monitor_get_handler(httpd_req_t *req)
+{
+    char buf[256];
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    httpd_resp_sendstr_chunk(req, "{\"heap\":{");
+    for (size_t i = 0; i < sizeof(heaps) / sizeof(heaps[0]); i++) {
+        multi_heap_info_t info;
+        heap_caps_get_info(&info, heaps[i].caps);
+        snprintf(buf, sizeof(buf), "%s\"%s\":{\"total\":%u,\"free\":%u,\"min_free\":%u,\"largest_free_block\":%u,\"blocks\":%u}",
+            i == 0? "" : ",", heaps[i].name, (unsigned int)heap_caps_get_total_size(heaps[i].caps),
+            (unsigned int)info.total_free_bytes, (unsigned int)info.minimum_free_bytes,
+            (unsigned int)info.largest_free_block, (unsigned int)info.allocated_blocks);
+        httpd_resp_sendstr_chunk(req, buf);
+    }
+
+    /* high-water marks are the fewest bytes of stack a task ever had left */
+    httpd_resp_sendstr_chunk(req, "},\"tasks\":[");
+#if configUSE_TRACE_FACILITY
+    /* static, the httpd task stack couldn't hold it */
+    static TaskStatus_t tasks[MEMORY_MONITOR_MAX_TASKS];
+    const UBaseType_t task_count = uxTaskGetSystemState(tasks, MEMORY_MONITOR_MAX_TASKS, NULL);
+    for (UBaseType_t i = 0; i < task_count; i++) {
+        snprintf(buf, sizeof(buf), "%s{\"name\":\"%s\",\"priority\":%u,\"stack_high_water\":%u}",
+            i == 0? "" : ",", tasks[i].pcTaskName, (unsigned int)tasks[i].uxCurrentPriority,
+            (unsigned int)tasks[i].usStackHighWaterMark);
+        httpd_resp_sendstr_chunk(req, buf);
+    }
+#endif
+
+#ifdef CONFIG_HEAP_USE_HOOKS
+    snprintf(buf, sizeof(buf), "],\"allocations\":%u,\"frees\":%u,\"sections\":{",
+        (unsigned int)__atomic_load_n(&allocations, __ATOMIC_RELAXED), (unsigned int)__atomic_load_n(&frees, __ATOMIC_RELAXED));
+    httpd_resp_sendstr_chunk(req, buf);
+#else
+    httpd_resp_sendstr_chunk(req, "],\"sections\":{");
+#endif
+    for (int section = 0; section < MEMORY_MONITOR_SECTION_COUNT; section++) {
+        const memory_monitor_section_stats_t stats = memory_monitor_sections[section];
+        snprintf(buf, sizeof(buf), "%s\"%s\":{\"runs\":%u,\"allocations\":%u,\"frees\":%u,\"allocated_bytes\":%u,\"heap_delta\":%d}",
+            section == 0? "" : ",", section_names[section], (unsigned int)stats.runs, (unsigned int)stats.allocations,
+            (unsigned int)stats.frees, (unsigned int)stats.allocated_bytes, (int)stats.heap_delta);
+        httpd_resp_sendstr_chunk(req, buf);
+    }
+    httpd_resp_sendstr_chunk(req, "}}");
+    httpd_resp_sendstr_chunk(req, NULL);
+    return ESP_OK;
+}
+
+esp_err_t memory_monitor_register_http_handler(httpd_handle_t server, const char *uri)
+{
+    httpd_uri_t memory_get = {
+        .uri       = uri,
+        .method    = HTTP_GET,
+        .handler   = memory_monitor_get_handler,
+        .user_ctx  = NULL
+    };
+    return httpd_register_uri_handler(server, &memory_get);
+}
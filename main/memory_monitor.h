@@ -0,0 +1,50 @@
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+#ifndef MEMORY_MONITOR_H
+#define MEMORY_MONITOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MEMORY_MONITOR_MAX_TASKS 32 // FreeRTOS reports no task stacks at all once more tasks than this exist
+
+// code paths whose allocations are counted. every allocation made while a section is open counts against it,
+// including ones made by other tasks in the meantime
+typedef enum
+{
+    MEMORY_MONITOR_SECTION_SETUP = 0,           // boot Setup(), the services and the first ExpanderMain
+    MEMORY_MONITOR_SECTION_EXPANDERMAIN_PARSE,  // a reloaded config parsed into the staged ExpanderMain
+    MEMORY_MONITOR_SECTION_EXPANDERMAIN_SETUP,  // the staged ExpanderMain set up before it is swapped in
+    MEMORY_MONITOR_SECTION_COUNT
+} memory_monitor_section_t;
+
+typedef struct
+{
+    uint32_t runs;
+    // of the last run. allocation counts need CONFIG_HEAP_USE_HOOKS, they stay 0 without it
+    uint32_t allocations;
+    uint32_t frees;
+    uint32_t allocated_bytes;
+    int32_t heap_delta; // change of the free heap, negative when the section kept memory
+} memory_monitor_section_stats_t;
+
+extern memory_monitor_section_stats_t memory_monitor_sections[MEMORY_MONITOR_SECTION_COUNT];
+
+// a section must not be nested in itself
+void memory_monitor_section_begin(memory_monitor_section_t section);
+void memory_monitor_section_end(memory_monitor_section_t section);
+
+// logs free and largest free block of the internal and DMA heap
+void memory_monitor_log();
+
+// GET uri returns the heap by capability, the task stack high-water marks and the sections as JSON
+esp_err_t memory_monitor_register_http_handler(httpd_handle_t server, const char *uri);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
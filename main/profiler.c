@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <string.h>
+#include "profiler.h"
+#include "esp_attr.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "freertos/task.h"
+
+#define PROFILER_REPORT_STACK_SIZE 3072
+
+static const char *TAG = "profiler";
+
+static const char *stage_names[PROFILER_STAGE_COUNT] = {
+    "loop",
+    "loop_period",
+    "attiny_isr",
+    "attiny_frame",
+    "websocket_rx",
+    "uart_dispatch",
+    "updi_write"
+};
+
+static const char *counter_names[PROFILER_COUNTER_COUNT] = {
+    "spi_transactions",
+    "uart_bytes",
+    "updi_bytes"
+};
+
+profiler_stats_t profiler_stats[PROFILER_STAGE_COUNT];
+uint32_t profiler_counters[PROFILER_COUNTER_COUNT];
+
+void IRAM_ATTR profiler_record(profiler_stage_t stage, uint32_t cycles)
+{
+    profiler_stats_t *stats = &profiler_stats[stage];
+    if (stats->count == 0 || cycles < stats->min)
+        stats->min = cycles;
+    if (cycles > stats->max)
+        stats->max = cycles;
+    stats->total += cycles;
+    stats->count++;
+    stats->histogram[cycles == 0? 0 : 31 - __builtin_clz(cycles)]++;
+}
+
+// counters are left running, they are only ever read as differences
+void profiler_reset()
+{
+    memset(profiler_stats, 0, sizeof(profiler_stats));
+}
+
+float profiler_mean_us(profiler_stage_t stage)
+{
+    const profiler_stats_t *stats = &profiler_stats[stage];
+    if (stats->count == 0)
+        return 0;
+    return (float)stats->total / stats->count / esp_rom_get_cpu_ticks_per_us();
+}
+
+float profiler_max_us(profiler_stage_t stage)
+{
+    return (float)profiler_stats[stage].max / esp_rom_get_cpu_ticks_per_us();
+}
+
+static void profiler_report_task(void *arg)
+{
+    const uint32_t interval_ms = (uint32_t)(uintptr_t)arg;
+    const uint32_t ticks_per_us = esp_rom_get_cpu_ticks_per_us();
+    uint32_t prev_stage_count[PROFILER_STAGE_COUNT];
+    uint32_t prev_counters[PROFILER_COUNTER_COUNT];
+    for (int stage = 0; stage < PROFILER_STAGE_COUNT; stage++)
+        prev_stage_count[stage] = profiler_stats[stage].count;
+    for (int counter = 0; counter < PROFILER_COUNTER_COUNT; counter++)
+        prev_counters[counter] = __atomic_load_n(&profiler_counters[counter], __ATOMIC_RELAXED);
+    int64_t prev_time = esp_timer_get_time();
+
+    TickType_t wake = xTaskGetTickCount();
+    while (1) {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(interval_ms));
+        const int64_t now = esp_timer_get_time();
+        const float seconds = (now - prev_time) / 1000000.0f;
+        prev_time = now;
+
+        for (int stage = 0; stage < PROFILER_STAGE_COUNT; stage++) {
+            const profiler_stats_t stats = profiler_stats[stage];
+            const uint32_t count = stats.count - prev_stage_count[stage];
+            prev_stage_count[stage] = stats.count;
+            if (stats.count == 0)
+                continue;
+            ESP_LOGI(TAG, "%-14s %8.1f/s min %8u max %8u mean %8u cycles, max %.2fus", stage_names[stage], count / seconds,
+                (unsigned int)stats.min, (unsigned int)stats.max, (unsigned int)(stats.total / stats.count), (float)stats.max / ticks_per_us);
+        }
+        for (int counter = 0; counter < PROFILER_COUNTER_COUNT; counter++) {
+            const uint32_t value = __atomic_load_n(&profiler_counters[counter], __ATOMIC_RELAXED);
+            const uint32_t delta = value - prev_counters[counter];
+            prev_counters[counter] = value;
+            if (delta != 0)
+                ESP_LOGI(TAG, "%-16s %10.1f/s", counter_names[counter], delta / seconds);
+        }
+    }
+}
+
+esp_err_t profiler_report_start(uint32_t interval_ms, UBaseType_t priority)
+{
+    if (interval_ms == 0)
+        return ESP_ERR_INVALID_ARG;
+    if (xTaskCreate(profiler_report_task, "profiler_report", PROFILER_REPORT_STACK_SIZE, (void *)(uintptr_t)interval_ms, priority, NULL) != pdPASS)
+        return ESP_ERR_NO_MEM;
+    return ESP_OK;
+}
+
+/* Handler to report the profiler stages and counters as JSON */
+static esp_err_t profiler_get_handler(httpd_req_t *req)
+{
+    char buf[512];
+    const uint32_t ticks_per_us = esp_rom_get_cpu_ticks_per_us();
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    snprintf(buf, sizeof(buf), "{\"cycles_per_us\":%u,\"stages\":{", (unsigned int)ticks_per_us);
+    httpd_resp_sendstr_chunk(req, buf);
+
+    for (int stage = 0; stage < PROFILER_STAGE_COUNT; stage++) {
+        /* copy so the stage is reported consistently while it keeps being recorded */
+        const profiler_stats_t stats = profiler_stats[stage];
+        snprintf(buf, sizeof(buf), "%s\"%s\":{\"count\":%u,\"min_us\":%.2f,\"max_us\":%.2f,\"mean_us\":%.2f,\"histogram_log2_cycles\":[",
+            stage == 0? "" : ",", stage_names[stage], (unsigned int)stats.count,
+            (float)stats.min / ticks_per_us, (float)stats.max / ticks_per_us,
+            stats.count == 0? 0.0f : (float)stats.total / stats.count / ticks_per_us);
+        httpd_resp_sendstr_chunk(req, buf);
+
+        size_t len = 0;
+        for (int bucket = 0; bucket < PROFILER_HISTOGRAM_BUCKETS; bucket++) {
+            len += snprintf(buf + len, sizeof(buf) - len, "%s%u", bucket == 0? "" : ",", (unsigned int)stats.histogram[bucket]);
+        }
+        snprintf(buf + len, sizeof(buf) - len, "]}");
+        httpd_resp_sendstr_chunk(req, buf);
+    }
+    httpd_resp_sendstr_chunk(req, "},\"counters\":{");
+    for (int counter = 0; counter < PROFILER_COUNTER_COUNT; counter++) {
+        snprintf(buf, sizeof(buf), "%s\"%s\":%u", counter == 0? "" : ",", counter_names[counter],
+            (unsigned int)__atomic_load_n(&profiler_counters[counter], __ATOMIC_RELAXED));
+        httpd_resp_sendstr_chunk(req, buf);
+    }
+    httpd_resp_sendstr_chunk(req, "}}");
+    httpd_resp_sendstr_chunk(req, NULL);
+
+    char query[16];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK && strncmp(query, "reset", 5) == 0) {
+        profiler_reset();
+    }
+    return ESP_OK;
+}
+
+esp_err_t profiler_register_http_handler(httpd_handle_t server, const char *uri)
+{
+    httpd_uri_t stats_get = {
+        .uri       = uri,
+        .method    = HTTP_GET,
+        .handler   = profiler_get_handler,
+        .user_ctx  = NULL
+    };
+    return httpd_register_uri_handler(server, &stats_get);
+}
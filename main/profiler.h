@@ -0,0 +1,82 @@
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_cpu.h"
+#include "esp_http_server.h"
+#include "freertos/FreeRTOS.h"
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROFILER_HISTOGRAM_BUCKETS 32 // bucket n counts samples of [2^n, 2^(n+1)) cycles
+
+typedef enum
+{
+    PROFILER_STAGE_LOOP = 0,
+    PROFILER_STAGE_LOOP_PERIOD,
+    PROFILER_STAGE_ATTINY_ISR,
+    PROFILER_STAGE_ATTINY_FRAME,
+    PROFILER_STAGE_WEBSOCKET_RX,
+    PROFILER_STAGE_UART_DISPATCH,
+    PROFILER_STAGE_UPDI_WRITE,
+    PROFILER_STAGE_COUNT
+} profiler_stage_t;
+
+// running totals reported as rates
+typedef enum
+{
+    PROFILER_COUNTER_SPI_TRANSACTIONS = 0,
+    PROFILER_COUNTER_UART_BYTES,
+    PROFILER_COUNTER_UPDI_BYTES,
+    PROFILER_COUNTER_COUNT
+} profiler_counter_t;
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint32_t histogram[PROFILER_HISTOGRAM_BUCKETS];
+} profiler_stats_t;
+
+extern profiler_stats_t profiler_stats[PROFILER_STAGE_COUNT];
+extern uint32_t profiler_counters[PROFILER_COUNTER_COUNT];
+
+static inline uint32_t profiler_start()
+{
+    return esp_cpu_get_cycle_count();
+}
+
+// records cycles against a stage. safe from ISRs and tasks, each stage should only have one writer
+void profiler_record(profiler_stage_t stage, uint32_t cycles);
+
+static inline void profiler_end(profiler_stage_t stage, uint32_t start)
+{
+    profiler_record(stage, esp_cpu_get_cycle_count() - start);
+}
+
+// adds to a counter. safe from ISRs and tasks, counters may have several writers
+static inline void profiler_count(profiler_counter_t counter, uint32_t amount)
+{
+    __atomic_fetch_add(&profiler_counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+void profiler_reset();
+float profiler_mean_us(profiler_stage_t stage);
+float profiler_max_us(profiler_stage_t stage);
+
+// logs every stage and the counter rates over the console each interval_ms, from a task of priority
+esp_err_t profiler_report_start(uint32_t interval_ms, UBaseType_t priority);
+
+// GET uri returns all stages as JSON. GET uri?reset clears them after reporting
+esp_err_t profiler_register_http_handler(httpd_handle_t server, const char *uri);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
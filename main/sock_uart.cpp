@@ -1,53 +1,201 @@
-
 #include "sock_uart.h"
 #include "uart_listen.h"
 #include "lwip/sockets.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/stream_buffer.h"
+#include <atomic>
+#include <string.h>
 
+//a single task serves the listen socket and every session with select(). uart data is coalesced in a
+//stream buffer and sent once a full segment is waiting or SOCK_UART_FLUSH_US after the last flush.
+//whatever a session doesn't take right away waits in its backlog and goes out before anything newer
 typedef struct
 {
-    sock_uart_config_t *sock_uart_config;
-    int sock;
-} sock_uart_read_config_t;
+    sock_uart_config_t *config;
+    int sessions[SOCK_UART_MAX_CLIENTS];
+    uint8_t *backlog[SOCK_UART_MAX_CLIENTS];
+    size_t backlog_length[SOCK_UART_MAX_CLIENTS];
+    int64_t backlog_progress[SOCK_UART_MAX_CLIENTS]; //last time the backlog was empty or shrank
+    uint8_t max_clients;
+    int newest; //session that receives uart data when not broadcasting
+    std::atomic<uint8_t> session_count;
+    StreamBufferHandle_t tx_buffer;
+    int64_t last_flush;
+} sock_uart_state_t;
 
-void sock_uart_read(void *arg)
+static void sock_uart_uart_rx(void *context, const uint8_t *data, size_t length)
 {
-    sock_uart_read_config_t *config = (sock_uart_read_config_t *)arg;
+    sock_uart_state_t *state = (sock_uart_state_t *)context;
+    if(state->session_count.load() == 0)
+        return;
+    xStreamBufferSend(state->tx_buffer, data, length, 0);
+}
 
-    ESP_ERROR_CHECK(uart_param_config(config->sock_uart_config->uart_num, config->sock_uart_config->uart_config));
-    ESP_ERROR_CHECK(uart_set_pin(config->sock_uart_config->uart_num, config->sock_uart_config->tx_pin, config->sock_uart_config->rx_pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+static void sock_uart_close(sock_uart_state_t *state, int session)
+{
+    shutdown(state->sessions[session], 0);
+    close(state->sessions[session]);
+    state->sessions[session] = -1;
+    state->backlog_length[session] = 0;
+    state->session_count--;
+    if(state->newest == session)
+    {
+        //hand the uart data over to one of the remaining clients
+        state->newest = -1;
+        for(int i = 0; i < state->max_clients; i++)
+            if(state->sessions[i] >= 0)
+                state->newest = i;
+    }
+}
+
+static void sock_uart_accept(sock_uart_state_t *state, int listen_sock)
+{
+    int keepAlive = 1;
+    int keepIdle = 5;
+    int keepInterval = 5;
+    int keepCount = 3;
+    int noDelay = 1;
+    int tos = IPTOS_LOWDELAY;
 
-    auto uart_callback_iterator = uart_listen_add_callback(config->sock_uart_config->uart_num, [&](const uint8_t *rx_buffer, size_t len) {
-        send(config->sock, rx_buffer, len, 0);
-    });
+    struct sockaddr_storage source_addr;
+    socklen_t addr_len = sizeof(source_addr);
+    int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+    if (sock < 0) {
+        ESP_LOGE("SOCK_UART", "Unable to accept connection: errno %d", errno);
+        return;
+    }
 
-    int len;
-    uint8_t rx_buffer[config->sock_uart_config->sock_rx_buffer_size];
-    while(1)
+    int session = -1;
+    for(int i = 0; i < state->max_clients; i++)
     {
-        len = recv(config->sock, rx_buffer, sizeof(rx_buffer), 0);
-        if (len == 0 || len == -1) {
-            ESP_LOGW("SOCK_UART", "Connection closed");
-            goto sock_uart_read_cleanup;
-        } else if (len < 0) {
-            ESP_LOGE("SOCK_UART", "Error occurred during receiving: errno %d", len);
-        } else {
-            bool perform_write = true;
-            if(config->sock_uart_config->sock_rx_hook != 0) {
-                perform_write = config->sock_uart_config->sock_rx_hook(rx_buffer, len);
-            }
-            if(perform_write) {
-                uart_write_bytes(config->sock_uart_config->uart_num, rx_buffer, len);
-            }
+        if(state->sessions[i] < 0)
+        {
+            session = i;
+            break;
+        }
+    }
+    if(session < 0)
+    {
+        ESP_LOGW("SOCK_UART", "Connection refused, %d clients connected", state->max_clients);
+        close(sock);
+        return;
+    }
+
+    // Set tcp keepalive option
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(int));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
+    // set no delay
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+    setsockopt(sock, IPPROTO_IP, IP_TOS, &tos, sizeof(int));
+
+    //something else may have reconfigured the uart while nobody was connected
+    ESP_ERROR_CHECK(uart_param_config(state->config->uart_num, state->config->uart_config));
+    ESP_ERROR_CHECK(uart_set_pin(state->config->uart_num, state->config->tx_pin, state->config->rx_pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+
+    if(state->config->sock_rx_hook != 0)
+        state->config->sock_rx_hook(0, 0);
+    if(state->session_count.load() == 0)
+        xStreamBufferReset(state->tx_buffer);
+    state->sessions[session] = sock;
+    state->backlog_length[session] = 0;
+    state->newest = session;
+    state->session_count++;
+}
+
+static void sock_uart_receive(sock_uart_state_t *state, int session, uint8_t *rx_buffer, size_t rx_buffer_size)
+{
+    int len = recv(state->sessions[session], rx_buffer, rx_buffer_size, 0);
+    if (len == 0 || len == -1) {
+        ESP_LOGW("SOCK_UART", "Connection closed");
+        sock_uart_close(state, session);
+    } else if (len < 0) {
+        ESP_LOGE("SOCK_UART", "Error occurred during receiving: errno %d", len);
+    } else {
+        bool perform_write = true;
+        if(state->config->sock_rx_hook != 0) {
+            perform_write = state->config->sock_rx_hook(rx_buffer, len);
+        }
+        if(perform_write) {
+            uart_write_bytes(state->config->uart_num, rx_buffer, len);
+        }
+    }
+}
+
+//sends what a session has waiting. returns false when the session had to be closed
+static bool sock_uart_drain(sock_uart_state_t *state, int session)
+{
+    const size_t length = state->backlog_length[session];
+    if(length == 0)
+        return true;
+    const int sent = send(state->sessions[session], state->backlog[session], length, MSG_DONTWAIT);
+    if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        sock_uart_close(state, session);
+        return false;
+    }
+    const int64_t now = esp_timer_get_time();
+    if(sent > 0)
+    {
+        state->backlog_length[session] = length - sent;
+        memmove(state->backlog[session], state->backlog[session] + sent, length - sent);
+        state->backlog_progress[session] = now;
+    }
+    else if(now - state->backlog_progress[session] >= SOCK_UART_STALL_US)
+    {
+        ESP_LOGW("SOCK_UART", "Client stalled for %d ms, closing", SOCK_UART_STALL_US / 1000);
+        sock_uart_close(state, session);
+        return false;
+    }
+    return true;
+}
+
+//a slow client never stalls the others. it gets the data later from its backlog, or is closed once that overflows,
+//so a client never sees the stream with bytes missing from the middle
+static void sock_uart_send(sock_uart_state_t *state, int session, const uint8_t *data, size_t length)
+{
+    if(!sock_uart_drain(state, session))
+        return;
+    size_t sent = 0;
+    if(state->backlog_length[session] == 0)
+    {
+        const int result = send(state->sessions[session], data, length, MSG_DONTWAIT);
+        if(result < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            sock_uart_close(state, session);
+            return;
         }
+        if(result > 0)
+            sent = result;
+        if(sent == length)
+            return;
+        state->backlog_progress[session] = esp_timer_get_time();
     }
+    if(state->backlog_length[session] + length - sent > SOCK_UART_CLIENT_BACKLOG)
+    {
+        ESP_LOGW("SOCK_UART", "Client fell %d bytes behind, closing", SOCK_UART_CLIENT_BACKLOG);
+        sock_uart_close(state, session);
+        return;
+    }
+    memcpy(state->backlog[session] + state->backlog_length[session], data + sent, length - sent);
+    state->backlog_length[session] += length - sent;
+}
 
-sock_uart_read_cleanup:
-    uart_listen_remove_callback(config->sock_uart_config->uart_num, uart_callback_iterator);
-    shutdown(config->sock, 0);
-    close(config->sock);
-    vTaskDelete(NULL);
-    delete config;
+static void sock_uart_flush(sock_uart_state_t *state, uint8_t *tx_chunk)
+{
+    size_t len;
+    while((len = xStreamBufferReceive(state->tx_buffer, tx_chunk, SOCK_UART_COALESCE_SIZE, 0)) > 0)
+    {
+        for(int i = 0; i < state->max_clients; i++)
+        {
+            if(state->sessions[i] < 0 || (!state->config->broadcast && i != state->newest))
+                continue;
+            sock_uart_send(state, i, tx_chunk, len);
+        }
+    }
+    state->last_flush = esp_timer_get_time();
 }
 
 extern "C" {
@@ -55,12 +203,6 @@ extern "C" {
     {
         sock_uart_config_t *config = (sock_uart_config_t *)arg;
 
-        int keepAlive = 1;
-        int keepIdle = 5;
-        int keepInterval = 5;
-        int keepCount = 3;
-        int noDelay = 1;
-        int tos = IPTOS_LOWDELAY;
         struct sockaddr_storage dest_addr;
 
         struct sockaddr_in *dest_addr_ip4 = (struct sockaddr_in *)&dest_addr;
@@ -68,6 +210,12 @@ extern "C" {
         dest_addr_ip4->sin_family = AF_INET;
         dest_addr_ip4->sin_port = htons(config->port);
 
+        sock_uart_state_t *state = 0;
+        uint8_t *rx_buffer = 0;
+        uint8_t *tx_chunk = 0;
+        uint32_t uart_callback_id = 0;
+        bool allocated = false;
+
         int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
         if (listen_sock < 0) 
         {
@@ -85,47 +233,94 @@ extern "C" {
             goto sock_uart_cleanup;
         }
 
-        err = listen(listen_sock, 1);
+        state = new sock_uart_state_t();
+        state->config = config;
+        state->max_clients = config->max_clients == 0? 1 : (config->max_clients > SOCK_UART_MAX_CLIENTS? SOCK_UART_MAX_CLIENTS : config->max_clients);
+        state->newest = -1;
+        for(int i = 0; i < SOCK_UART_MAX_CLIENTS; i++)
+            state->sessions[i] = -1;
+        state->tx_buffer = xStreamBufferCreate(SOCK_UART_TX_BUFFER_SIZE, 1);
+        rx_buffer = (uint8_t *)malloc(config->sock_rx_buffer_size);
+        tx_chunk = (uint8_t *)malloc(SOCK_UART_COALESCE_SIZE);
+        allocated = state->tx_buffer != NULL && rx_buffer != 0 && tx_chunk != 0;
+        for(int i = 0; i < state->max_clients; i++)
+        {
+            state->backlog[i] = (uint8_t *)malloc(SOCK_UART_CLIENT_BACKLOG);
+            allocated &= state->backlog[i] != 0;
+        }
+        if(!allocated)
+        {
+            ESP_LOGE("SOCK_UART", "Unable to allocate buffers");
+            goto sock_uart_cleanup;
+        }
+
+        err = listen(listen_sock, state->max_clients);
         if (err != 0) 
         {
             ESP_LOGE("SOCK_UART", "Error occurred during listen: errno %d", errno);
             goto sock_uart_cleanup;
         }
 
-        while(!uart_is_driver_installed(config->uart_num)) vTaskDelay(pdMS_TO_TICKS(100));//wait for uart driver to be installed by uart_listen
+        ESP_ERROR_CHECK(uart_listen_start(config->uart_num));
         ESP_ERROR_CHECK(uart_param_config(config->uart_num, config->uart_config));
         ESP_ERROR_CHECK(uart_set_pin(config->uart_num, config->tx_pin, config->rx_pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+        uart_callback_id = uart_listen_add_callback(config->uart_num, sock_uart_uart_rx, state);
 
         while (1) 
         {
-            struct sockaddr_storage source_addr;
-            socklen_t addr_len = sizeof(source_addr);
-            int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
-            if (sock < 0) {
-                ESP_LOGE("SOCK_UART", "Unable to accept connection: errno %d", errno);
-                continue;
+            fd_set readfds;
+            fd_set writefds;
+            FD_ZERO(&readfds);
+            FD_ZERO(&writefds);
+            FD_SET(listen_sock, &readfds);
+            int maxfd = listen_sock;
+            for(int i = 0; i < state->max_clients; i++)
+            {
+                if(state->sessions[i] < 0)
+                    continue;
+                FD_SET(state->sessions[i], &readfds);
+                //wake as soon as a backlogged client can take more
+                if(state->backlog_length[i] > 0)
+                    FD_SET(state->sessions[i], &writefds);
+                if(state->sessions[i] > maxfd)
+                    maxfd = state->sessions[i];
+            }
+
+            struct timeval timeout = { .tv_sec = 0, .tv_usec = SOCK_UART_FLUSH_US };
+            const int ready = select(maxfd + 1, &readfds, &writefds, NULL, &timeout);
+            if(ready > 0)
+            {
+                for(int i = 0; i < state->max_clients; i++)
+                {
+                    if(state->sessions[i] >= 0 && FD_ISSET(state->sessions[i], &readfds))
+                        sock_uart_receive(state, i, rx_buffer, config->sock_rx_buffer_size);
+                }
+                if(FD_ISSET(listen_sock, &readfds))
+                    sock_uart_accept(state, listen_sock);
             }
 
-            // Set tcp keepalive option
-            setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(int));
-            setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int));
-            setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
-            setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
-            // set no delay
-            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
-            setsockopt(sock, IPPROTO_IP, IP_TOS, &tos, sizeof(int));
-
-            config->sock_rx_hook(0, 0);
-            sock_uart_read_config_t *sock_uart_read_config = new sock_uart_read_config_t(
+            if(state->session_count.load() > 0 && (xStreamBufferBytesAvailable(state->tx_buffer) >= SOCK_UART_COALESCE_SIZE || esp_timer_get_time() - state->last_flush >= SOCK_UART_FLUSH_US))
+                sock_uart_flush(state, tx_chunk);
+            for(int i = 0; i < state->max_clients; i++)
             {
-                .sock_uart_config = config,
-                .sock = sock
-            });
-            xTaskCreate(sock_uart_read, "sock_uart_read", 4096, sock_uart_read_config, 10, NULL);
+                if(state->sessions[i] >= 0)
+                    sock_uart_drain(state, i);
+            }
         }
 
 sock_uart_cleanup:
+        uart_listen_remove_callback(config->uart_num, uart_callback_id);
+        if(state != 0)
+        {
+            if(state->tx_buffer != NULL)
+                vStreamBufferDelete(state->tx_buffer);
+            for(int i = 0; i < SOCK_UART_MAX_CLIENTS; i++)
+                free(state->backlog[i]);
+            delete state;
+        }
+        free(rx_buffer);
+        free(tx_chunk);
         close(listen_sock);
         vTaskDelete(NULL);
     }
-}
\ No newline at end of file
+}
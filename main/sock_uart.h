@@ -5,6 +5,13 @@
 #ifndef SOCK_UART_H
 #define SOCK_UART_H
 
+#define SOCK_UART_MAX_CLIENTS 4
+#define SOCK_UART_TX_BUFFER_SIZE 4096 //uart data waiting to be coalesced into tcp segments
+#define SOCK_UART_COALESCE_SIZE 1436 //flush as soon as a full segment is waiting
+#define SOCK_UART_FLUSH_US 1000 //otherwise flush this long after the last flush
+#define SOCK_UART_CLIENT_BACKLOG 4096 //bytes a slow client may fall behind before it is closed
+#define SOCK_UART_STALL_US 2000000 //or how long it may take nothing while data waits
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -18,6 +25,8 @@ typedef struct
     gpio_num_t tx_pin;
     gpio_num_t rx_pin;
     bool(*sock_rx_hook)(const uint8_t *, size_t);
+    uint8_t max_clients; //sessions served at once, up to SOCK_UART_MAX_CLIENTS. 0 serves a single client
+    bool broadcast; //uart data goes to every client instead of only the newest one
 } sock_uart_config_t;
 
 void sock_uart(void *arg);
@@ -0,0 +1,305 @@
+#include <string.h>
+#include "timed_io.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/rmt_tx.h"
+#include "driver/mcpwm_cap.h"
+
+#define TIMED_IO_MAX_SYMBOLS 128 //long gaps take one half symbol per 32767 ticks
+#define TIMED_IO_MAX_DURATION 32767
+#define TIMED_IO_NS_PER_TICK (1000000000 / TIMED_IO_RESOLUTION_HZ)
+#define TIMED_IO_LATENCY_SHIFT 2 //each measured list moves the latency estimate a quarter of the way
+
+typedef struct
+{
+    bool used;
+    bool level; //level the pin holds once the last list finished
+    rmt_channel_handle_t channel;
+    rmt_encoder_handle_t encoder;
+    size_t halves;
+    uint64_t ticks; //length of the list in symbols
+    rmt_symbol_word_t symbols[TIMED_IO_MAX_SYMBOLS];
+    //the transmit call starts the list some time after it is placed. the done event measures when it really started,
+    //the next list is placed that much later
+    bool measure;
+    int64_t start_ns; //where the list was placed
+    int32_t latency_ns;
+} timed_io_output_t;
+
+typedef struct
+{
+    bool used;
+    bool has_rise;
+    mcpwm_cap_channel_handle_t channel;
+    uint32_t timeout_us;
+    uint32_t rise;
+    //written by the capture ISR, read under the sequence count
+    uint32_t sequence;
+    uint32_t period_ticks;
+    uint32_t pulse_ticks;
+    int64_t last_edge_us;
+} timed_io_capture_t;
+
+static const char *TAG = "TIMED_IO";
+
+static timed_io_output_t timed_io_outputs[TIMED_IO_OUTPUTS];
+static timed_io_capture_t timed_io_captures[TIMED_IO_CAPTURES];
+static mcpwm_cap_timer_handle_t timed_io_capture_timer = NULL;
+static uint32_t timed_io_capture_resolution = 0;
+
+static bool timed_io_output_put(timed_io_output_t *output, bool level, uint32_t ticks)
+{
+    if(output->halves >= TIMED_IO_MAX_SYMBOLS * 2)
+        return false;
+    rmt_symbol_word_t *symbol = &output->symbols[output->halves / 2];
+    if(output->halves % 2 == 0)
+    {
+        symbol->level0 = level;
+        symbol->duration0 = ticks;
+    }
+    else
+    {
+        symbol->level1 = level;
+        symbol->duration1 = ticks;
+    }
+    output->halves++;
+    output->ticks += ticks;
+    return true;
+}
+
+//holds level for ticks, split over as many halves as it takes
+static bool timed_io_output_hold(timed_io_output_t *output, bool level, uint64_t ticks)
+{
+    while(ticks > 0)
+    {
+        const uint32_t chunk = ticks > TIMED_IO_MAX_DURATION? TIMED_IO_MAX_DURATION : (uint32_t)ticks;
+        if(!timed_io_output_put(output, level, chunk))
+            return false;
+        ticks -= chunk;
+    }
+    return true;
+}
+
+static bool IRAM_ATTR timed_io_output_done(rmt_channel_handle_t channel, const rmt_tx_done_event_data_t *event, void *arg)
+{
+    timed_io_output_t *output = (timed_io_output_t *)arg;
+    if(!output->measure)
+        return false;
+    output->measure = false;
+    //the list ended its length after it started. the interrupt latency of the event lands in the estimate too,
+    //so edges run early by about that
+    const int64_t started_ns = esp_timer_get_time() * 1000 - (int64_t)(output->ticks * TIMED_IO_NS_PER_TICK);
+    int32_t latency_ns = output->latency_ns + (int32_t)((started_ns - output->start_ns) >> TIMED_IO_LATENCY_SHIFT);
+    if(latency_ns < 0)
+        latency_ns = 0;
+    if(latency_ns > TIMED_IO_LEAD_NS / 2)
+        latency_ns = TIMED_IO_LEAD_NS / 2;
+    output->latency_ns = latency_ns;
+    return false;
+}
+
+static esp_err_t timed_io_output_play(timed_io_output_t *output, bool eot_level)
+{
+    //an odd half is padded so the symbol ends on the final level
+    if(output->halves % 2 != 0)
+        timed_io_output_put(output, eot_level, 1);
+    const rmt_transmit_config_t config = { .loop_count = 0, .flags = { .eot_level = eot_level } };
+    return rmt_transmit(output->channel, output->encoder, output->symbols, output->halves / 2 * sizeof(rmt_symbol_word_t), &config);
+}
+
+timed_io_handle_t timed_io_output_init(gpio_num_t gpio, bool idle_level)
+{
+    for(timed_io_handle_t handle = 0; handle < TIMED_IO_OUTPUTS; handle++)
+    {
+        timed_io_output_t *output = &timed_io_outputs[handle];
+        if(output->used)
+            continue;
+
+        const rmt_tx_channel_config_t channel_config =
+        {
+            .gpio_num = gpio,
+            .clk_src = RMT_CLK_SRC_DEFAULT,
+            .resolution_hz = TIMED_IO_RESOLUTION_HZ,
+            .mem_block_symbols = 48,
+            .trans_queue_depth = 1
+        };
+        const rmt_copy_encoder_config_t encoder_config = {};
+        const rmt_tx_event_callbacks_t callbacks = { .on_trans_done = timed_io_output_done };
+        if(rmt_new_tx_channel(&channel_config, &output->channel) != ESP_OK)
+            return -1;
+        if(rmt_new_copy_encoder(&encoder_config, &output->encoder) != ESP_OK ||
+           rmt_tx_register_event_callbacks(output->channel, &callbacks, output) != ESP_OK || rmt_enable(output->channel) != ESP_OK)
+        {
+            if(output->encoder)
+                rmt_del_encoder(output->encoder);
+            rmt_del_channel(output->channel);
+            memset(output, 0, sizeof(timed_io_output_t));
+            return -1;
+        }
+        output->used = true;
+
+        //park the pin on its idle level
+        output->level = idle_level;
+        output->halves = 0;
+        output->ticks = 0;
+        timed_io_output_put(output, idle_level, 1);
+        timed_io_output_play(output, idle_level);
+        return handle;
+    }
+    ESP_LOGW(TAG, "No RMT channel left for GPIO %d", gpio);
+    return -1;
+}
+
+void timed_io_output_release(timed_io_handle_t handle)
+{
+    if(handle < 0 || handle >= TIMED_IO_OUTPUTS || !timed_io_outputs[handle].used)
+        return;
+    timed_io_output_t *output = &timed_io_outputs[handle];
+    rmt_disable(output->channel);
+    rmt_del_encoder(output->encoder);
+    rmt_del_channel(output->channel);
+    memset(output, 0, sizeof(timed_io_output_t));
+}
+
+esp_err_t timed_io_output_schedule(timed_io_handle_t handle, const timed_io_edge_t *edges, size_t count)
+{
+    if(handle < 0 || handle >= TIMED_IO_OUTPUTS || !timed_io_outputs[handle].used || count == 0 || count > TIMED_IO_MAX_EDGES)
+        return ESP_ERR_INVALID_ARG;
+    timed_io_output_t *output = &timed_io_outputs[handle];
+    //the symbols of a playing list are still being read by the driver
+    if(rmt_tx_wait_all_done(output->channel, 0) != ESP_OK)
+        return ESP_ERR_INVALID_STATE;
+
+    //edges are placed in ticks from where the list is expected to start, so rounding never accumulates along the list.
+    //the done event of the last list has run by now, its estimate is current
+    const int64_t start_ns = esp_timer_get_time() * 1000 + output->latency_ns;
+    if(edges[0].time_ns < start_ns + TIMED_IO_LEAD_NS)
+        return ESP_ERR_INVALID_ARG;
+    bool level = output->level;
+    uint64_t tick = 0;
+    output->halves = 0;
+    output->ticks = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(i > 0 && edges[i].time_ns < edges[i - 1].time_ns)
+            return ESP_ERR_INVALID_ARG;
+        const uint64_t edge_tick = (uint64_t)(edges[i].time_ns - start_ns) / TIMED_IO_NS_PER_TICK;
+        if(!timed_io_output_hold(output, level, edge_tick - tick))
+            return ESP_ERR_INVALID_SIZE;
+        tick = edge_tick;
+        level = edges[i].level;
+    }
+    //drive the final level for a tick, the end of transmission level keeps it there
+    if(!timed_io_output_put(output, level, 1))
+        return ESP_ERR_INVALID_SIZE;
+
+    output->start_ns = start_ns;
+    output->measure = true;
+    esp_err_t ret = timed_io_output_play(output, level);
+    if(ret == ESP_OK)
+        output->level = level;
+    else
+        output->measure = false;
+    return ret;
+}
+
+static bool IRAM_ATTR timed_io_capture_edge(mcpwm_cap_channel_handle_t channel, const mcpwm_capture_event_data_t *event, void *arg)
+{
+    timed_io_capture_t *capture = (timed_io_capture_t *)arg;
+    __atomic_add_fetch(&capture->sequence, 1, __ATOMIC_SEQ_CST);
+    if(event->cap_edge == MCPWM_CAP_EDGE_POS)
+    {
+        if(capture->has_rise)
+            capture->period_ticks = event->cap_value - capture->rise;
+        capture->rise = event->cap_value;
+        capture->has_rise = true;
+    }
+    else if(capture->has_rise)
+    {
+        capture->pulse_ticks = event->cap_value - capture->rise;
+    }
+    capture->last_edge_us = esp_timer_get_time();
+    __atomic_add_fetch(&capture->sequence, 1, __ATOMIC_SEQ_CST);
+    return false;
+}
+
+timed_io_handle_t timed_io_capture_init(gpio_num_t gpio, uint32_t timeout_us)
+{
+    if(timed_io_capture_timer == NULL)
+    {
+        const mcpwm_capture_timer_config_t timer_config = { .group_id = 0, .clk_src = MCPWM_CAPTURE_CLK_SRC_DEFAULT };
+        if(mcpwm_new_capture_timer(&timer_config, &timed_io_capture_timer) != ESP_OK)
+            return -1;
+        mcpwm_capture_timer_get_resolution(timed_io_capture_timer, &timed_io_capture_resolution);
+        mcpwm_capture_timer_enable(timed_io_capture_timer);
+        mcpwm_capture_timer_start(timed_io_capture_timer);
+    }
+
+    for(timed_io_handle_t handle = 0; handle < TIMED_IO_CAPTURES; handle++)
+    {
+        timed_io_capture_t *capture = &timed_io_captures[handle];
+        if(capture->used)
+            continue;
+
+        const mcpwm_capture_channel_config_t channel_config =
+        {
+            .gpio_num = gpio,
+            .prescale = 1,
+            .flags = { .pos_edge = true, .neg_edge = true }
+        };
+        memset(capture, 0, sizeof(timed_io_capture_t));
+        capture->timeout_us = timeout_us;
+        if(mcpwm_new_capture_channel(timed_io_capture_timer, &channel_config, &capture->channel) != ESP_OK)
+            return -1;
+        const mcpwm_capture_event_callbacks_t callbacks = { .on_cap = timed_io_capture_edge };
+        if(mcpwm_capture_channel_register_event_callbacks(capture->channel, &callbacks, capture) != ESP_OK ||
+           mcpwm_capture_channel_enable(capture->channel) != ESP_OK)
+        {
+            mcpwm_del_capture_channel(capture->channel);
+            memset(capture, 0, sizeof(timed_io_capture_t));
+            return -1;
+        }
+        capture->used = true;
+        return handle;
+    }
+    ESP_LOGW(TAG, "No MCPWM capture channel left for GPIO %d", gpio);
+    return -1;
+}
+
+void timed_io_capture_release(timed_io_handle_t handle)
+{
+    if(handle < 0 || handle >= TIMED_IO_CAPTURES || !timed_io_captures[handle].used)
+        return;
+    timed_io_capture_t *capture = &timed_io_captures[handle];
+    mcpwm_capture_channel_disable(capture->channel);
+    mcpwm_del_capture_channel(capture->channel);
+    memset(capture, 0, sizeof(timed_io_capture_t));
+}
+
+bool timed_io_capture_read(timed_io_handle_t handle, float *period, float *pulse_width)
+{
+    *period = 0;
+    *pulse_width = 0;
+    if(handle < 0 || handle >= TIMED_IO_CAPTURES || !timed_io_captures[handle].used)
+        return false;
+    const timed_io_capture_t *capture = &timed_io_captures[handle];
+
+    uint32_t sequence;
+    uint32_t period_ticks;
+    uint32_t pulse_ticks;
+    int64_t last_edge_us;
+    do
+    {
+        sequence = __atomic_load_n(&capture->sequence, __ATOMIC_SEQ_CST);
+        period_ticks = capture->period_ticks;
+        pulse_ticks = capture->pulse_ticks;
+        last_edge_us = capture->last_edge_us;
+    } while((sequence & 1) != 0 || __atomic_load_n(&capture->sequence, __ATOMIC_SEQ_CST) != sequence);
+
+    if(period_ticks == 0 || esp_timer_get_time() - last_edge_us > capture->timeout_us)
+        return false;
+    *period = (float)period_ticks / timed_io_capture_resolution;
+    *pulse_width = (float)pulse_ticks / timed_io_capture_resolution;
+    return true;
+}
@@ -0,0 +1,51 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "driver/gpio.h"
+
+#ifndef TIMED_IO_H
+#define TIMED_IO_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TIMED_IO_OUTPUTS 2 //RMT TX channels on the C6
+#define TIMED_IO_CAPTURES 3 //MCPWM capture channels on the C6
+#define TIMED_IO_RESOLUTION_HZ 10000000 //RMT tick, edges land on 100 ns
+#define TIMED_IO_MAX_EDGES 32 //edges per scheduled list
+#define TIMED_IO_LEAD_NS 20000 //the first edge must be at least this far out for the transmit call to make it
+
+// one output edge at an absolute time in the esp_timer timebase, in nanoseconds
+typedef struct
+{
+    int64_t time_ns;
+    bool level;
+} timed_io_edge_t;
+
+// identifier of an output or capture, -1 when none was available
+typedef int8_t timed_io_handle_t;
+
+/* timed outputs. the pin is handed to an RMT TX channel that plays back edge lists, so edges within a list are
+ * placed by hardware relative to its start. the start itself follows the transmit call by a few microseconds, every
+ * finished list measures that latency and the next one is placed by the estimate. the whole list is off by the
+ * jitter of the transmit call, and early by the latency of the done interrupt. the first list goes out uncorrected */
+timed_io_handle_t timed_io_output_init(gpio_num_t gpio, bool idle_level);
+void timed_io_output_release(timed_io_handle_t output);
+// ESP_ERR_INVALID_STATE while the previous list is still playing, ESP_ERR_INVALID_ARG when edges are not in order
+// or the first is closer than TIMED_IO_LEAD_NS
+esp_err_t timed_io_output_schedule(timed_io_handle_t output, const timed_io_edge_t *edges, size_t count);
+
+/* input capture. MCPWM timestamps both edges of the pin in hardware, a short ISR turns them into period and
+ * pulse width. a pin without an edge for timeout_us reads 0 */
+timed_io_handle_t timed_io_capture_init(gpio_num_t gpio, uint32_t timeout_us);
+void timed_io_capture_release(timed_io_handle_t capture);
+// seconds. false when the pin has gone quiet
+bool timed_io_capture_read(timed_io_handle_t capture, float *period, float *pulse_width);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,24 +1,81 @@
-
 #include "uart_listen.h"
 #include "soc/uart_reg.h"
 #include "freertos/semphr.h"
-#include <map>
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "profiler.h"
+#include <atomic>
+#include <stdio.h>
 
-std::map<uint32_t, uart_callback_t> uart_callback_map[UART_NUM_MAX];
-SemaphoreHandle_t uart_callback_map_semaphore[UART_NUM_MAX];
+//per port subscriber snapshots. the uart_listen task only ever reads the published snapshot, add/remove
+//copy it into the other one, publish that and wait for the reader to leave the old one before returning
+typedef struct
+{
+    uint32_t id;
+    uart_listen_callback_t callback;
+    void *context;
+} uart_listen_subscriber_t;
 
-extern "C" {
-    void uart_listen(void *arg)
+typedef struct
+{
+    size_t count;
+    uart_listen_subscriber_t subscribers[UART_LISTEN_MAX_CALLBACKS];
+} uart_listen_table_t;
+
+uart_listen_table_t uart_listen_tables[UART_NUM_MAX][2];
+std::atomic<uint8_t> uart_listen_published[UART_NUM_MAX];
+std::atomic<uint8_t> uart_listen_reading[UART_NUM_MAX]; //table + 1 the reader is in, 0 when not reading
+std::atomic<uint32_t> uart_listen_callback_id(1);
+
+uart_listen_config_t uart_listen_configs[UART_NUM_MAX];
+bool uart_listen_configured[UART_NUM_MAX];
+bool uart_listen_started[UART_NUM_MAX];
+QueueHandle_t uart_listen_queues[UART_NUM_MAX];
+
+static SemaphoreHandle_t uart_listen_writer_lock()
+{
+    static StaticSemaphore_t buffer;
+    static SemaphoreHandle_t lock = xSemaphoreCreateMutexStatic(&buffer);
+    return lock;
+}
+
+static void uart_listen_dispatch(uart_port_t uart_num, const uint8_t *data, size_t length)
+{
+    const uint32_t startCycles = profiler_start();
+    uint8_t table = uart_listen_published[uart_num].load();
+    uart_listen_reading[uart_num].store(table + 1);
+    //a writer may have published and missed the announcement, so follow it to the new table
+    const uint8_t published = uart_listen_published[uart_num].load();
+    if(published != table)
     {
-        uart_listen_config_t *config = (uart_listen_config_t *)arg;
-        uart_callback_map_semaphore[config->uart_num] = xSemaphoreCreateBinary();
-        xSemaphoreGive(uart_callback_map_semaphore[config->uart_num]);
+        table = published;
+        uart_listen_reading[uart_num].store(table + 1);
+    }
+
+    const uart_listen_table_t *snapshot = &uart_listen_tables[uart_num][table];
+    for(size_t i = 0; i < snapshot->count; i++)
+        snapshot->subscribers[i].callback(snapshot->subscribers[i].context, data, length);
+
+    uart_listen_reading[uart_num].store(0);
+    profiler_count(PROFILER_COUNTER_UART_BYTES, length);
+    profiler_end(PROFILER_STAGE_UART_DISPATCH, startCycles);
+}
 
-        if(!uart_is_driver_installed(config->uart_num))
-            ESP_ERROR_CHECK(uart_driver_install(config->uart_num, config->rx_buffer_size, config->tx_buffer_size, 0, NULL, ESP_INTR_FLAG_IRAM));
+//publish the edited inactive table and wait until the reader is out of the old one
+static void uart_listen_publish(uart_port_t uart_num, uint8_t table)
+{
+    const uint8_t old = table ^ 1;
+    uart_listen_published[uart_num].store(table);
+    while(uart_listen_reading[uart_num].load() == old + 1)
+        vTaskDelay(1);
+}
+
+extern "C" {
+    static void uart_listen_poll(uart_listen_config_t *config)
+    {
         ESP_ERROR_CHECK(uart_set_rx_full_threshold(config->uart_num, 1));
 
-        uint8_t rx_buffer[config->rx_buffer_size];
+        uint8_t rx_buffer[UART_LISTEN_CHUNK_SIZE];
         while (1) 
         {
             // Read data from the UART. have to do this weird read stuff below because read bytes tries to get all the bytes requested before timing out. not just what's available
@@ -27,44 +84,171 @@ extern "C" {
             uart_get_buffered_data_len(config->uart_num, &bufferedLen);
             if(bufferedLen > 0) 
             {
-                len += uart_read_bytes(config->uart_num, rx_buffer + 1, bufferedLen > (config->rx_buffer_size - 1)? (config->rx_buffer_size - 1): bufferedLen, pdMS_TO_TICKS(1000));
+                len += uart_read_bytes(config->uart_num, rx_buffer + 1, bufferedLen > (sizeof(rx_buffer) - 1)? (sizeof(rx_buffer) - 1): bufferedLen, pdMS_TO_TICKS(1000));
             }
             // Write data to functions
             if (len) 
+                uart_listen_dispatch(config->uart_num, rx_buffer, len);
+        }
+    }
+
+    static void uart_listen_events(uart_listen_config_t *config, QueueHandle_t queue)
+    {
+        ESP_ERROR_CHECK(uart_set_rx_full_threshold(config->uart_num, config->rx_full_threshold));
+        ESP_ERROR_CHECK(uart_set_rx_timeout(config->uart_num, config->rx_timeout));
+
+        uint8_t rx_buffer[UART_LISTEN_CHUNK_SIZE];
+        uart_event_t event;
+        while (1) 
+        {
+            if(xQueueReceive(queue, &event, portMAX_DELAY) != pdTRUE)
+                continue;
+            switch(event.type)
             {
-                if(xSemaphoreTake(uart_callback_map_semaphore[config->uart_num], pdMS_TO_TICKS(100)) != pdTRUE)
-                    continue;
-                const auto begin = uart_callback_map[config->uart_num].begin();
-                const auto end = uart_callback_map[config->uart_num].end();
-                auto next = begin;
-                while(next != end)
+                case UART_DATA:
                 {
-                    next->second(rx_buffer, len);
-                    next++;
+                    // drain everything buffered so far, a single event can stand for several FIFO reads
+                    size_t bufferedLen = 0;
+                    uart_get_buffered_data_len(config->uart_num, &bufferedLen);
+                    while(bufferedLen > 0)
+                    {
+                        const int len = uart_read_bytes(config->uart_num, rx_buffer, bufferedLen > sizeof(rx_buffer)? sizeof(rx_buffer) : bufferedLen, 0);
+                        if(len <= 0)
+                            break;
+                        uart_listen_dispatch(config->uart_num, rx_buffer, len);
+                        bufferedLen -= (size_t)len > bufferedLen? bufferedLen : (size_t)len;
+                    }
+                    break;
                 }
-                xSemaphoreGive(uart_callback_map_semaphore[config->uart_num]);
+                case UART_FIFO_OVF:
+                case UART_BUFFER_FULL:
+                    ESP_LOGW("UART_LISTEN", "uart %d rx overflow", config->uart_num);
+                    uart_flush_input(config->uart_num);
+                    xQueueReset(queue);
+                    break;
+                default:
+                    break;
             }
         }
     }
-}
 
-uint32_t callback_id_iterator = 1;
+    static void uart_listen(void *arg)
+    {
+        uart_listen_config_t *config = (uart_listen_config_t *)arg;
+        QueueHandle_t queue = uart_listen_queues[config->uart_num];
 
-uint32_t uart_listen_add_callback(uart_port_t uart_num, uart_callback_t callback)
-{
-    if(xSemaphoreTake(uart_callback_map_semaphore[uart_num], pdMS_TO_TICKS(1000)) != pdTRUE)
-        return 0;
-    uint32_t callback_id = callback_id_iterator++;
-    uart_callback_map[uart_num].insert({callback_id, callback});
-    xSemaphoreGive(uart_callback_map_semaphore[uart_num]);
-    return callback_id;
+        if(queue != NULL)
+            uart_listen_events(config, queue);
+        else
+            uart_listen_poll(config);
+    }
+
+    esp_err_t uart_listen_configure(const uart_listen_config_t *config)
+    {
+        if(config->uart_num >= UART_NUM_MAX)
+            return ESP_ERR_INVALID_ARG;
+        if(xSemaphoreTake(uart_listen_writer_lock(), portMAX_DELAY) != pdTRUE)
+            return ESP_ERR_TIMEOUT;
+        esp_err_t err = ESP_ERR_INVALID_STATE;
+        if(!uart_listen_started[config->uart_num])
+        {
+            uart_listen_configs[config->uart_num] = *config;
+            uart_listen_configured[config->uart_num] = true;
+            err = ESP_OK;
+        }
+        xSemaphoreGive(uart_listen_writer_lock());
+        return err;
+    }
+
+    //must be called with the writer lock held
+    static esp_err_t uart_listen_start_locked(uart_port_t uart_num)
+    {
+        if(uart_listen_started[uart_num])
+            return ESP_OK;
+
+        uart_listen_config_t *config = &uart_listen_configs[uart_num];
+        if(!uart_listen_configured[uart_num])
+        {
+            *config = {
+                .uart_num = uart_num,
+                .rx_buffer_size = UART_LISTEN_DEFAULT_RX_BUFFER_SIZE,
+                .tx_buffer_size = 0,
+                .event_queue_size = UART_LISTEN_DEFAULT_EVENT_QUEUE_SIZE,
+                .rx_full_threshold = UART_LISTEN_DEFAULT_RX_FULL_THRESHOLD,
+                .rx_timeout = UART_LISTEN_DEFAULT_RX_TIMEOUT,
+                .stack_size = UART_LISTEN_DEFAULT_STACK_SIZE,
+                .priority = UART_LISTEN_DEFAULT_PRIORITY
+            };
+        }
+
+        //a driver installed elsewhere has no event queue for us, so that port falls back to polling
+        if(!uart_is_driver_installed(uart_num))
+        {
+            const esp_err_t err = uart_driver_install(uart_num, config->rx_buffer_size, config->tx_buffer_size, config->event_queue_size, config->event_queue_size > 0? &uart_listen_queues[uart_num] : NULL, ESP_INTR_FLAG_IRAM);
+            if(err != ESP_OK)
+                return err;
+        }
+
+        char name[16];
+        snprintf(name, sizeof(name), "uart_listen_%d", uart_num);
+        if(xTaskCreate(uart_listen, name, config->stack_size, config, config->priority, NULL) != pdPASS)
+            return ESP_ERR_NO_MEM;
+        uart_listen_started[uart_num] = true;
+        return ESP_OK;
+    }
+
+    esp_err_t uart_listen_start(uart_port_t uart_num)
+    {
+        if(uart_num >= UART_NUM_MAX)
+            return ESP_ERR_INVALID_ARG;
+        if(xSemaphoreTake(uart_listen_writer_lock(), portMAX_DELAY) != pdTRUE)
+            return ESP_ERR_TIMEOUT;
+        const esp_err_t err = uart_listen_start_locked(uart_num);
+        xSemaphoreGive(uart_listen_writer_lock());
+        return err;
+    }
+
+    uint32_t uart_listen_add_callback(uart_port_t uart_num, uart_listen_callback_t callback, void *context)
+    {
+        if(uart_num >= UART_NUM_MAX)
+            return 0;
+        if(xSemaphoreTake(uart_listen_writer_lock(), portMAX_DELAY) != pdTRUE)
+            return 0;
+        uint32_t callback_id = 0;
+        if(uart_listen_start_locked(uart_num) != ESP_OK)
+        {
+            xSemaphoreGive(uart_listen_writer_lock());
+            return 0;
+        }
+        const uint8_t table = uart_listen_published[uart_num].load() ^ 1;
+        uart_listen_table_t *next = &uart_listen_tables[uart_num][table];
+        *next = uart_listen_tables[uart_num][table ^ 1];
+        if(next->count < UART_LISTEN_MAX_CALLBACKS)
+        {
+            callback_id = uart_listen_callback_id++;
+            next->subscribers[next->count++] = { callback_id, callback, context };
+            uart_listen_publish(uart_num, table);
+        }
+        xSemaphoreGive(uart_listen_writer_lock());
+        return callback_id;
+    }
+
+    void uart_listen_remove_callback(uart_port_t uart_num, uint32_t callback_id)
+    {
+        if(callback_id == 0)
+            return;
+        if(xSemaphoreTake(uart_listen_writer_lock(), portMAX_DELAY) != pdTRUE)
+            return;
+        const uint8_t table = uart_listen_published[uart_num].load() ^ 1;
+        uart_listen_table_t *next = &uart_listen_tables[uart_num][table];
+        const uart_listen_table_t *current = &uart_listen_tables[uart_num][table ^ 1];
+        next->count = 0;
+        for(size_t i = 0; i < current->count; i++)
+        {
+            if(current->subscribers[i].id != callback_id)
+                next->subscribers[next->count++] = current->subscribers[i];
+        }
+        uart_listen_publish(uart_num, table);
+        xSemaphoreGive(uart_listen_writer_lock());
+    }
 }
-void uart_listen_remove_callback(uart_port_t uart_num, uint32_t callback_id)
-{
-    if(callback_id == 0)
-        return;
-    if(xSemaphoreTake(uart_callback_map_semaphore[uart_num], pdMS_TO_TICKS(1000)) != pdTRUE)
-        return;
-    uart_callback_map[uart_num].erase(callback_id);
-    xSemaphoreGive(uart_callback_map_semaphore[uart_num]);
-}
\ No newline at end of file
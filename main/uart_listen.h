@@ -3,26 +3,48 @@
 #ifndef UART_LISTEN_H
 #define UART_LISTEN_H
 
-#ifdef __cplusplus
-#include <stdio.h>
-#include <functional>
+#define UART_LISTEN_MAX_CALLBACKS 4 //subscribers per port
+#define UART_LISTEN_CHUNK_SIZE 256 //largest chunk handed to the callbacks at once
 
-typedef std::function<void(const uint8_t *, size_t)> uart_callback_t;
-uint32_t uart_listen_add_callback(uart_port_t uart_num, uart_callback_t callback);
-void uart_listen_remove_callback(uart_port_t uart_num, uint32_t callback_id);
+//used for ports that were never given a config through uart_listen_configure
+#define UART_LISTEN_DEFAULT_RX_BUFFER_SIZE 512
+#define UART_LISTEN_DEFAULT_EVENT_QUEUE_SIZE 8
+#define UART_LISTEN_DEFAULT_RX_FULL_THRESHOLD 64
+#define UART_LISTEN_DEFAULT_RX_TIMEOUT 2
+#define UART_LISTEN_DEFAULT_STACK_SIZE 3072
+#define UART_LISTEN_DEFAULT_PRIORITY 10
+
+#ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef void (*uart_listen_callback_t)(void *context, const uint8_t *data, size_t length);
+
 typedef struct 
 {
     uart_port_t uart_num;
     size_t rx_buffer_size;
     size_t tx_buffer_size;
+    int event_queue_size; //0 polls the driver byte by byte, otherwise whole chunks are delivered per UART_DATA event
+    uint8_t rx_full_threshold; //bytes in the RX FIFO that raise a UART_DATA event
+    uint8_t rx_timeout; //idle symbol times after which a partially filled RX FIFO raises a UART_DATA event
+    uint32_t stack_size; //stack of the listener task
+    UBaseType_t priority; //priority of the listener task
 } uart_listen_config_t;
-void uart_listen(void *arg);
+
+//sets the driver buffers and listener task used for a port. nothing is created until the port is started
+esp_err_t uart_listen_configure(const uart_listen_config_t *config);
+//installs the driver and creates the listener task of the port if that hasn't happened yet.
+//adding a callback starts the port, so this is only needed when the driver must exist before that
+esp_err_t uart_listen_start(uart_port_t uart_num);
+
+//callbacks are called from the uart_listen task of the port and must not block.
+//once remove returns the callback is no longer running and won't be called again
+uint32_t uart_listen_add_callback(uart_port_t uart_num, uart_listen_callback_t callback, void *context);
+void uart_listen_remove_callback(uart_port_t uart_num, uint32_t callback_id);
 
 #ifdef __cplusplus
 }
 #endif
 
-#endif
\ No newline at end of file
+#endif